@@ -0,0 +1,313 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Community
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <QBuffer>
+#include <QColorSpace>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QTest>
+
+#include <cmath>
+
+Q_DECLARE_METATYPE(QImage::Format)
+
+class ExrTests : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QCoreApplication::addLibraryPath(QStringLiteral(PLUGIN_DIR));
+    }
+
+    void testFloatFormat_data()
+    {
+        QTest::addColumn<int>("quality");
+        QTest::addColumn<QImage::Format>("format");
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+        QTest::newRow("half float") << 0 << QImage::Format_RGBA16FPx4_Premultiplied;
+        QTest::newRow("half float (quality 99)") << 99 << QImage::Format_RGBA16FPx4_Premultiplied;
+        QTest::newRow("float") << 100 << QImage::Format_RGBA32FPx4_Premultiplied;
+#else
+        QTest::newRow("unsupported") << 0 << QImage::Format_Invalid;
+#endif
+    }
+
+    void testFloatFormat()
+    {
+#if QT_VERSION < QT_VERSION_CHECK(6, 2, 0)
+        QSKIP("Float formats require Qt 6.2");
+#else
+        QFETCH(int, quality);
+        QFETCH(QImage::Format, format);
+
+        QImageReader reader(QFINDTESTDATA("read/exr/rgba-half.exr"));
+        reader.setQuality(quality);
+        QCOMPARE(reader.imageFormat(), format);
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.size(), QSize(8, 4));
+        QCOMPARE(img.format(), format);
+        QCOMPARE(img.colorSpace(), QColorSpace(QColorSpace::SRgbLinear));
+
+        // the half values of the file are exact in both formats: red is
+        // (x + 1) / 16, green (y + 1) / 8, blue 0.25 and alpha 1 on the first
+        // two lines and 0.75 on the others
+        img.convertTo(QImage::Format_RGBA32FPx4_Premultiplied);
+        for (int y = 0; y < img.height(); ++y) {
+            auto line = reinterpret_cast<const float *>(img.constScanLine(y));
+            for (int x = 0; x < img.width(); ++x) {
+                QCOMPARE(line[x * 4], (x + 1) / 16.f);
+                QCOMPARE(line[x * 4 + 1], (y + 1) / 8.f);
+                QCOMPARE(line[x * 4 + 2], 0.25f);
+                QCOMPARE(line[x * 4 + 3], y < 2 ? 1.f : 0.75f);
+            }
+        }
+#endif
+    }
+
+    void testDefaultFormat()
+    {
+        // the tone mapped image has no alpha
+        QImageReader reader(QFINDTESTDATA("read/exr/rgba-half.exr"));
+        QCOMPARE(reader.imageFormat(), QImage::Format_RGB32);
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.format(), QImage::Format_RGB32);
+        QCOMPARE(img, QImage(QFINDTESTDATA("read/exr/rgba-half.png")).convertToFormat(QImage::Format_RGB32));
+    }
+
+    void testTiledClipRect_data()
+    {
+        QTest::addColumn<QRect>("clipRect");
+
+        QTest::newRow("tiles") << QRect(8, 16, 16, 8);
+        QTest::newRow("partial tiles") << QRect(5, 3, 20, 18);
+        QTest::newRow("bottom right") << QRect(27, 30, 5, 2);
+    }
+
+    void testTiledClipRect()
+    {
+        QFETCH(QRect, clipRect);
+
+        // only the tiles which intersect the rectangle are decoded
+        QImageReader reader(QFINDTESTDATA("read/exr/tiled-mip.exr"));
+        reader.setClipRect(clipRect);
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.size(), clipRect.size());
+        QCOMPARE(img, QImage(QFINDTESTDATA("read/exr/tiled-mip.png")).convertToFormat(QImage::Format_RGB32).copy(clipRect));
+    }
+
+    void testTiledScaledSize()
+    {
+        // the levels of the file have different pixels: the half size image
+        // is the level 1 and not the scaled level 0
+        QImageReader reader(QFINDTESTDATA("read/exr/tiled-mip.exr"));
+        reader.setScaledSize(QSize(16, 16));
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img, QImage(QFINDTESTDATA("read/exr/tiled-mip-level1.png")).convertToFormat(QImage::Format_RGB32));
+
+        // the level not smaller than the scaled size is scaled down
+        QImageReader reader2(QFINDTESTDATA("read/exr/tiled-mip.exr"));
+        reader2.setScaledSize(QSize(12, 10));
+        QVERIFY(reader2.read(&img));
+        QCOMPARE(img.size(), QSize(12, 10));
+    }
+
+    void testTiledClipRectAndScaledSize()
+    {
+        // the clip rectangle is mapped to the coordinates of the level 1
+        QImageReader reader(QFINDTESTDATA("read/exr/tiled-mip.exr"));
+        reader.setClipRect(QRect(8, 8, 16, 16));
+        reader.setScaledSize(QSize(8, 8));
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img, QImage(QFINDTESTDATA("read/exr/tiled-mip-level1.png")).convertToFormat(QImage::Format_RGB32).copy(4, 4, 8, 8));
+    }
+
+    void testMetadata()
+    {
+        QImageReader reader(QFINDTESTDATA("read/exr/metadata.exr"));
+
+        // the texts are read from the header before the image
+        QCOMPARE(reader.text(QStringLiteral("Author")), QStringLiteral("KDE Community"));
+        QCOMPARE(reader.text(QStringLiteral("Comment")), QStringLiteral("Metadata test image"));
+        // capDate is local time and utcOffset the seconds to add to get UTC
+        QCOMPARE(reader.text(QStringLiteral("CreationDate")), QStringLiteral("2023-05-01T10:30:00-02:00"));
+        QCOMPARE(reader.text(QStringLiteral("project")), QStringLiteral("kimageformats"));
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.text(QStringLiteral("Author")), QStringLiteral("KDE Community"));
+        QCOMPARE(img.text(QStringLiteral("Comment")), QStringLiteral("Metadata test image"));
+        QCOMPARE(img.text(QStringLiteral("CreationDate")), QStringLiteral("2023-05-01T10:30:00-02:00"));
+        QCOMPARE(img.text(QStringLiteral("project")), QStringLiteral("kimageformats"));
+        QVERIFY(img.text(QStringLiteral("name")).isEmpty());
+
+        // xDensity is in pixels per inch
+        QCOMPARE(img.dotsPerMeterX(), qRound(144 / 0.0254));
+        QCOMPARE(img.dotsPerMeterY(), qRound(144 / 0.0254));
+
+        QCOMPARE(img, QImage(QFINDTESTDATA("read/exr/metadata.png")).convertToFormat(QImage::Format_RGB32));
+    }
+
+    void testChromaticities()
+    {
+#if QT_VERSION < QT_VERSION_CHECK(6, 2, 0)
+        QSKIP("Float formats require Qt 6.2");
+#else
+        // the float images are linear with the primaries of the file (Rec. 2020)
+        QImageReader reader(QFINDTESTDATA("read/exr/metadata.exr"));
+        reader.setQuality(100);
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        const QColorSpace cs = img.colorSpace();
+        QVERIFY(cs.isValid());
+        QCOMPARE(cs.transferFunction(), QColorSpace::TransferFunction::Linear);
+        QVERIFY(cs != QColorSpace(QColorSpace::SRgbLinear));
+#endif
+    }
+
+    void testImages_data()
+    {
+        QTest::addColumn<QString>("fileName");
+        QTest::addColumn<QString>("secondImage");
+
+        // the RGBA view and the diffuse layer
+        QTest::newRow("layers") << QStringLiteral("layers") << QStringLiteral("layers-diffuse");
+        // the RGBA part and the depth part (a gray image)
+        QTest::newRow("multi-part") << QStringLiteral("multipart") << QStringLiteral("multipart-depth");
+    }
+
+    void testImages()
+    {
+        QFETCH(QString, fileName);
+        QFETCH(QString, secondImage);
+
+        // the device is left at the end of the data read: the images are
+        // read in sequence and counted afterwards on the same reader
+        QImageReader reader(QFINDTESTDATA(QStringLiteral("read/exr/") + fileName + QStringLiteral(".exr")));
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img, QImage(QFINDTESTDATA(QStringLiteral("read/exr/") + fileName + QStringLiteral(".png"))).convertToFormat(QImage::Format_RGB32));
+
+        QVERIFY(reader.jumpToNextImage());
+        QCOMPARE(reader.currentImageNumber(), 1);
+        QCOMPARE(reader.size(), QSize(8, 6));
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img, QImage(QFINDTESTDATA(QStringLiteral("read/exr/") + secondImage + QStringLiteral(".png"))).convertToFormat(QImage::Format_RGB32));
+
+        QCOMPARE(reader.imageCount(), 2);
+        QVERIFY(!reader.jumpToNextImage());
+
+        // back to the first image
+        QVERIFY(reader.jumpToImage(0));
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img, QImage(QFINDTESTDATA(QStringLiteral("read/exr/") + fileName + QStringLiteral(".png"))).convertToFormat(QImage::Format_RGB32));
+    }
+
+    void testFloatLayer()
+    {
+#if QT_VERSION < QT_VERSION_CHECK(6, 2, 0)
+        QSKIP("Float formats require Qt 6.2");
+#else
+        // the depth.Z layer has FLOAT samples which are not representable as half
+        QImageReader reader(QFINDTESTDATA("read/exr/float-layer.exr"));
+        reader.setQuality(100);
+        QCOMPARE(reader.imageCount(), 2);
+        QVERIFY(reader.jumpToImage(1));
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.format(), QImage::Format_RGBA32FPx4_Premultiplied);
+        QCOMPARE(img.size(), QSize(8, 6));
+        for (int y = 0; y < img.height(); ++y) {
+            auto line = reinterpret_cast<const float *>(img.constScanLine(y));
+            for (int x = 0; x < img.width(); ++x) {
+                const float z = 1000 + x / 1024.f + y / 8.f;
+                QCOMPARE(line[x * 4], z);
+                QCOMPARE(line[x * 4 + 1], z);
+                QCOMPARE(line[x * 4 + 2], z);
+                QCOMPARE(line[x * 4 + 3], 1.f);
+            }
+        }
+#endif
+    }
+
+    void testImageCountFirst()
+    {
+        QImageReader reader(QFINDTESTDATA("read/exr/multipart.exr"));
+        QCOMPARE(reader.size(), QSize(8, 6));
+        QCOMPARE(reader.imageCount(), 2);
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img, QImage(QFINDTESTDATA("read/exr/multipart.png")).convertToFormat(QImage::Format_RGB32));
+    }
+
+    void testWriteUntagged_data()
+    {
+        QTest::addColumn<QColorSpace>("colorSpace");
+
+        QTest::newRow("untagged") << QColorSpace();
+        QTest::newRow("sRGB") << QColorSpace(QColorSpace::SRgb);
+    }
+
+    void testWriteUntagged()
+    {
+#if QT_VERSION < QT_VERSION_CHECK(6, 2, 0)
+        QSKIP("Float formats require Qt 6.2");
+#else
+        QFETCH(QColorSpace, colorSpace);
+
+        // the 8-bit images without a colorspace are sRGB: the values are
+        // linearized as the ones of the sRGB images
+        QImage image(4, 4, QImage::Format_RGB32);
+        image.fill(qRgb(128, 64, 192));
+        image.setColorSpace(colorSpace);
+
+        QByteArray data;
+        QBuffer buffer(&data);
+        QVERIFY(buffer.open(QIODevice::WriteOnly));
+        QImageWriter writer(&buffer, "exr");
+        QVERIFY(writer.write(image));
+        buffer.close();
+
+        QVERIFY(buffer.open(QIODevice::ReadOnly));
+        QImageReader reader(&buffer, "exr");
+        reader.setQuality(100);
+        QImage img;
+        QVERIFY(reader.read(&img));
+        img.convertTo(QImage::Format_RGBA32FPx4);
+
+        auto line = reinterpret_cast<const float *>(img.constScanLine(2));
+        auto linear = [](int v) {
+            const double c = v / 255.0;
+            return c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+        };
+        // the samples are stored as half
+        QVERIFY(qAbs(line[4] - linear(128)) < 0.002);
+        QVERIFY(qAbs(line[5] - linear(64)) < 0.002);
+        QVERIFY(qAbs(line[6] - linear(192)) < 0.002);
+#endif
+    }
+};
+
+QTEST_MAIN(ExrTests)
+
+#include "exrtest.moc"
@@ -0,0 +1,246 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Community
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <QBuffer>
+#include <QColorSpace>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QTest>
+
+#include <cmath>
+
+Q_DECLARE_METATYPE(QImage::Format)
+
+// compares the channels of two images of the same format with a tolerance
+template<class T>
+static bool imgEquals(const QImage &im1, const QImage &im2, int fuzziness = 0)
+{
+    if (im1.size() != im2.size() || im1.format() != im2.format()) {
+        return false;
+    }
+    const int count = im1.width() * im1.depth() / (8 * int(sizeof(T)));
+    for (int y = 0; y < im1.height(); ++y) {
+        auto line1 = reinterpret_cast<const T *>(im1.constScanLine(y));
+        auto line2 = reinterpret_cast<const T *>(im2.constScanLine(y));
+        for (int x = 0; x < count; ++x) {
+            if (qAbs(int(line1[x]) - int(line2[x])) > fuzziness) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+class HdrTests : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QCoreApplication::addLibraryPath(QStringLiteral(PLUGIN_DIR));
+    }
+
+    void testDefaultFormat()
+    {
+        QImageReader reader(QFINDTESTDATA("read/hdr/gradient.hdr"));
+        QVERIFY(reader.canRead());
+        QCOMPARE(reader.size(), QSize(16, 12));
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.format(), QImage::Format_RGB32);
+
+        const QImage expected = QImage(QFINDTESTDATA("read/hdr/gradient.png")).convertToFormat(QImage::Format_RGB32);
+        QVERIFY(imgEquals<quint8>(img, expected));
+    }
+
+    void testFloatFormat_data()
+    {
+        QTest::addColumn<int>("quality");
+        QTest::addColumn<QImage::Format>("format");
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+        QTest::newRow("half float") << 0 << QImage::Format_RGBX16FPx4;
+        QTest::newRow("half float (quality 99)") << 99 << QImage::Format_RGBX16FPx4;
+        QTest::newRow("float") << 100 << QImage::Format_RGBX32FPx4;
+#else
+        QTest::newRow("unsupported") << 0 << QImage::Format_Invalid;
+#endif
+    }
+
+    void testFloatFormat()
+    {
+#if QT_VERSION < QT_VERSION_CHECK(6, 2, 0)
+        QSKIP("Float formats require Qt 6.2");
+#endif
+        QFETCH(int, quality);
+        QFETCH(QImage::Format, format);
+
+        QImageReader reader(QFINDTESTDATA("read/hdr/gradient.hdr"));
+        reader.setQuality(quality);
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.format(), format);
+        QCOMPARE(img.colorSpace(), QColorSpace(QColorSpace::SRgbLinear));
+
+        // the expected image has the linear values of the pixels (all lower than 1) in 16 bits
+        const QImage expected = QImage(QFINDTESTDATA("read/hdr/gradient-linear.png")).convertToFormat(QImage::Format_RGBX64);
+        QVERIFY(imgEquals<quint16>(img.convertToFormat(QImage::Format_RGBX64), expected, 2));
+    }
+
+    void testClipRect_data()
+    {
+        QTest::addColumn<QString>("fileName");
+        QTest::addColumn<QRect>("clipRect");
+
+        QTest::newRow("gradient") << QStringLiteral("gradient") << QRect(3, 2, 9, 7);
+        QTest::newRow("gradient (bottom right)") << QStringLiteral("gradient") << QRect(10, 6, 6, 6);
+        const QStringList orientations = {QStringLiteral("nX-nY"),
+                                          QStringLiteral("nX-pY"),
+                                          QStringLiteral("nY-nX"),
+                                          QStringLiteral("pX-nY"),
+                                          QStringLiteral("pX-pY"),
+                                          QStringLiteral("pY-nX"),
+                                          QStringLiteral("pY-pX")};
+        for (const auto &orientation : orientations) {
+            QTest::newRow(qPrintable(orientation)) << QStringLiteral("orientation-") + orientation << QRect(5, 3, 40, 20);
+        }
+    }
+
+    void testClipRect()
+    {
+        QFETCH(QString, fileName);
+        QFETCH(QRect, clipRect);
+
+        QImageReader reader(QFINDTESTDATA(QStringLiteral("read/hdr/") + fileName + QStringLiteral(".hdr")));
+        reader.setClipRect(clipRect);
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.size(), clipRect.size());
+
+        const QImage expected = QImage(QFINDTESTDATA(QStringLiteral("read/hdr/") + fileName + QStringLiteral(".png")))
+                                    .convertToFormat(QImage::Format_RGB32)
+                                    .copy(clipRect);
+        QVERIFY(imgEquals<quint8>(img.convertToFormat(QImage::Format_RGB32), expected));
+    }
+
+    void testScaledSize()
+    {
+        // the image is box filtered while decoding: the expected image has
+        // the averages of the 2x2 blocks of pixels
+        QImageReader reader(QFINDTESTDATA("read/hdr/gradient.hdr"));
+        reader.setScaledSize(QSize(8, 6));
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.size(), QSize(8, 6));
+
+        const QImage expected = QImage(QFINDTESTDATA("read/hdr/gradient-scaled.png")).convertToFormat(QImage::Format_RGB32);
+        QVERIFY(imgEquals<quint8>(img.convertToFormat(QImage::Format_RGB32), expected));
+    }
+
+    void testClipRectAndScaledSize()
+    {
+        QImageReader reader(QFINDTESTDATA("read/hdr/gradient.hdr"));
+        reader.setClipRect(QRect(4, 2, 8, 6));
+        reader.setScaledSize(QSize(4, 3));
+
+        QImage img;
+        QVERIFY(reader.read(&img));
+        QCOMPARE(img.size(), QSize(4, 3));
+
+        const QImage expected = QImage(QFINDTESTDATA("read/hdr/gradient-scaled.png")).convertToFormat(QImage::Format_RGB32).copy(2, 1, 4, 3);
+        QVERIFY(imgEquals<quint8>(img.convertToFormat(QImage::Format_RGB32), expected));
+    }
+
+    void testOldStyleLines_data()
+    {
+        QTest::addColumn<QByteArray>("pixels");
+        QTest::addColumn<bool>("success");
+
+        // 4 pixels per line: too short for the new style RLE
+        QTest::newRow("flat") << QByteArray("\x10\x20\x30\x80\x10\x20\x30\x80\x10\x20\x30\x80\x10\x20\x30\x80"
+                                            "\x40\x50\x60\x80\x40\x50\x60\x80\x40\x50\x60\x80\x40\x50\x60\x80",
+                                            32)
+                              << true;
+        QTest::newRow("run") << QByteArray("\x10\x20\x30\x80\x01\x01\x01\x03\x40\x50\x60\x80\x01\x01\x01\x03", 16) << true;
+        // the image read so far is returned
+        QTest::newRow("truncated") << QByteArray("\x10\x20\x30\x80\x10\x20\x30\x80\x10\x20\x30\x80\x10\x20\x30\x80", 16) << true;
+        QTest::newRow("run without a previous pixel") << QByteArray("\x01\x01\x01\x04\x40\x50\x60\x80\x01\x01\x01\x03", 12) << false;
+    }
+
+    void testOldStyleLines()
+    {
+        QFETCH(QByteArray, pixels);
+        QFETCH(bool, success);
+
+        QByteArray data = QByteArrayLiteral("#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y 2 +X 4\n") + pixels;
+        QBuffer buffer(&data);
+        QVERIFY(buffer.open(QIODevice::ReadOnly));
+
+        QImageReader reader(&buffer, "hdr");
+        QImage img;
+        QCOMPARE(reader.read(&img), success);
+        if (success) {
+            QCOMPARE(img.size(), QSize(4, 2));
+            QCOMPARE(img.pixel(0, 0), qRgb(0x10, 0x20, 0x30));
+        }
+    }
+
+    void testWriteUntagged_data()
+    {
+        QTest::addColumn<QColorSpace>("colorSpace");
+
+        QTest::newRow("untagged") << QColorSpace();
+        QTest::newRow("sRGB") << QColorSpace(QColorSpace::SRgb);
+    }
+
+    void testWriteUntagged()
+    {
+#if QT_VERSION < QT_VERSION_CHECK(6, 2, 0)
+        QSKIP("Float formats require Qt 6.2");
+#else
+        QFETCH(QColorSpace, colorSpace);
+
+        // the 8-bit images without a colorspace are sRGB: the values are
+        // linearized as the ones of the sRGB images
+        QImage image(4, 4, QImage::Format_RGB32);
+        image.fill(qRgb(128, 64, 192));
+        image.setColorSpace(colorSpace);
+
+        QByteArray data;
+        QBuffer buffer(&data);
+        QVERIFY(buffer.open(QIODevice::WriteOnly));
+        QImageWriter writer(&buffer, "hdr");
+        QVERIFY(writer.write(image));
+        buffer.close();
+
+        QVERIFY(buffer.open(QIODevice::ReadOnly));
+        QImageReader reader(&buffer, "hdr");
+        reader.setQuality(100);
+        QImage img;
+        QVERIFY(reader.read(&img));
+
+        auto line = reinterpret_cast<const float *>(img.constScanLine(2));
+        auto linear = [](int v) {
+            const double c = v / 255.0;
+            return c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+        };
+        // the RGBE mantissas have 8 bits
+        QVERIFY(qAbs(line[4] - linear(128)) < 0.01);
+        QVERIFY(qAbs(line[5] - linear(64)) < 0.01);
+        QVERIFY(qAbs(line[6] - linear(192)) < 0.01);
+#endif
+    }
+};
+
+QTEST_MAIN(HdrTests)
+
+#include "hdrtest.moc"
@@ -0,0 +1,244 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Community
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <QBuffer>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QRandomGenerator>
+#include <QTest>
+
+#include "psdkernels_p.h"
+
+Q_DECLARE_METATYPE(QImage::Format)
+
+// an image with noise and flat areas, so that the compressed size of the lines is not uniform
+static QImage testImage(const QSize &size, QImage::Format format)
+{
+    QImage image(size, QImage::Format_RGBA64);
+    QRandomGenerator rng(42);
+    for (int y = 0; y < image.height(); ++y) {
+        auto line = reinterpret_cast<QRgba64 *>(image.scanLine(y));
+        for (int x = 0; x < image.width(); ++x) {
+            if ((x / 64 + y / 64) % 2) {
+                line[x] = QRgba64::fromRgba64(x * 37, y * 53, 0x8000, 0xffff);
+            } else {
+                const quint64 v = rng.generate64();
+                line[x] = QRgba64::fromRgba64(quint16(v), quint16(v >> 16), quint16(v >> 32), quint16(v >> 48) | 0x8000);
+            }
+        }
+    }
+    return image.convertToFormat(format);
+}
+
+// the image decoded with the given number of threads
+static QImage decode(const QByteArray &data, int threads, const QRect &clipRect = QRect())
+{
+    qputenv("KIMAGEFORMATS_THREADS", QByteArray::number(threads));
+    QBuffer buffer;
+    buffer.setData(data);
+    buffer.open(QIODevice::ReadOnly);
+
+    QImageReader reader(&buffer, "psd");
+    if (clipRect.isValid()) {
+        reader.setClipRect(clipRect);
+    }
+    const QImage image = reader.read();
+    qunsetenv("KIMAGEFORMATS_THREADS");
+    return image;
+}
+
+class PsdTests : public QObject
+{
+    Q_OBJECT
+
+private Q_SLOTS:
+    void initTestCase()
+    {
+        QCoreApplication::addLibraryPath(QStringLiteral(PLUGIN_DIR));
+    }
+
+    void testParallelDecoding_data()
+    {
+        QTest::addColumn<QImage::Format>("format");
+        QTest::addColumn<QSize>("size");
+        QTest::addColumn<QRect>("clipRect");
+
+        // the heights are not multiple of the band height
+        QTest::newRow("RGB") << QImage::Format_RGB888 << QSize(1100, 1001) << QRect();
+        QTest::newRow("RGBA") << QImage::Format_RGBA8888 << QSize(1024, 777) << QRect();
+        QTest::newRow("RGBA 16 bits") << QImage::Format_RGBA64 << QSize(640, 999) << QRect();
+        QTest::newRow("Grayscale") << QImage::Format_Grayscale8 << QSize(1500, 1111) << QRect();
+        QTest::newRow("Grayscale 16 bits") << QImage::Format_Grayscale16 << QSize(700, 833) << QRect();
+        QTest::newRow("RGBA clipped") << QImage::Format_RGBA8888 << QSize(1024, 777) << QRect(100, 77, 501, 603);
+    }
+
+    void testParallelDecoding()
+    {
+        QFETCH(QImage::Format, format);
+        QFETCH(QSize, size);
+        QFETCH(QRect, clipRect);
+
+        // the file is written with the RLE compression of the writer
+        QByteArray data;
+        QBuffer buffer(&data);
+        QVERIFY(buffer.open(QIODevice::WriteOnly));
+        QImageWriter writer(&buffer, "psd");
+        QVERIFY2(writer.write(testImage(size, format)), qPrintable(writer.errorString()));
+        buffer.close();
+
+        const QImage single = decode(data, 1, clipRect);
+        QVERIFY(!single.isNull());
+        QCOMPARE(single.size(), clipRect.isValid() ? clipRect.size() : size);
+
+        // the bands of lines decoded by more threads than bands, by fewer
+        // threads than bands and by the default number of threads
+        const int counts[] = {2, 3, 8, 64, 0};
+        for (int threads : counts) {
+            const QImage parallel = decode(data, threads, clipRect);
+            QVERIFY2(parallel == single, qPrintable(QStringLiteral("%1 threads").arg(threads)));
+        }
+    }
+
+    void testLayers_data()
+    {
+        QTest::addColumn<QString>("fileName");
+        QTest::addColumn<QStringList>("names");
+        QTest::addColumn<QStringList>("offsets");
+        QTest::addColumn<QStringList>("blendModes");
+        QTest::addColumn<QStringList>("opacities");
+
+        QTest::newRow("8 bits") << QStringLiteral("layers-nomerged") << QStringList{QStringLiteral("background"), QStringLiteral("square"), QStringLiteral("hidden")}
+                                << QStringList{QStringLiteral("0,0"), QStringLiteral("2,4"), QStringLiteral("0,0")}
+                                << QStringList{QStringLiteral("norm"), QStringLiteral("norm"), QStringLiteral("norm")}
+                                << QStringList{QStringLiteral("255"), QStringLiteral("255"), QStringLiteral("255")};
+        // the layers of the 16-bit documents are in the Lr16 block
+        QTest::newRow("16 bits") << QStringLiteral("layers-nomerged-16bits")
+                                 << QStringList{QStringLiteral("background"), QStringLiteral("window"), QStringLiteral("hidden multiply")}
+                                 << QStringList{QStringLiteral("0,0"), QStringLiteral("5,3"), QStringLiteral("1,2")}
+                                 << QStringList{QStringLiteral("norm"), QStringLiteral("norm"), QStringLiteral("mul ")}
+                                 << QStringList{QStringLiteral("255"), QStringLiteral("255"), QStringLiteral("128")};
+    }
+
+    void testLayers()
+    {
+        QFETCH(QString, fileName);
+        QFETCH(QStringList, names);
+        QFETCH(QStringList, offsets);
+        QFETCH(QStringList, blendModes);
+        QFETCH(QStringList, opacities);
+
+        // image 0 is the merged image, image N is the layer N-1 from the bottom one
+        QImageReader reader(QFINDTESTDATA(QStringLiteral("read/psd/") + fileName + QStringLiteral(".psd")));
+        QCOMPARE(reader.imageCount(), names.size() + 1);
+        for (int i = 1; i < reader.imageCount(); ++i) {
+            QVERIFY(reader.jumpToImage(i));
+            QImage layer;
+            QVERIFY(reader.read(&layer));
+
+            QImage expected(QFINDTESTDATA(QStringLiteral("psd/%1_%2.png").arg(fileName).arg(i)));
+            QVERIFY(!expected.isNull());
+            expected.convertTo(layer.format());
+            QCOMPARE(layer, expected);
+
+            QCOMPARE(layer.text(QStringLiteral("LayerName")), names.at(i - 1));
+            QCOMPARE(layer.text(QStringLiteral("LayerOffset")), offsets.at(i - 1));
+            QCOMPARE(layer.text(QStringLiteral("LayerBlendMode")), blendModes.at(i - 1));
+            QCOMPARE(layer.text(QStringLiteral("LayerOpacity")), opacities.at(i - 1));
+        }
+        QVERIFY(!reader.jumpToImage(reader.imageCount()));
+    }
+
+    void testZip()
+    {
+        // the 16-bit lines are compressed with ZIP with prediction
+        QImageReader reader(QFINDTESTDATA("psd/zip-prediction-16bits.psd"));
+        QImage img;
+#ifdef PSD_HAVE_ZLIB
+        QVERIFY2(reader.read(&img), qPrintable(reader.errorString()));
+        QImage expected(QFINDTESTDATA("psd/zip-prediction-16bits.png"));
+        expected.convertTo(img.format());
+        QCOMPARE(img, expected);
+#else
+        // the plugin is built without zlib: the ZIP compression is not supported
+        QVERIFY(!reader.read(&img));
+#endif
+    }
+
+    void testKernels_data()
+    {
+        QTest::addColumn<int>("set");
+
+        QTest::newRow("SSE2") << int(PSDKernelSet::SSE2);
+        QTest::newRow("SSSE3") << int(PSDKernelSet::SSSE3);
+        QTest::newRow("AVX2") << int(PSDKernelSet::AVX2);
+        QTest::newRow("NEON") << int(PSDKernelSet::NEON);
+    }
+
+    void testKernels()
+    {
+        QFETCH(int, set);
+        const auto kernelSet = PSDKernelSet(set);
+        if (!isKernelSetSupported(kernelSet)) {
+            QSKIP("Instruction set not supported");
+        }
+
+        // the widths are not multiple of the number of pixels of the vectors:
+        // the last pixels of the lines are converted by the scalar code
+        QRandomGenerator rng(7);
+        const qint32 widths[] = {1, 7, 16, 33, 1001};
+        for (qint32 width : widths) {
+            QVector<QByteArray> planes;
+            QVector<const char *> sources;
+            for (int c = 0; c < 4; ++c) {
+                QByteArray plane(width * 2, Qt::Uninitialized);
+                for (auto &&v : plane) {
+                    v = char(rng.bounded(256));
+                }
+                planes << plane;
+                sources << planes.last().constData();
+            }
+            for (qint32 cn : {3, 4}) {
+                QByteArray expected(width * cn * 2, 0);
+                QByteArray result(width * cn * 2, 0);
+                planesToChunchy<quint8>(reinterpret_cast<uchar *>(expected.data()), sources.constData(), cn, cn, width, PSDKernelSet::Scalar);
+                planesToChunchy<quint8>(reinterpret_cast<uchar *>(result.data()), sources.constData(), cn, cn, width, kernelSet);
+                QCOMPARE(result, expected);
+                planesToChunchy<quint16>(reinterpret_cast<uchar *>(expected.data()), sources.constData(), cn, cn, width, PSDKernelSet::Scalar);
+                planesToChunchy<quint16>(reinterpret_cast<uchar *>(result.data()), sources.constData(), cn, cn, width, kernelSet);
+                QCOMPARE(result, expected);
+
+                // the Lab values are in the interleaved buffer
+                const QByteArray lab = expected;
+                labToRgb<quint8>(reinterpret_cast<uchar *>(expected.data()), cn, lab.constData(), cn, width, cn == 4, PSDKernelSet::Scalar);
+                labToRgb<quint8>(reinterpret_cast<uchar *>(result.data()), cn, lab.constData(), cn, width, cn == 4, kernelSet);
+                QCOMPARE(result, expected);
+                labToRgb<quint16>(reinterpret_cast<uchar *>(expected.data()), cn, lab.constData(), cn, width, cn == 4, PSDKernelSet::Scalar);
+                labToRgb<quint16>(reinterpret_cast<uchar *>(result.data()), cn, lab.constData(), cn, width, cn == 4, kernelSet);
+                QCOMPARE(result, expected);
+            }
+
+            // the CMYK values are the 4 interleaved planes: the buffers are larger than
+            // the converted lines, so the pixels written past the lines are detected too
+            QByteArray cmyk(width * 4 * 2, 0);
+            planesToChunchy<quint16>(reinterpret_cast<uchar *>(cmyk.data()), sources.constData(), 4, 4, width, PSDKernelSet::Scalar);
+            for (qint32 cn : {3, 4}) {
+                QByteArray expected(width * cn * 2 + 8, 0);
+                QByteArray result(width * cn * 2 + 8, 0);
+                cmykToRgb<quint8>(reinterpret_cast<uchar *>(expected.data()), cn, cmyk.constData(), 4, width, false, PSDKernelSet::Scalar);
+                cmykToRgb<quint8>(reinterpret_cast<uchar *>(result.data()), cn, cmyk.constData(), 4, width, false, kernelSet);
+                QCOMPARE(result, expected);
+                cmykToRgb<quint16>(reinterpret_cast<uchar *>(expected.data()), cn, cmyk.constData(), 4, width, false, PSDKernelSet::Scalar);
+                cmykToRgb<quint16>(reinterpret_cast<uchar *>(result.data()), cn, cmyk.constData(), 4, width, false, kernelSet);
+                QCOMPARE(result, expected);
+            }
+        }
+    }
+};
+
+QTEST_MAIN(PsdTests)
+
+#include "psdtest.moc"
@@ -18,32 +18,121 @@
 #include <ImfCompressionAttribute.h>
 #include <ImfConvert.h>
 #include <ImfFloatAttribute.h>
+#include <ImfFrameBuffer.h>
 #include <ImfInputFile.h>
+#include <ImfInputPart.h>
 #include <ImfInt64.h>
 #include <ImfIntAttribute.h>
 #include <ImfLineOrderAttribute.h>
+#include <ImfMultiPartInputFile.h>
+#include <ImfOutputFile.h>
+#include <ImfPartType.h>
 #include <ImfRgbaFile.h>
 #include <ImfStandardAttributes.h>
 #include <ImfStringAttribute.h>
+#include <ImfThreading.h>
+#include <ImfTiledRgbaFile.h>
 #include <ImfVecAttribute.h>
 #include <ImfVersion.h>
 
 #include <iostream>
 
+#include <QBuffer>
+#include <QColorSpace>
 #include <QDataStream>
+#include <QDateTime>
 #include <QDebug>
+#include <QFile>
 #include <QImage>
 #include <QImageIOPlugin>
+#include <QLoggingCategory>
+#include <QScopeGuard>
+#include <QtEndian>
+#include <QThread>
+#include <QVariant>
 
+Q_LOGGING_CATEGORY(EXRPLUGIN, "kf.imageformats.plugins.exr", QtWarningMsg)
+
+/* Enables the multithreaded decompression of the OpenEXR library: the size of
+ * its global thread pool is set from QThread::idealThreadCount() unless the
+ * application has already set it. At runtime, the KIMAGEFORMATS_THREADS
+ * environment variable overrides the number of threads (1 disables them).
+ * Build with EXR_DISABLE_THREADS to decode on the calling thread only.
+ */
+#ifndef EXR_DISABLE_THREADS
+#define EXR_USE_THREADS
+#endif
+
+/* Quality option values used to select the format of the decoded image:
+ * - negative (default): 8-bit RGB32 image, tone mapped as in previous versions;
+ * - from 0 to 99: half float RGBA16FPx4 image with linear values (Qt 6.2+);
+ * - 100: single precision RGBA32FPx4 image with linear values (Qt 6.2+).
+ * EXR colors are premultiplied by alpha, so are the float images.
+ */
+#define EXR_QUALITY_FLOAT16 0
+#define EXR_QUALITY_FLOAT32 100
+
+/* Number of lines decoded at a time when the pixels have to be converted:
+ * it is a multiple of the lines in the blocks of all the compressions but
+ * DWAB, whose blocks are kept in the line buffers of the library anyway.
+ */
+#define EXR_BAND_HEIGHT 64
+
+/* Compression used when the CompressionRatio option is not set: the value
+ * of the option is an Imf::Compression (0 = none, 3 = ZIP, 4 = PIZ, 8 = DWAA...).
+ */
+#define EXR_DEFAULT_COMPRESSION Imf::ZIP_COMPRESSION
+
+/*!
+ * \brief The K_IStream class
+ * Reads the file from the device. When the device is a random access QFile
+ * or QBuffer, the data are read from a memory mapping (or from the buffer)
+ * and the OpenEXR library can decompress them without intermediate copies.
+ */
 class K_IStream : public Imf::IStream
 {
 public:
     K_IStream(QIODevice *dev, const QByteArray &fileName)
         : IStream(fileName.data())
         , m_dev(dev)
+        , m_file(nullptr)
+        , m_map(nullptr)
+        , m_data(nullptr)
+        , m_size(0)
+        , m_pos(0)
+    {
+        if (dev == nullptr || dev->isSequential()) {
+            return;
+        }
+        if (auto file = qobject_cast<QFile *>(dev)) {
+            if (file->size() > 0) {
+                m_map = file->map(0, file->size());
+            }
+            if (m_map) {
+                m_file = file;
+                m_data = reinterpret_cast<const char *>(m_map);
+                m_size = file->size();
+            }
+        } else if (auto buffer = qobject_cast<QBuffer *>(dev)) {
+            m_data = buffer->data().constData();
+            m_size = buffer->data().size();
+        }
+        m_pos = dev->pos();
+    }
+
+    ~K_IStream() override
     {
+        if (m_data) {
+            // leave the device where a QIODevice read would have left it
+            m_dev->seek(m_pos);
+        }
+        if (m_map) {
+            m_file->unmap(m_map);
+        }
     }
 
+    bool isMemoryMapped() const override;
+    char *readMemoryMapped(int n) override;
     bool read(char c[], int n) override;
 #if OPENEXR_VERSION_MAJOR > 2
     uint64_t tellg() override;
@@ -56,10 +145,39 @@ public:
 
 private:
     QIODevice *m_dev;
+    QFile *m_file;
+    uchar *m_map;
+    const char *m_data;
+    qint64 m_size;
+    qint64 m_pos;
 };
 
+bool K_IStream::isMemoryMapped() const
+{
+    return m_data != nullptr;
+}
+
+char *K_IStream::readMemoryMapped(int n)
+{
+    if (m_data == nullptr) {
+        throw Iex::InputExc("Stream is not memory mapped");
+    }
+    if (n < 0 || m_pos < 0 || m_pos + n > m_size) {
+        throw Iex::InputExc("Unexpected end of file");
+    }
+    // the library does not write into the returned data
+    auto data = const_cast<char *>(m_data + m_pos);
+    m_pos += n;
+    return data;
+}
+
 bool K_IStream::read(char c[], int n)
 {
+    if (m_data) {
+        memcpy(c, readMemoryMapped(n), n);
+        return m_pos < m_size;
+    }
+
     qint64 result = m_dev->read(c, n);
     if (result > 0) {
         return true;
@@ -77,6 +195,9 @@ uint64_t K_IStream::tellg()
 Imf::Int64 K_IStream::tellg()
 #endif
 {
+    if (m_data) {
+        return m_pos;
+    }
     return m_dev->pos();
 }
 
@@ -86,6 +207,10 @@ void K_IStream::seekg(uint64_t pos)
 void K_IStream::seekg(Imf::Int64 pos)
 #endif
 {
+    if (m_data) {
+        m_pos = qint64(pos);
+        return;
+    }
     m_dev->seek(pos);
 }
 
@@ -94,17 +219,62 @@ void K_IStream::clear()
     // TODO
 }
 
+class K_OStream : public Imf::OStream
+{
+public:
+    K_OStream(QIODevice *dev, const QByteArray &fileName)
+        : OStream(fileName.data())
+        , m_dev(dev)
+    {
+    }
+
+    void write(const char c[], int n) override;
+#if OPENEXR_VERSION_MAJOR > 2
+    uint64_t tellp() override;
+    void seekp(uint64_t pos) override;
+#else
+    Imf::Int64 tellp() override;
+    void seekp(Imf::Int64 pos) override;
+#endif
+
+private:
+    QIODevice *m_dev;
+};
+
+void K_OStream::write(const char c[], int n)
+{
+    qint64 result = m_dev->write(c, n);
+    if (result != n) {
+        throw Iex::IoExc("Error in write");
+    }
+}
+
+#if OPENEXR_VERSION_MAJOR > 2
+uint64_t K_OStream::tellp()
+#else
+Imf::Int64 K_OStream::tellp()
+#endif
+{
+    return m_dev->pos();
+}
+
+#if OPENEXR_VERSION_MAJOR > 2
+void K_OStream::seekp(uint64_t pos)
+#else
+void K_OStream::seekp(Imf::Int64 pos)
+#endif
+{
+    if (!m_dev->seek(pos)) {
+        throw Iex::IoExc("Error in seek");
+    }
+}
+
 /* this does a conversion from the ILM Half (equal to Nvidia Half)
- * format into the normal 32 bit pixel format. Process is from the
+ * format into an 8-bit channel value. Process is from the
  * ILM code.
  */
-QRgb RgbaToQrgba(struct Imf::Rgba &imagePixel)
+static uchar HalfToByte(float v)
 {
-    float r;
-    float g;
-    float b;
-    float a;
-
     //  1) Compensate for fogging by subtracting defog
     //     from the raw pixel values.
     // Response: We work with defog of 0.0, so this is a no-op
@@ -113,10 +283,7 @@ QRgb RgbaToQrgba(struct Imf::Rgba &imagePixel)
     //     2^(exposure + 2.47393).
     // Response: We work with exposure of 0.0.
     // (2^2.47393) is 5.55555
-    r = imagePixel.r * 5.55555;
-    g = imagePixel.g * 5.55555;
-    b = imagePixel.b * 5.55555;
-    a = imagePixel.a * 5.55555;
+    v = v * 5.55555;
 
     //  3) Values, which are now 1.0, are called "middle gray".
     //     If defog and exposure are both set to 0.0, then
@@ -135,38 +302,634 @@ QRgb RgbaToQrgba(struct Imf::Rgba &imagePixel)
     //     this value will be mapped to the display's
     //     maximum intensity).
     // Response: kneeLow = 0.0 (2^0.0 => 1); kneeHigh = 5.0 (2^5 =>32)
-    if (r > 1.0) {
-        r = 1.0 + std::log((r - 1.0) * 0.184874 + 1) / 0.184874;
-    }
-    if (g > 1.0) {
-        g = 1.0 + std::log((g - 1.0) * 0.184874 + 1) / 0.184874;
-    }
-    if (b > 1.0) {
-        b = 1.0 + std::log((b - 1.0) * 0.184874 + 1) / 0.184874;
-    }
-    if (a > 1.0) {
-        a = 1.0 + std::log((a - 1.0) * 0.184874 + 1) / 0.184874;
+    if (v > 1.0) {
+        v = 1.0 + std::log((v - 1.0) * 0.184874 + 1) / 0.184874;
     }
     //
     //  5) Gamma-correct the pixel values, assuming that the
     //     screen's gamma is 0.4545 (or 1/2.2).
-    r = std::pow(r, 0.4545);
-    g = std::pow(g, 0.4545);
-    b = std::pow(b, 0.4545);
-    a = std::pow(a, 0.4545);
+    v = std::pow(v, 0.4545);
 
     //  6) Scale the values such that pixels middle gray
     //     pixels are mapped to 84.66 (or 3.5 f-stops below
     //     the display's maximum intensity).
     //
-    //  7) Clamp the values to [0, 255].
-    return qRgba((unsigned char)(Imath::clamp(r * 84.66f, 0.f, 255.f)),
-                 (unsigned char)(Imath::clamp(g * 84.66f, 0.f, 255.f)),
-                 (unsigned char)(Imath::clamp(b * 84.66f, 0.f, 255.f)),
-                 (unsigned char)(Imath::clamp(a * 84.66f, 0.f, 255.f)));
+    //  7) Clamp the values to [0, 255] (negative and NaN values are black).
+    v *= 84.66f;
+    if (!(v > 0.f)) {
+        return 0;
+    }
+    return (unsigned char)(Imath::clamp(v, 0.f, 255.f));
+}
+
+/*!
+ * \brief The HalfLut class
+ * The tone mapping of all the 65536 half values: it replaces the log()
+ * and pow() calls per pixel with a table lookup.
+ */
+class HalfLut
+{
+public:
+    HalfLut()
+    {
+        for (int i = 0; i < 65536; ++i) {
+            half h;
+            h.setBits(quint16(i));
+            m_table[i] = HalfToByte(h);
+        }
+    }
+
+    inline uchar operator()(const half &h) const
+    {
+        return m_table[h.bits()];
+    }
+
+    static const HalfLut &instance()
+    {
+        static const HalfLut lut; // thread-safe initialization
+        return lut;
+    }
+
+private:
+    uchar m_table[65536];
+};
+
+/*!
+ * \brief RgbaToQRgbLine
+ * Converts a line of ILM Half pixels into 32 bit RGB pixels.
+ * The alpha channel is not used since the image is RGB32.
+ */
+static void RgbaToQRgbLine(const Imf::Rgba *pixels, QRgb *line, int width)
+{
+    const HalfLut &lut = HalfLut::instance();
+    for (int x = 0; x < width; ++x) {
+        const Imf::Rgba &px = pixels[x];
+        line[x] = qRgb(lut(px.r), lut(px.g), lut(px.b));
+    }
+}
+
+/*!
+ * \brief imageFormat
+ * \param quality The value of the Quality option.
+ * \return The format of the decoded image.
+ */
+static QImage::Format imageFormat(int quality)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    if (quality >= EXR_QUALITY_FLOAT32) {
+        return QImage::Format_RGBA32FPx4_Premultiplied;
+    }
+    if (quality >= EXR_QUALITY_FLOAT16) {
+        return QImage::Format_RGBA16FPx4_Premultiplied;
+    }
+#else
+    Q_UNUSED(quality)
+#endif
+    return QImage::Format_RGB32;
+}
+
+/*!
+ * \brief initThreads
+ * Sets the size of the OpenEXR global thread pool once per process, only if
+ * the application has not sized it: a pool sized by the application is never
+ * changed.
+ * \return The number of threads to pass to the files: decoderThreadCount()
+ * (i.e. the KIMAGEFORMATS_THREADS environment variable) limited to the pool
+ * size, or 0 to decode on the calling thread.
+ */
+static int initThreads()
+{
+#ifdef EXR_USE_THREADS
+    static const bool initialized = []() {
+        const int threads = decoderThreadCount();
+        if (Imf::globalThreadCount() == 0 && threads > 1) {
+            Imf::setGlobalThreadCount(threads);
+        }
+        return true;
+    }();
+    Q_UNUSED(initialized)
+
+    const int threads = std::min(decoderThreadCount(), Imf::globalThreadCount());
+    return threads > 1 ? threads : 0;
+#else
+    return 0;
+#endif
+}
+
+/*!
+ * \brief readBand
+ * Converts the lines [y, y + height) of the image to premultiplied linear values.
+ * \return The lines as RGBA16FPx4_Premultiplied (Qt 6.2+) or RGBA64_Premultiplied image.
+ */
+static QImage readBand(const QImage &image, int y, int height)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    const auto format = QImage::Format_RGBA16FPx4_Premultiplied;
+#else
+    const auto format = QImage::Format_RGBA64_Premultiplied;
+#endif
+    QImage band = image.copy(0, y, image.width(), height);
+
+    // EXR values are linear (the integer images without a colorspace are sRGB)
+    const QColorSpace cs = imageColorSpace(image);
+    if (cs.transferFunction() != QColorSpace::TransferFunction::Linear) {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+        band.convertTo(QImage::Format_RGBA32FPx4);
+#else
+        band.convertTo(QImage::Format_RGBA64);
+#endif
+        band.setColorSpace(cs);
+        band.convertToColorSpace(cs.withTransferFunction(QColorSpace::TransferFunction::Linear));
+    }
+    band.convertTo(format);
+    return band;
+}
+
+/*!
+ * \brief grayToRgb
+ * Copies the red channel, where the gray channel is decoded, to green and blue.
+ */
+static void grayToRgb(Imf::Rgba *line, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        line[x].g = line[x].r;
+        line[x].b = line[x].r;
+    }
+}
+
+static void grayToRgb(float *line, int width)
+{
+    for (int x = 0; x < width; ++x, line += 4) {
+        line[1] = line[0];
+        line[2] = line[0];
+    }
+}
+
+/*!
+ * \brief The LayerChannels class
+ * Names of the channels of a layer decoded as the R, G, B and A components of Imf::Rgba.
+ */
+class LayerChannels
+{
+public:
+    LayerChannels(const Imf::ChannelList &channels, const std::string &layer)
+        : m_gray(false)
+    {
+        const std::string prefix = layer.empty() ? std::string() : layer + ".";
+        m_names[0] = prefix + "R";
+        m_names[1] = prefix + "G";
+        m_names[2] = prefix + "B";
+        m_names[3] = prefix + "A";
+        if (channels.findChannel(m_names[0]) || channels.findChannel(m_names[1]) || channels.findChannel(m_names[2])) {
+            return;
+        }
+
+        // luminance and single channel layers (e.g. depth.Z) are gray images
+        std::string gray = prefix + "Y";
+        if (!channels.findChannel(gray)) {
+            gray.clear();
+            for (auto it = channels.begin(); it != channels.end(); ++it) {
+                const std::string name = it.name();
+                if (name.compare(0, prefix.size(), prefix) == 0 && name.find('.', prefix.size()) == std::string::npos) {
+                    gray = name;
+                    break;
+                }
+            }
+        }
+        if (!gray.empty()) {
+            m_names[0] = gray;
+            m_gray = true;
+        }
+    }
+
+    /*!
+     * \brief frameBuffer
+     * \param origin Address of the pixel (0, 0) of the data window coordinates.
+     * \param lineStride Distance in pixels between two lines.
+     * \param type Type of the 4 components of the pixels: HALF (Imf::Rgba) or FLOAT.
+     */
+    Imf::FrameBuffer frameBuffer(char *origin, size_t lineStride, Imf::PixelType type = Imf::HALF) const
+    {
+        const size_t componentSize = type == Imf::FLOAT ? sizeof(float) : sizeof(half);
+        const size_t xStride = 4 * componentSize;
+        Imf::FrameBuffer fb;
+        for (int i = 0; i < 4; ++i) {
+            // missing channels are filled with 0, alpha with 1
+            fb.insert(m_names[i], Imf::Slice(type, origin + i * componentSize, xStride, xStride * lineStride, 1, 1, i == 3 ? 1.0 : 0.0));
+        }
+        return fb;
+    }
+
+    bool isGray() const
+    {
+        return m_gray;
+    }
+
+private:
+    std::string m_names[4];
+    bool m_gray;
+};
+
+/*!
+ * \brief readPart
+ * Decodes a layer of a part of a multi-part file.
+ * \param layer The layer name: empty for the channels without a layer.
+ */
+static bool readPart(Imf::InputPart &part, const std::string &layer, QImage::Format format, QImage &outImage)
+{
+    const Imf::Header &header = part.header();
+    const Imath::Box2i dw = header.dataWindow();
+    const int width = dw.max.x - dw.min.x + 1;
+    const int height = dw.max.y - dw.min.y + 1;
+    const LayerChannels channels(header.channels(), layer);
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    if (format != QImage::Format_RGB32) {
+        // the float formats get the FLOAT channels (e.g. depth) without rounding them to half
+        const bool isFloat = format == QImage::Format_RGBA32FPx4_Premultiplied || format == QImage::Format_RGBA32FPx4 || format == QImage::Format_RGBX32FPx4;
+        QImage image = imageAlloc(width, height, isFloat ? QImage::Format_RGBA32FPx4_Premultiplied : QImage::Format_RGBA16FPx4_Premultiplied);
+        if (image.isNull()) {
+            qWarning() << "Failed to allocate image, invalid size?" << QSize(width, height);
+            return false;
+        }
+
+        const qsizetype pixelSize = image.depth() / 8;
+        const qsizetype lineStride = image.bytesPerLine() / pixelSize;
+        auto origin = reinterpret_cast<char *>(image.bits()) - (dw.min.x + qint64(dw.min.y) * lineStride) * pixelSize;
+        part.setFrameBuffer(channels.frameBuffer(origin, lineStride, isFloat ? Imf::FLOAT : Imf::HALF));
+        part.readPixels(dw.min.y, dw.max.y);
+
+        if (channels.isGray()) {
+            for (int y = 0; y < height; y++) {
+                if (isFloat) {
+                    grayToRgb(reinterpret_cast<float *>(image.scanLine(y)), width);
+                } else {
+                    grayToRgb(reinterpret_cast<Imf::Rgba *>(image.scanLine(y)), width);
+                }
+            }
+        }
+        if (format != image.format()) {
+            image.convertTo(format);
+        }
+        image.setColorSpace(QColorSpace(QColorSpace::SRgbLinear));
+
+        outImage = image;
+        return true;
+    }
+#endif
+
+    QImage image = imageAlloc(width, height, format);
+    if (image.isNull()) {
+        qWarning() << "Failed to allocate image, invalid size?" << QSize(width, height);
+        return false;
+    }
+
+    const int bandHeight = std::min(height, EXR_BAND_HEIGHT);
+    Imf::Array2D<Imf::Rgba> pixels;
+    pixels.resizeErase(bandHeight, width);
+
+    for (int y = 0; y < height; y += bandHeight) {
+        const int lines = std::min(bandHeight, height - y);
+        const int first = dw.min.y + y;
+        part.setFrameBuffer(channels.frameBuffer(reinterpret_cast<char *>(&pixels[0][0] - dw.min.x - qint64(first) * width), width));
+        part.readPixels(first, first + lines - 1);
+
+        for (int i = 0; i < lines; i++) {
+            if (channels.isGray()) {
+                grayToRgb(pixels[i], width);
+            }
+            RgbaToQRgbLine(pixels[i], reinterpret_cast<QRgb *>(image.scanLine(y + i)), width);
+        }
+    }
+
+    outImage = image;
+    return true;
+}
+
+/*!
+ * \brief decodeFormat
+ * \return The format of the image where the lines are decoded: RGB32 or RGBA16FPx4.
+ */
+static QImage::Format decodeFormat(QImage::Format format)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    if (format != QImage::Format_RGB32) {
+        return QImage::Format_RGBA16FPx4_Premultiplied;
+    }
+#endif
+    return format;
+}
+
+/*!
+ * \brief RgbaToLine
+ * Converts a line of ILM Half pixels to a line of an image in the decodeFormat().
+ */
+static void RgbaToLine(const Imf::Rgba *pixels, uchar *line, int width, QImage::Format format)
+{
+    if (format == QImage::Format_RGB32) {
+        RgbaToQRgbLine(pixels, reinterpret_cast<QRgb *>(line), width);
+    } else {
+        // Imf::Rgba has the same layout of a RGBA16FPx4 pixel
+        memcpy(line, pixels, width * sizeof(Imf::Rgba));
+    }
+}
+
+/*!
+ * \brief finishImage
+ * Converts the decoded image to the requested format and sets its colorspace.
+ */
+static void finishImage(QImage &image, QImage::Format format)
+{
+    if (format == QImage::Format_RGB32) {
+        return;
+    }
+    if (image.format() != format) {
+        image.convertTo(format);
+    }
+    image.setColorSpace(QColorSpace(QColorSpace::SRgbLinear));
+}
+
+/*!
+ * \brief readScanlines
+ * Decodes the RGBA view of the file: only the lines of the clip rectangle are read.
+ */
+static bool readScanlines(Imf::RgbaInputFile &file, const QRect &clipRect, QImage::Format format, QImage &outImage)
+{
+    const Imath::Box2i dw = file.dataWindow();
+    const int width = dw.max.x - dw.min.x + 1;
+    const int height = dw.max.y - dw.min.y + 1;
+
+    QRect rect(0, 0, width, height);
+    if (clipRect.isValid()) {
+        rect = rect.intersected(clipRect);
+    }
+    if (rect.isEmpty()) {
+        return false;
+    }
+
+    QImage image = imageAlloc(rect.size(), decodeFormat(format));
+    if (image.isNull()) {
+        qWarning() << "Failed to allocate image, invalid size?" << rect.size();
+        return false;
+    }
+
+    if (format != QImage::Format_RGB32 && rect.width() == width) {
+        // the lines are decoded directly into the image without tone mapping
+        auto base = reinterpret_cast<Imf::Rgba *>(image.bits());
+        const qsizetype lineStride = image.bytesPerLine() / qsizetype(sizeof(Imf::Rgba));
+        const int first = dw.min.y + rect.top();
+        file.setFrameBuffer(base - dw.min.x - qint64(first) * lineStride, 1, lineStride);
+        file.readPixels(first, first + rect.height() - 1);
+    } else {
+        // the file is decoded a band of lines at a time into a small buffer
+        const int bandHeight = std::min(rect.height(), EXR_BAND_HEIGHT);
+        Imf::Array2D<Imf::Rgba> pixels;
+        pixels.resizeErase(bandHeight, width);
+
+        for (int y = 0; y < rect.height(); y += bandHeight) {
+            const int lines = std::min(bandHeight, rect.height() - y);
+            const int first = dw.min.y + rect.top() + y;
+            file.setFrameBuffer(&pixels[0][0] - dw.min.x - qint64(first) * width, 1, width);
+            file.readPixels(first, first + lines - 1);
+
+            // convert the pixels a line at a time
+            for (int i = 0; i < lines; i++) {
+                RgbaToLine(pixels[i] + rect.left(), image.scanLine(y + i), rect.width(), image.format());
+            }
+        }
+    }
+
+    finishImage(image, format);
+    outImage = image;
+    return true;
+}
+
+/*!
+ * \brief isSinglePartTiled
+ * \return True if the version field of the file marks a single part tiled file.
+ */
+static bool isSinglePartTiled(QIODevice *device)
+{
+    const QByteArray head = device->peek(8);
+    if (head.size() < 8) {
+        return false;
+    }
+    const int version = qFromLittleEndian<qint32>(head.constData() + 4);
+    return Imf::isTiled(version) && !Imf::isMultiPart(version);
+}
+
+/*!
+ * \brief levelFits
+ * \return True if the clipped part of a level with the given size is not smaller than the requested one.
+ */
+static bool levelFits(int levelSize, int size, int clipSize, int scaledSize)
+{
+    return qint64(clipSize) * levelSize >= qint64(scaledSize) * size;
+}
+
+/*!
+ * \brief readTiles
+ * Decodes the tiles of a tiled file which intersect the clip rectangle. With a
+ * scaled size the nearest mip/rip level not smaller than it is decoded instead
+ * of the full resolution one.
+ */
+static bool readTiles(Imf::TiledRgbaInputFile &file, const QRect &clipRect, const QSize &scaledSize, QImage::Format format, QImage &outImage)
+{
+    const Imath::Box2i dw = file.dataWindow();
+    const int width = dw.max.x - dw.min.x + 1;
+    const int height = dw.max.y - dw.min.y + 1;
+
+    QRect rect(0, 0, width, height);
+    if (clipRect.isValid()) {
+        rect = rect.intersected(clipRect);
+    }
+    if (rect.isEmpty()) {
+        return false;
+    }
+
+    // select the level
+    int lx = 0;
+    int ly = 0;
+    if (scaledSize.isValid() && file.levelMode() == Imf::MIPMAP_LEVELS) {
+        while (lx + 1 < file.numLevels() && levelFits(file.levelWidth(lx + 1), width, rect.width(), scaledSize.width())
+               && levelFits(file.levelHeight(lx + 1), height, rect.height(), scaledSize.height())) {
+            ++lx;
+        }
+        ly = lx;
+    } else if (scaledSize.isValid() && file.levelMode() == Imf::RIPMAP_LEVELS) {
+        while (lx + 1 < file.numXLevels() && levelFits(file.levelWidth(lx + 1), width, rect.width(), scaledSize.width())) {
+            ++lx;
+        }
+        while (ly + 1 < file.numYLevels() && levelFits(file.levelHeight(ly + 1), height, rect.height(), scaledSize.height())) {
+            ++ly;
+        }
+    }
+
+    // clip rectangle in level coordinates
+    const int lw = file.levelWidth(lx);
+    const int lh = file.levelHeight(ly);
+    const int x0 = qBound(0, int(qint64(rect.left()) * lw / width), lw - 1);
+    const int y0 = qBound(0, int(qint64(rect.top()) * lh / height), lh - 1);
+    const int x1 = qBound(x0, int((qint64(rect.right() + 1) * lw + width - 1) / width) - 1, lw - 1);
+    const int y1 = qBound(y0, int((qint64(rect.bottom() + 1) * lh + height - 1) / height) - 1, lh - 1);
+
+    QImage image = imageAlloc(x1 - x0 + 1, y1 - y0 + 1, decodeFormat(format));
+    if (image.isNull()) {
+        qWarning() << "Failed to allocate image, invalid size?" << QSize(x1 - x0 + 1, y1 - y0 + 1);
+        return false;
+    }
+
+    // the tiles are decoded a row at a time: the library writes whole tiles
+    // into the frame buffer, so the buffer is aligned to the tiles
+    const Imath::Box2i ldw = file.dataWindowForLevel(lx, ly);
+    const int tw = file.tileXSize();
+    const int th = file.tileYSize();
+    const int tx0 = x0 / tw;
+    const int tx1 = x1 / tw;
+    const int bx = tx0 * tw;
+    const int bw = std::min((tx1 + 1) * tw, lw) - bx;
+    Imf::Array2D<Imf::Rgba> pixels;
+    pixels.resizeErase(std::min(th, lh), bw);
+
+    for (int ty = y0 / th, ty1 = y1 / th; ty <= ty1; ++ty) {
+        const int by = ty * th;
+        file.setFrameBuffer(&pixels[0][0] - (ldw.min.x + bx) - qint64(ldw.min.y + by) * bw, 1, bw);
+        file.readTiles(tx0, tx1, ty, ty, lx, ly);
+
+        for (int y = std::max(by, y0), last = std::min(by + th - 1, y1); y <= last; ++y) {
+            RgbaToLine(pixels[y - by] + (x0 - bx), image.scanLine(y - y0), image.width(), image.format());
+        }
+    }
+
+    finishImage(image, format);
+    outImage = image;
+    return true;
+}
+
+/*!
+ * \brief rewind
+ * Moves a random access device to the start of the file: K_IStream reads from
+ * the current position and leaves the device at the end of the data it read.
+ * \note Sequential devices can only be read once, from where they are.
+ */
+static bool rewind(QIODevice *device)
+{
+    return device->isSequential() || device->seek(0);
+}
+
+/*!
+ * \brief readHeader
+ * Reads the header of a part without decoding the pixels: the device is left where it was.
+ * \note Transactions are used on sequential devices.
+ */
+static bool readHeader(QIODevice *device, int partNumber, Imf::Header &header)
+{
+    const bool sequential = device->isSequential();
+    const qint64 oldPos = device->pos();
+    if (sequential) {
+        device->startTransaction();
+    } else if (!device->seek(0)) {
+        return false;
+    }
+    auto cleanup = qScopeGuard([device, sequential, oldPos] {
+        if (sequential) {
+            device->rollbackTransaction();
+        } else {
+            device->seek(oldPos);
+        }
+    });
+
+    try {
+        K_IStream istr(device, QByteArray());
+        if (partNumber == 0) {
+            Imf::InputFile file(istr, 1);
+            header = file.header();
+        } else {
+            Imf::MultiPartInputFile file(istr, 1);
+            header = file.header(partNumber);
+        }
+    } catch (const std::exception &exc) {
+        qCDebug(EXRPLUGIN) << exc.what();
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief headerTexts
+ * Converts the string and the position attributes of the header to text keys:
+ * the standard ones use the names of the other plugins, the custom ones keep their name.
+ */
+static QList<QPair<QString, QString>> headerTexts(const Imf::Header &header)
+{
+    QList<QPair<QString, QString>> texts;
+    for (auto it = header.begin(); it != header.end(); ++it) {
+        const QString name = QString::fromLatin1(it.name());
+        if (auto attr = dynamic_cast<const Imf::StringAttribute *>(&it.attribute())) {
+            const QString value = QString::fromStdString(attr->value());
+            if (name == QStringLiteral("owner")) {
+                texts.append(qMakePair(QStringLiteral("Author"), value));
+            } else if (name == QStringLiteral("comments")) {
+                texts.append(qMakePair(QStringLiteral("Comment"), value));
+            } else if (name == QStringLiteral("capDate")) {
+                // capDate is local time: utcOffset is the number of seconds to add to get UTC
+                auto dt = QDateTime::fromString(value, QStringLiteral("yyyy:MM:dd HH:mm:ss"));
+                if (dt.isValid() && Imf::hasUtcOffset(header)) {
+                    dt.setOffsetFromUtc(-qRound(Imf::utcOffset(header)));
+                }
+                texts.append(qMakePair(QStringLiteral("CreationDate"), dt.isValid() ? dt.toString(Qt::ISODate) : value));
+            } else if (name != QStringLiteral("name") && name != QStringLiteral("type")) {
+                texts.append(qMakePair(name, value));
+            }
+        } else if (name == QStringLiteral("latitude") || name == QStringLiteral("longitude") || name == QStringLiteral("altitude")) {
+            if (auto attr = dynamic_cast<const Imf::FloatAttribute *>(&it.attribute())) {
+                texts.append(qMakePair(name.at(0).toUpper() + name.mid(1), QString::number(attr->value())));
+            }
+        }
+    }
+    return texts;
+}
+
+/*!
+ * \brief setMetadata
+ * Sets the header attributes as text keys, the resolution and, for the
+ * linear float images, the primaries of the chromaticities attribute.
+ */
+static void setMetadata(QImage &image, const Imf::Header &header)
+{
+    const auto texts = headerTexts(header);
+    for (const auto &text : texts) {
+        image.setText(text.first, text.second);
+    }
+
+    if (Imf::hasXDensity(header)) {
+        // xDensity is in pixels per inch, pixelAspectRatio is x / y
+        const float dpi = Imf::xDensity(header);
+        const float aspect = header.pixelAspectRatio();
+        if (dpi > 0 && aspect > 0) {
+            image.setDotsPerMeterX(qRound(dpi / 0.0254f));
+            image.setDotsPerMeterY(qRound(dpi * aspect / 0.0254f));
+        }
+    }
+
+    if (Imf::hasChromaticities(header) && image.format() != QImage::Format_RGB32) {
+        const Imf::Chromaticities &c = Imf::chromaticities(header);
+        const QColorSpace cs(QPointF(c.white.x, c.white.y),
+                             QPointF(c.red.x, c.red.y),
+                             QPointF(c.green.x, c.green.y),
+                             QPointF(c.blue.x, c.blue.y),
+                             QColorSpace::TransferFunction::Linear);
+        if (cs.isValid()) {
+            image.setColorSpace(cs);
+        }
+    }
 }
 
 EXRHandler::EXRHandler()
+    : m_quality(-1)
+    , m_compressionRatio(-1)
+    , m_imageNumber(0)
+    , m_scanned(false)
 {
 }
 
@@ -182,43 +945,330 @@ bool EXRHandler::canRead() const
 bool EXRHandler::read(QImage *outImage)
 {
     try {
-        int width;
-        int height;
+        const int threads = initThreads();
 
-        K_IStream istr(device(), QByteArray());
-        Imf::RgbaInputFile file(istr);
-        Imath::Box2i dw = file.dataWindow();
+        const QImage::Format format = imageFormat(m_quality);
+        QImage image;
+        Imf::Header header;
 
-        width = dw.max.x - dw.min.x + 1;
-        height = dw.max.y - dw.min.y + 1;
+        if (m_imageNumber > 0) {
+            // parts and layers other than the default view of the first part
+            if (!ensureScanned() || m_imageNumber >= m_images.size() || !rewind(device())) {
+                return false;
+            }
+            const auto &img = m_images.at(m_imageNumber);
+            K_IStream istr(device(), QByteArray());
+            Imf::MultiPartInputFile file(istr, threads);
+            Imf::InputPart part(file, img.first);
+            if (!readPart(part, img.second.toStdString(), format, image)) {
+                return false;
+            }
+            header = part.header();
+            if (m_clipRect.isValid()) {
+                image = image.copy(m_clipRect.intersected(image.rect()));
+            }
+        } else if (!rewind(device())) {
+            return false;
+        } else if ((m_clipRect.isValid() || m_scaledSize.isValid()) && isSinglePartTiled(device())) {
+            // only the needed tiles of the nearest mip level are decoded
+            K_IStream istr(device(), QByteArray());
+            Imf::TiledRgbaInputFile file(istr, threads);
+            if (!readTiles(file, m_clipRect, m_scaledSize, format, image)) {
+                return false;
+            }
+            header = file.header();
+        } else {
+            K_IStream istr(device(), QByteArray());
+            Imf::RgbaInputFile file(istr, threads);
+            if (!readScanlines(file, m_clipRect, format, image)) {
+                return false;
+            }
+            header = file.header();
+        }
 
-        QImage image = imageAlloc(width, height, QImage::Format_RGB32);
         if (image.isNull()) {
-            qWarning() << "Failed to allocate image, invalid size?" << QSize(width, height);
             return false;
         }
+        if (m_scaledSize.isValid() && image.size() != m_scaledSize) {
+            image = image.scaled(m_scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        }
+        setMetadata(image, header);
+
+        *outImage = image;
+
+        return true;
+    } catch (const std::exception &exc) {
+        //      qDebug() << exc.what();
+        return false;
+    }
+}
+
+bool EXRHandler::write(const QImage &image)
+{
+    try {
+        const int width = image.width();
+        const int height = image.height();
+        if (image.isNull()) {
+            return false;
+        }
+
+        auto compression = EXR_DEFAULT_COMPRESSION;
+        if (m_compressionRatio >= 0 && m_compressionRatio < Imf::NUM_COMPRESSION_METHODS) {
+            compression = Imf::Compression(m_compressionRatio);
+        }
+
+        Imf::Header header(width, height);
+        header.compression() = compression;
+
+        const int threads = initThreads();
 
+        K_OStream ostr(device(), QByteArray());
+        const auto channels = image.hasAlphaChannel() ? Imf::WRITE_RGBA : Imf::WRITE_RGB;
+        Imf::RgbaOutputFile file(ostr, header, channels, threads);
+
+#if QT_VERSION < QT_VERSION_CHECK(6, 2, 0)
         Imf::Array2D<Imf::Rgba> pixels;
-        pixels.resizeErase(height, width);
+        pixels.resizeErase(std::min(height, EXR_BAND_HEIGHT), width);
+#endif
+
+        // the image is converted and written a band of lines at a time: the
+        // library compresses the lines of a band in parallel
+        for (int y = 0; y < height; y += EXR_BAND_HEIGHT) {
+            const int lines = std::min(EXR_BAND_HEIGHT, height - y);
+            const QImage band = readBand(image, y, lines);
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+            // Imf::Rgba has the same layout of a RGBA16FPx4 pixel
+            auto base = reinterpret_cast<const Imf::Rgba *>(band.constBits());
+            const qsizetype lineStride = band.bytesPerLine() / qsizetype(sizeof(Imf::Rgba));
+            file.setFrameBuffer(base - qint64(y) * lineStride, 1, lineStride);
+#else
+            for (int i = 0; i < lines; i++) {
+                auto rgba64 = reinterpret_cast<const QRgba64 *>(band.constScanLine(i));
+                auto line = pixels[i];
+                for (int x = 0; x < width; x++) {
+                    line[x] = Imf::Rgba(rgba64[x].red() / 65535.f, rgba64[x].green() / 65535.f, rgba64[x].blue() / 65535.f, rgba64[x].alpha() / 65535.f);
+                }
+            }
+            file.setFrameBuffer(&pixels[0][0] - qint64(y) * width, 1, width);
+#endif
+            file.writePixels(lines);
+        }
+
+        return true;
+    } catch (const std::exception &exc) {
+        qCDebug(EXRPLUGIN) << exc.what();
+        return false;
+    }
+}
+
+bool EXRHandler::supportsOption(ImageOption option) const
+{
+    if (option == QImageIOHandler::Size) {
+        return true;
+    }
+    if (option == QImageIOHandler::ImageFormat) {
+        return true;
+    }
+    if (option == QImageIOHandler::Description) {
+        return true;
+    }
+    if (option == QImageIOHandler::Quality) {
+        return true;
+    }
+    if (option == QImageIOHandler::CompressionRatio) {
+        return true;
+    }
+    if (option == QImageIOHandler::ClipRect) {
+        return true;
+    }
+    if (option == QImageIOHandler::ScaledSize) {
+        return true;
+    }
+    return false;
+}
+
+void EXRHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == QImageIOHandler::Quality) {
+        bool ok = false;
+        auto q = value.toInt(&ok);
+        if (ok) {
+            m_quality = q;
+        }
+    }
+    if (option == QImageIOHandler::CompressionRatio) {
+        bool ok = false;
+        auto c = value.toInt(&ok);
+        if (ok) {
+            m_compressionRatio = c;
+        }
+    }
+    if (option == QImageIOHandler::ClipRect) {
+        m_clipRect = value.toRect();
+    }
+    if (option == QImageIOHandler::ScaledSize) {
+        m_scaledSize = value.toSize();
+    }
+}
 
-        file.setFrameBuffer(&pixels[0][0] - dw.min.x - dw.min.y * width, 1, width);
-        file.readPixels(dw.min.y, dw.max.y);
+QVariant EXRHandler::option(ImageOption option) const
+{
+    QVariant v;
 
-        // somehow copy pixels into image
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x++) {
-                // copy pixels(x,y) into image(x,y)
-                image.setPixel(x, y, RgbaToQrgba(pixels[y][x]));
+    if (option == QImageIOHandler::Size || option == QImageIOHandler::Description) {
+        Imf::Header header;
+        if (partHeader(currentPart(), header)) {
+            if (option == QImageIOHandler::Size) {
+                const Imath::Box2i dw = header.dataWindow();
+                v = QVariant::fromValue(QSize(dw.max.x - dw.min.x + 1, dw.max.y - dw.min.y + 1));
+            } else {
+                // "key: value" pairs separated by empty lines, as parsed by QImageReader::textKeys()
+                QStringList pairs;
+                const auto texts = headerTexts(header);
+                for (const auto &text : texts) {
+                    pairs << text.first + QStringLiteral(": ") + text.second;
+                }
+                v = pairs.join(QStringLiteral("\n\n"));
             }
         }
+    }
 
-        *outImage = image;
+    if (option == QImageIOHandler::ImageFormat) {
+        v = imageFormat(m_quality);
+    }
+
+    if (option == QImageIOHandler::Quality) {
+        v = m_quality;
+    }
+
+    if (option == QImageIOHandler::CompressionRatio) {
+        v = m_compressionRatio;
+    }
+
+    if (option == QImageIOHandler::ClipRect) {
+        v = m_clipRect;
+    }
+
+    if (option == QImageIOHandler::ScaledSize) {
+        v = m_scaledSize;
+    }
 
+    return v;
+}
+
+bool EXRHandler::ensureScanned() const
+{
+    if (m_scanned) {
         return true;
+    }
+
+    if (device()->isSequential()) {
+        return false;
+    }
+
+    const auto oldPos = device()->pos();
+    auto cleanup = qScopeGuard([this, oldPos] {
+        device()->seek(oldPos);
+    });
+    if (!device()->seek(0)) {
+        return false;
+    }
+
+    // image 0 is always the RGBA view of the first part
+    QVector<QPair<int, QByteArray>> images;
+    images.append(qMakePair(0, QByteArray()));
+    QVector<Imf::Header> headers;
+
+    try {
+        K_IStream istr(device(), QByteArray());
+        Imf::MultiPartInputFile file(istr, initThreads());
+        for (int i = 0, n = file.parts(); i < n; ++i) {
+            const Imf::Header &header = file.header(i);
+            headers.append(header);
+            if (header.hasType() && Imf::isDeepData(header.type())) {
+                continue;
+            }
+
+            const Imf::ChannelList &channels = header.channels();
+            if (i > 0) {
+                // the channels without a layer
+                for (auto it = channels.begin(); it != channels.end(); ++it) {
+                    if (std::string(it.name()).find('.') == std::string::npos) {
+                        images.append(qMakePair(i, QByteArray()));
+                        break;
+                    }
+                }
+            }
+
+            std::set<std::string> layers;
+            channels.layers(layers);
+            for (const auto &layer : layers) {
+                images.append(qMakePair(i, QByteArray::fromStdString(layer)));
+            }
+        }
     } catch (const std::exception &exc) {
-        //      qDebug() << exc.what();
+        qCDebug(EXRPLUGIN) << exc.what();
         return false;
     }
+
+    auto *mutableThis = const_cast<EXRHandler *>(this);
+    mutableThis->m_images = images;
+    mutableThis->m_headers = headers;
+    mutableThis->m_scanned = true;
+    return true;
+}
+
+bool EXRHandler::partHeader(int partNumber, Imf::Header &header) const
+{
+    if (partNumber >= 0 && partNumber < m_headers.size()) {
+        header = m_headers.at(partNumber);
+        return true;
+    }
+    if (partNumber != 0 || device() == nullptr || !readHeader(device(), 0, header)) {
+        return false;
+    }
+    const_cast<EXRHandler *>(this)->m_headers.append(header);
+    return true;
+}
+
+int EXRHandler::currentPart() const
+{
+    if (m_imageNumber == 0 || !ensureScanned() || m_imageNumber >= m_images.size()) {
+        return 0;
+    }
+    return m_images.at(m_imageNumber).first;
+}
+
+int EXRHandler::currentImageNumber() const
+{
+    return m_imageNumber;
+}
+
+int EXRHandler::imageCount() const
+{
+    // the scan is skipped on sequential devices: only the first image can be read
+    if (!ensureScanned()) {
+        return 1;
+    }
+    return m_images.size();
+}
+
+bool EXRHandler::jumpToImage(int imageNumber)
+{
+    if (imageNumber == 0) {
+        m_imageNumber = 0;
+        return true;
+    }
+    if (imageNumber < 0 || imageNumber >= imageCount()) {
+        return false;
+    }
+    m_imageNumber = imageNumber;
+    return true;
+}
+
+bool EXRHandler::jumpToNextImage()
+{
+    return jumpToImage(m_imageNumber + 1);
 }
 
 bool EXRHandler::canRead(QIODevice *device)
@@ -236,7 +1286,7 @@ bool EXRHandler::canRead(QIODevice *device)
 QImageIOPlugin::Capabilities EXRPlugin::capabilities(QIODevice *device, const QByteArray &format) const
 {
     if (format == "exr") {
-        return Capabilities(CanRead);
+        return Capabilities(CanRead | CanWrite);
     }
     if (!format.isEmpty()) {
         return {};
@@ -249,6 +1299,9 @@ QImageIOPlugin::Capabilities EXRPlugin::capabilities(QIODevice *device, const QB
     if (device->isReadable() && EXRHandler::canRead(device)) {
         cap |= CanRead;
     }
+    if (device->isWritable()) {
+        cap |= CanWrite;
+    }
     return cap;
 }
 
@@ -10,7 +10,14 @@
 #ifndef KIMG_EXR_P_H
 #define KIMG_EXR_P_H
 
+#include <QByteArray>
 #include <QImageIOPlugin>
+#include <QPair>
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+#include <ImfHeader.h>
 
 class EXRHandler : public QImageIOHandler
 {
@@ -19,8 +26,86 @@ public:
 
     bool canRead() const override;
     bool read(QImage *outImage) override;
+    bool write(const QImage &image) override;
+
+    int currentImageNumber() const override;
+    int imageCount() const override;
+    bool jumpToImage(int imageNumber) override;
+    bool jumpToNextImage() override;
+
+    bool supportsOption(QImageIOHandler::ImageOption option) const override;
+    void setOption(QImageIOHandler::ImageOption option, const QVariant &value) override;
+    QVariant option(QImageIOHandler::ImageOption option) const override;
 
     static bool canRead(QIODevice *device);
+
+private:
+    /*!
+     * \brief ensureScanned
+     * Reads the headers of all the parts to list the images, once.
+     * \return False on sequential devices.
+     */
+    bool ensureScanned() const;
+
+    /*!
+     * \brief partHeader
+     * Gets the header of a part from the headers read by ensureScanned(),
+     * or reads (once) the header of the first part.
+     */
+    bool partHeader(int partNumber, Imf::Header &header) const;
+
+    /*!
+     * \brief currentPart
+     * \return The number of the part of the current image.
+     */
+    int currentPart() const;
+
+    /*!
+     * \brief m_quality
+     * Selects the format of the decoded image: the default (-1) is a tone
+     * mapped RGB32 image, from 0 to 99 an half float image and 100 a float
+     * image, both linear and with alpha.
+     * \note Float formats require Qt 6.2 or newer.
+     */
+    int m_quality;
+
+    /*!
+     * \brief m_compressionRatio
+     * The Imf::Compression used by the writer: the default (-1) is ZIP.
+     */
+    int m_compressionRatio;
+
+    /*!
+     * \brief m_clipRect
+     * Part of the image to decode: only the lines (or the tiles) which
+     * intersect it are read.
+     */
+    QRect m_clipRect;
+
+    /*!
+     * \brief m_scaledSize
+     * Size of the decoded image: tiled files with mip or rip levels decode
+     * the nearest level which is not smaller than it.
+     */
+    QSize m_scaledSize;
+
+    int m_imageNumber;
+
+    bool m_scanned;
+
+    /*!
+     * \brief m_images
+     * Part number and layer name of each image: image 0 is the RGBA view of
+     * the first part, followed by its layers and by the layers of the other
+     * parts (the channels without a layer have an empty name).
+     */
+    QVector<QPair<int, QByteArray>> m_images;
+
+    /*!
+     * \brief m_headers
+     * The headers of the parts: only the first one until the file is scanned.
+     */
+    QVector<Imf::Header> m_headers;
 };
 
 class EXRPlugin : public QImageIOPlugin
@@ -9,11 +9,13 @@
 #include "hdr_p.h"
 #include "util_p.h"
 
-#include <QDataStream>
+#include <QColorSpace>
 #include <QImage>
 #include <QLoggingCategory>
 #include <QRegularExpressionMatch>
 
+#include <memory>
+
 #include <QDebug>
 
 typedef unsigned char uchar;
@@ -25,6 +27,16 @@ namespace // Private.
 #define MAXLINE 1024
 #define MINELEN 8 // minimum scanline length for encoding
 #define MAXELEN 0x7fff // maximum scanline length for encoding
+#define MINRUN 4 // minimum run length written by the encoder
+#define BAND_HEIGHT 16 // number of lines converted at a time by the encoder
+
+/* Quality option values used to select the format of the decoded image:
+ * - negative (default): 8-bit RGB32 image, values are clipped as in previous versions;
+ * - from 0 to 99: half float RGBX16FPx4 image with linear Radiance values (Qt 6.2+);
+ * - 100: single precision RGBX32FPx4 image with linear Radiance values (Qt 6.2+).
+ */
+#define HDR_QUALITY_FLOAT16 0
+#define HDR_QUALITY_FLOAT32 100
 
 static inline uchar ClipToByte(float value)
 {
@@ -35,27 +47,110 @@ static inline uchar ClipToByte(float value)
     return uchar(value);
 }
 
+#define CHUNK_SIZE (64 * 1024) // size of the blocks read from the device
+
+/*!
+ * \brief The BufferedReader class
+ * Reads the device in large chunks into a reusable buffer so the scanlines
+ * are decoded from memory instead of extracting one byte at a time from a
+ * QDataStream.
+ */
+class BufferedReader
+{
+public:
+    explicit BufferedReader(QIODevice *device)
+        : m_device(device)
+        , m_begin(0)
+        , m_end(0)
+    {
+    }
+
+    /*!
+     * \brief ensure
+     * Makes at least \a size bytes available in the buffer.
+     * \return False if the device does not have enough data.
+     */
+    inline bool ensure(qint64 size)
+    {
+        return (m_end - m_begin >= size) || fill(size);
+    }
+
+    /*!
+     * \brief data
+     * \return The unread data of the buffer.
+     */
+    inline const uchar *data() const
+    {
+        return reinterpret_cast<const uchar *>(m_buffer.constData()) + m_begin;
+    }
+
+    inline void skip(qint64 size)
+    {
+        m_begin += size;
+    }
+
+    inline uchar take()
+    {
+        return uchar(m_buffer.at(m_begin++));
+    }
+
+private:
+    bool fill(qint64 size)
+    {
+        // move the unread bytes at the beginning of the buffer
+        auto available = m_end - m_begin;
+        if (m_begin > 0 && available > 0) {
+            memmove(m_buffer.data(), m_buffer.data() + m_begin, available);
+        }
+        m_begin = 0;
+        m_end = available;
+
+        if (m_buffer.size() < std::max(size, qint64(CHUNK_SIZE))) {
+            m_buffer.resize(std::max(size, qint64(CHUNK_SIZE)));
+        }
+        while (m_end < size) {
+            auto read = m_device->read(m_buffer.data() + m_end, m_buffer.size() - m_end);
+            if (read <= 0) {
+                break;
+            }
+            m_end += read;
+        }
+        return m_end >= size;
+    }
+
+    QIODevice *m_device;
+    QByteArray m_buffer;
+    qint64 m_begin;
+    qint64 m_end;
+};
+
+enum ScanlineResult {
+    ScanlineOk,
+    ScanlineEnd, // no more data: the image is returned as is
+    ScanlineError,
+};
+
 // read an old style line from the hdr image file
-// if 'first' is true the first byte is already read
-static bool Read_Old_Line(uchar *image, int width, QDataStream &s)
+static ScanlineResult Read_Old_Line(uchar *image, int width, BufferedReader &reader)
 {
+    const uchar *first = image;
     int rshift = 0;
     int i;
 
     while (width > 0) {
-        s >> image[0];
-        s >> image[1];
-        s >> image[2];
-        s >> image[3];
-
-        if (s.atEnd()) {
-            return false;
+        if (!reader.ensure(4)) {
+            return ScanlineEnd;
         }
+        memcpy(image, reader.data(), 4);
+        reader.skip(4);
 
         if ((image[0] == 1) && (image[1] == 1) && (image[2] == 1)) {
-            for (i = image[3] << rshift; i > 0; i--) {
-                // memcpy(image, image-4, 4);
-                (uint &)image[0] = (uint &)image[0 - 4];
+            if (image == first) {
+                qCDebug(HDRPLUGIN) << "Run without a previous pixel";
+                return ScanlineError;
+            }
+            for (i = image[3] << rshift; i > 0 && width > 0; i--) {
+                memcpy(image, image - 4, 4);
                 image += 4;
                 width--;
             }
@@ -66,10 +161,127 @@ static bool Read_Old_Line(uchar *image, int width, QDataStream &s)
             rshift = 0;
         }
     }
+    return ScanlineOk;
+}
+
+/*!
+ * \brief Read_RLE_Line
+ * Decodes a new style RLE line: each component is encoded separately, so
+ * the runs are expanded in the planar buffer and then interleaved.
+ * \param planes Buffer of 4 * width bytes.
+ * \param skip If true, the line is only parsed to reach the next one.
+ */
+static bool Read_RLE_Line(uchar *image, uchar *planes, int width, BufferedReader &reader, bool skip)
+{
+    for (int i = 0; i < 4; i++) {
+        uchar *plane = planes + i * width;
+        for (int j = 0; j < width;) {
+            if (!reader.ensure(2)) {
+                qCDebug(HDRPLUGIN) << "Truncated HDR file";
+                return false;
+            }
+            int code = reader.take();
+            if (code > 128) {
+                // run
+                code &= 127;
+                if (code > width - j) {
+                    qCDebug(HDRPLUGIN) << "Run exceeds the width of the line";
+                    return false;
+                }
+                auto val = reader.take();
+                if (!skip) {
+                    memset(plane + j, val, code);
+                }
+            } else {
+                // non-run
+                if (code > width - j) {
+                    qCDebug(HDRPLUGIN) << "Non-run exceeds the width of the line";
+                    return false;
+                }
+                if (!reader.ensure(code)) {
+                    qCDebug(HDRPLUGIN) << "Truncated HDR file";
+                    return false;
+                }
+                if (!skip) {
+                    memcpy(plane + j, reader.data(), code);
+                }
+                reader.skip(code);
+            }
+            j += code;
+        }
+    }
+
+    if (skip) {
+        return true;
+    }
+    for (int j = 0; j < width; j++) {
+        image[j * 4] = planes[j];
+        image[j * 4 + 1] = planes[width + j];
+        image[j * 4 + 2] = planes[2 * width + j];
+        image[j * 4 + 3] = planes[3 * width + j];
+    }
     return true;
 }
 
-static void RGBE_To_QRgbLine(uchar *image, QRgb *scanline, int width)
+/*!
+ * \brief Read_Scanline
+ * Reads a scanline of RGBE pixels using the old or the new style encoding.
+ * \param skip If true, the pixels of a new style line are not decoded.
+ */
+static ScanlineResult Read_Scanline(uchar *image, uchar *planes, int width, BufferedReader &reader, bool skip = false)
+{
+    // determine scanline type
+    if ((width < MINELEN) || (MAXELEN < width)) {
+        return Read_Old_Line(image, width, reader);
+    }
+
+    // the 4 bytes header of a new style line (or the first pixel of an old style one)
+    if (!reader.ensure(5)) {
+        return ScanlineEnd;
+    }
+
+    const uchar *header = reader.data();
+    if ((header[0] != 2) || (header[1] != 2) || (header[2] & 128)) {
+        return Read_Old_Line(image, width, reader);
+    }
+
+    if ((header[2] << 8 | header[3]) != width) {
+        qCDebug(HDRPLUGIN) << "Line of pixels had width" << (header[2] << 8 | header[3]) << "instead of" << width;
+        return ScanlineError;
+    }
+    reader.skip(4);
+
+    return Read_RLE_Line(image, planes, width, reader, skip) ? ScanlineOk : ScanlineError;
+}
+
+/*!
+ * \brief RGBE_To_FloatLine
+ * Converts a line of RGBE pixels to linear RGBX float values.
+ * The exponent is converted by building the IEEE 754 bits of 2^(e - 136) so
+ * the loop has no branches and it can be vectorized by the compiler.
+ */
+static void RGBE_To_FloatLine(const uchar *image, float *scanline, int width)
+{
+    for (int j = 0; j < width; j++) {
+        // v = ldexp(1.0, int(image[3]) - 136): exponents below 10 (and 0, the
+        // Radiance black) would be denormals, so they are flushed to zero
+        const quint32 bits = quint32(std::max(int(image[3]) - 9, 0)) << 23;
+        float v;
+        memcpy(&v, &bits, sizeof(v));
+
+        // a zero mantissa is black only when the exponent is zero too
+        const float b = bits ? 0.5f : 0.0f;
+        scanline[0] = (float(image[0]) + b) * v;
+        scanline[1] = (float(image[1]) + b) * v;
+        scanline[2] = (float(image[2]) + b) * v;
+        scanline[3] = 1.0f;
+
+        image += 4;
+        scanline += 4;
+    }
+}
+
+static void RGBE_To_QRgbLine(const uchar *image, QRgb *scanline, int width)
 {
     for (int j = 0; j < width; j++) {
         // v = ldexp(1.0, int(image[3]) - 128);
@@ -87,103 +299,379 @@ static void RGBE_To_QRgbLine(uchar *image, QRgb *scanline, int width)
     }
 }
 
-// Load the HDR image.
-static bool LoadHDR(QDataStream &s, const int width, const int height, QImage &img)
+/*!
+ * \brief imageFormat
+ * \param quality The value of the Quality option.
+ * \return The format of the decoded image.
+ */
+static QImage::Format imageFormat(int quality)
 {
-    uchar val;
-    uchar code;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    if (quality >= HDR_QUALITY_FLOAT32) {
+        return QImage::Format_RGBX32FPx4;
+    }
+    if (quality >= HDR_QUALITY_FLOAT16) {
+        return QImage::Format_RGBX16FPx4;
+    }
+#else
+    Q_UNUSED(quality)
+#endif
+    return QImage::Format_RGB32;
+}
 
-    // Create dst image.
-    img = imageAlloc(width, height, QImage::Format_RGB32);
-    if (img.isNull()) {
-        qCDebug(HDRPLUGIN) << "Couldn't create image with size" << width << height << "and format RGB32";
-        return false;
+/*!
+ * \brief RGBE_To_Line
+ * Converts a line of RGBE pixels to the format of the destination image.
+ * \param floatLine Temporary buffer of 4 * width floats used by the half float conversion.
+ */
+static void RGBE_To_Line(const uchar *image, uchar *scanline, int width, QImage::Format format, float *floatLine)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    if (format == QImage::Format_RGBX32FPx4) {
+        RGBE_To_FloatLine(image, reinterpret_cast<float *>(scanline), width);
+        return;
     }
+    if (format == QImage::Format_RGBX16FPx4) {
+        RGBE_To_FloatLine(image, floatLine, width);
+        qFloatToFloat16(reinterpret_cast<qfloat16 *>(scanline), floatLine, qsizetype(width) * 4);
+        return;
+    }
+#else
+    Q_UNUSED(format)
+    Q_UNUSED(floatLine)
+#endif
+    RGBE_To_QRgbLine(image, reinterpret_cast<QRgb *>(scanline), width);
+}
 
-    QByteArray lineArray;
-    lineArray.resize(4 * width);
-    uchar *image = (uchar *)lineArray.data();
+/*!
+ * \brief Float_To_Line
+ * Converts a line of linear RGBX float values to the format of the destination image.
+ */
+static void Float_To_Line(const float *line, uchar *scanline, int width, QImage::Format format)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    if (format == QImage::Format_RGBX32FPx4) {
+        memcpy(scanline, line, qsizetype(width) * 4 * sizeof(float));
+        return;
+    }
+    if (format == QImage::Format_RGBX16FPx4) {
+        qFloatToFloat16(reinterpret_cast<qfloat16 *>(scanline), line, qsizetype(width) * 4);
+        return;
+    }
+#else
+    Q_UNUSED(format)
+#endif
+    // same scale of the 8-bit conversion: mantissa * 2^(exponent - 128)
+    auto rgb = reinterpret_cast<QRgb *>(scanline);
+    for (int j = 0; j < width; j++, line += 4) {
+        rgb[j] = qRgb(ClipToByte(line[0] * 256.0f), ClipToByte(line[1] * 256.0f), ClipToByte(line[2] * 256.0f));
+    }
+}
 
-    for (int cline = 0; cline < height; cline++) {
-        QRgb *scanline = (QRgb *)img.scanLine(cline);
+/*!
+ * \brief The Orientation struct
+ * Describes how the scanlines of the file are laid out in the image: a
+ * scanline is a row of the image or, when the image is stored in column
+ * order, a column.
+ */
+struct Orientation {
+    bool columnMajor = false; // the scanlines are the columns of the image
+    bool flipMajor = false; // the scanlines are stored from the bottom (or from the right)
+    bool flipMinor = false; // the pixels of a scanline are stored from the right (or from the bottom)
 
-        // determine scanline type
-        if ((width < MINELEN) || (MAXELEN < width)) {
-            Read_Old_Line(image, width, s);
-            RGBE_To_QRgbLine(image, scanline, width);
-            continue;
+    bool isStandard() const
+    {
+        return !columnMajor && !flipMinor;
+    }
+};
+
+struct Header {
+    int width = 0;
+    int height = 0;
+    Orientation orientation;
+};
+
+template<class T>
+static void Copy_Pixels(const uchar *line, uchar *dst, qsizetype step, int length)
+{
+    auto src = reinterpret_cast<const T *>(line);
+    for (int k = 0; k < length; k++, dst += step) {
+        *reinterpret_cast<T *>(dst) = src[k];
+    }
+}
+
+/*!
+ * \brief Write_Line
+ * Writes a converted scanline to the row or column \a pos of the image.
+ */
+static void Write_Line(const uchar *line, int length, int pos, const Orientation &o, QImage &img)
+{
+    const int pixelSize = img.depth() / 8;
+    const qsizetype bpl = img.bytesPerLine();
+
+    uchar *dst;
+    qsizetype step;
+    if (o.columnMajor) {
+        dst = img.bits() + qsizetype(pos) * pixelSize;
+        step = bpl;
+    } else {
+        dst = img.scanLine(pos);
+        step = pixelSize;
+    }
+    if (o.flipMinor) {
+        dst += step * (length - 1);
+        step = -step;
+    }
+
+    switch (pixelSize) {
+    case 4:
+        Copy_Pixels<quint32>(line, dst, step, length);
+        break;
+    case 8:
+        Copy_Pixels<quint64>(line, dst, step, length);
+        break;
+    default:
+        for (int k = 0; k < length; k++, dst += step) {
+            memcpy(dst, line + k * pixelSize, pixelSize);
         }
+        break;
+    }
+}
 
-        s >> val;
+/*!
+ * \brief The BoxFilter class
+ * Averages the decoded scanlines in bins while they are read: a bin covers
+ * one line of the scaled image, so only one line of accumulators is needed.
+ */
+class BoxFilter
+{
+public:
+    /*!
+     * \param lines Number of scanlines to filter.
+     * \param length Number of pixels of the scanlines to filter.
+     * \param outLines Number of lines of the scaled image.
+     * \param outLength Number of pixels of the lines of the scaled image.
+     * \param flipMinor True if the pixels of the scanlines are stored in reverse order.
+     */
+    BoxFilter(int lines, int length, int outLines, int outLength, bool flipMinor)
+        : m_lines(lines)
+        , m_outLines(outLines)
+        , m_outLength(outLength)
+        , m_bin(-1)
+        , m_binLines(0)
+        , m_pixelBins(length)
+        , m_binPixels(outLength, 0)
+        , m_acc(3 * outLength, 0.0f)
+        , m_line(4 * outLength, 1.0f)
+    {
+        // k and b are in image order, the bins are stored in file order
+        for (int k = 0; k < length; k++) {
+            int b = int(qint64(k) * outLength / length);
+            if (flipMinor) {
+                b = outLength - 1 - b;
+            }
+            m_binPixels[b]++;
+            m_pixelBins[flipMinor ? length - 1 - k : k] = b;
+        }
+    }
 
-        if (s.atEnd()) {
-            return true;
+    /*!
+     * \brief add
+     * Adds the scanline at the position \a pos of the region.
+     * \return The bin completed by the line or -1.
+     */
+    int add(const float *line, int pos)
+    {
+        const int bin = int(qint64(pos) * m_outLines / m_lines);
+        int completed = -1;
+        if (bin != m_bin) {
+            completed = flush();
+            m_bin = bin;
+        }
+        for (int k = 0, n = m_pixelBins.size(); k < n; k++, line += 4) {
+            float *acc = m_acc.data() + 3 * m_pixelBins.at(k);
+            acc[0] += line[0];
+            acc[1] += line[1];
+            acc[2] += line[2];
         }
+        m_binLines++;
+        return completed;
+    }
 
-        if (val != 2) {
-            s.device()->ungetChar(val);
-            Read_Old_Line(image, width, s);
-            RGBE_To_QRgbLine(image, scanline, width);
-            continue;
+    /*!
+     * \brief flush
+     * Computes the averages of the current bin and resets the accumulators.
+     * \return The completed bin or -1.
+     */
+    int flush()
+    {
+        if (m_binLines == 0) {
+            return -1;
         }
+        for (int b = 0; b < m_outLength; b++) {
+            const int pixels = m_binPixels.at(b);
+            const float scale = 1.0f / float(std::max(1, pixels * m_binLines));
+            m_line[4 * b] = m_acc.at(3 * b) * scale;
+            m_line[4 * b + 1] = m_acc.at(3 * b + 1) * scale;
+            m_line[4 * b + 2] = m_acc.at(3 * b + 2) * scale;
+        }
+        std::fill(m_acc.begin(), m_acc.end(), 0.0f);
+        m_binLines = 0;
+        return m_bin;
+    }
+
+    /*!
+     * \brief line
+     * \return The averaged line of the last completed bin as RGBX floats in file order.
+     */
+    const float *line() const
+    {
+        return m_line.data();
+    }
 
-        s >> image[1];
-        s >> image[2];
-        s >> image[3];
+private:
+    int m_lines;
+    int m_outLines;
+    int m_outLength;
+    int m_bin;
+    int m_binLines;
+    QVector<int> m_pixelBins;
+    QVector<int> m_binPixels;
+    QVector<float> m_acc;
+    QVector<float> m_line;
+};
 
-        if (s.atEnd()) {
-            return true;
+/*!
+ * \brief LoadHDR
+ * Loads the HDR image.
+ * \param clip Part of the image to decode: scanlines after it are not read
+ * and the scanlines before it are parsed without decoding the pixels.
+ * \param scaled Size of the image returned: the decoded scanlines are box
+ * filtered while they are read.
+ */
+static bool LoadHDR(QIODevice *device, const Header &h, const QImage::Format format, const QRect &clip, const QSize &scaled, QImage &img)
+{
+    const Orientation &o = h.orientation;
+
+    QRect rect(0, 0, h.width, h.height);
+    if (clip.isValid()) {
+        rect = rect.intersected(clip);
+        if (rect.isEmpty()) {
+            qCDebug(HDRPLUGIN) << "The clip rect" << clip << "is outside the image";
+            return false;
         }
+    }
 
-        if ((image[1] != 2) || (image[2] & 128)) {
-            image[0] = 2;
-            Read_Old_Line(image + 4, width - 1, s);
-            RGBE_To_QRgbLine(image, scanline, width);
-            continue;
+    // down scaling is done while decoding, up scaling at the end
+    QSize size = rect.size();
+    if (scaled.isValid() && !scaled.isEmpty() && scaled.width() <= size.width() && scaled.height() <= size.height()) {
+        size = scaled;
+    }
+    const bool scaling = size != rect.size();
+
+    // Create dst image.
+    img = imageAlloc(size, format);
+    if (img.isNull()) {
+        qCDebug(HDRPLUGIN) << "Couldn't create image with size" << size << "and format" << format;
+        return false;
+    }
+
+    // lines and length of the scanlines in the file
+    const int lines = o.columnMajor ? h.width : h.height;
+    const int length = o.columnMajor ? h.height : h.width;
+
+    // region to decode in scanline coordinates
+    const int majorFirst = o.columnMajor ? rect.left() : rect.top();
+    const int majorCount = o.columnMajor ? rect.width() : rect.height();
+    const int minorFirst = o.columnMajor ? rect.top() : rect.left();
+    const int minorCount = o.columnMajor ? rect.height() : rect.width();
+    const int firstLine = o.flipMajor ? lines - majorFirst - majorCount : majorFirst;
+    const int lastLine = firstLine + majorCount - 1;
+    const int firstPixel = o.flipMinor ? length - minorFirst - minorCount : minorFirst;
+
+    const int outLines = o.columnMajor ? size.width() : size.height();
+    const int outLength = o.columnMajor ? size.height() : size.width();
+
+    QByteArray lineArray;
+    lineArray.resize(4 * length);
+    uchar *image = (uchar *)lineArray.data();
+
+    QByteArray planesArray;
+    planesArray.resize(4 * length);
+    uchar *planes = (uchar *)planesArray.data();
+
+    QVector<float> floatLine;
+    if (format != QImage::Format_RGB32 || scaling) {
+        floatLine.resize(4 * length);
+    }
+
+    // scanlines that are not rows in the standard orientation are converted
+    // here and then written directly to their row or column of the image
+    QByteArray convertedArray;
+    if (!o.isStandard()) {
+        convertedArray.resize(qsizetype(outLength) * img.depth() / 8);
+    }
+    auto converted = reinterpret_cast<uchar *>(convertedArray.data());
+
+    std::unique_ptr<BoxFilter> filter;
+    if (scaling) {
+        filter.reset(new BoxFilter(majorCount, minorCount, outLines, outLength, o.flipMinor));
+    }
+    auto writeBin = [&](int bin) {
+        if (bin < 0) {
+            return;
+        }
+        if (o.isStandard()) {
+            Float_To_Line(filter->line(), img.scanLine(bin), outLength, format);
+        } else {
+            Float_To_Line(filter->line(), converted, outLength, format);
+            Write_Line(converted, outLength, bin, o, img);
         }
+    };
 
-        if ((image[2] << 8 | image[3]) != width) {
-            qCDebug(HDRPLUGIN) << "Line of pixels had width" << (image[2] << 8 | image[3]) << "instead of" << width;
+    BufferedReader reader(device);
+    for (int cline = 0; cline <= lastLine; cline++) {
+        const bool skip = cline < firstLine;
+        auto result = Read_Scanline(image, planes, length, reader, skip);
+        if (result == ScanlineError) {
             return false;
         }
+        if (result == ScanlineEnd) {
+            break;
+        }
+        if (skip) {
+            continue;
+        }
 
-        // read each component
-        for (int i = 0; i < 4; i++) {
-            for (int j = 0; j < width;) {
-                s >> code;
-                if (s.atEnd()) {
-                    qCDebug(HDRPLUGIN) << "Truncated HDR file";
-                    return false;
-                }
-                if (code > 128) {
-                    // run
-                    code &= 127;
-                    s >> val;
-                    while (code != 0) {
-                        image[i + j * 4] = val;
-                        j++;
-                        code--;
-                    }
-                } else {
-                    // non-run
-                    while (code != 0) {
-                        s >> image[i + j * 4];
-                        j++;
-                        code--;
-                    }
-                }
-            }
+        // position of the scanline in the destination image
+        const int pos = o.flipMajor ? lastLine - cline : cline - firstLine;
+        const uchar *pixels = image + 4 * firstPixel;
+
+        if (scaling) {
+            RGBE_To_FloatLine(pixels, floatLine.data(), minorCount);
+            writeBin(filter->add(floatLine.data(), pos));
+        } else if (o.isStandard()) {
+            RGBE_To_Line(pixels, img.scanLine(pos), minorCount, format, floatLine.data());
+        } else {
+            RGBE_To_Line(pixels, converted, minorCount, format, floatLine.data());
+            Write_Line(converted, minorCount, pos, o, img);
         }
+    }
 
-        RGBE_To_QRgbLine(image, scanline, width);
+    if (scaling) {
+        writeBin(filter->flush());
+    } else if (scaled.isValid() && !scaled.isEmpty() && scaled != size) {
+        img = img.scaled(scaled, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
     }
 
     return true;
 }
 
-} // namespace
-
-bool HDRHandler::read(QImage *outImage)
+/*!
+ * \brief Read_Header
+ * Reads the header of the file and the resolution line.
+ */
+static bool Read_Header(QIODevice *device, Header &h)
 {
     int len;
     QByteArray line(MAXLINE + 1, Qt::Uninitialized);
@@ -191,7 +679,7 @@ bool HDRHandler::read(QImage *outImage)
 
     // Parse header
     do {
-        len = device()->readLine(line.data(), MAXLINE);
+        len = device->readLine(line.data(), MAXLINE);
 
         if (line.startsWith("FORMAT=")) {
             format = line.mid(7, len - 7 - 1 /*\n*/);
@@ -204,11 +692,10 @@ bool HDRHandler::read(QImage *outImage)
         return false;
     }
 
-    len = device()->readLine(line.data(), MAXLINE);
+    len = device->readLine(line.data(), MAXLINE);
     line.resize(len);
 
     /*
-       TODO: handle flipping and rotation, as per the spec below
        The single resolution line consists of 4 values, a X and Y label each followed by a numerical
        integer value. The X and Y are immediately preceded by a sign which can be used to indicate
        flipping, the order of the X and Y indicate rotation. The standard coordinate system for
@@ -220,37 +707,321 @@ bool HDRHandler::read(QImage *outImage)
        The reader can convince themselves that the 8 combinations cover all the possible image orientations
        and rotations.
     */
-    QRegularExpression resolutionRegExp(QStringLiteral("([+\\-][XY]) ([0-9]+) ([+\\-][XY]) ([0-9]+)\n"));
+    QRegularExpression resolutionRegExp(QStringLiteral("([+\\-])([XY]) ([0-9]+) ([+\\-])([XY]) ([0-9]+)\n"));
     QRegularExpressionMatch match = resolutionRegExp.match(QString::fromLatin1(line));
     if (!match.hasMatch()) {
         qCDebug(HDRPLUGIN) << "Invalid HDR file, the first line after the header didn't have the expected format:" << line;
         return false;
     }
 
-    if ((match.captured(1).at(1) != u'Y') || (match.captured(3).at(1) != u'X')) {
-        qCDebug(HDRPLUGIN) << "Unsupported image orientation in HDR file.";
+    const QChar majorAxis = match.captured(2).at(0);
+    const QChar minorAxis = match.captured(5).at(0);
+    if (majorAxis == minorAxis) {
+        qCDebug(HDRPLUGIN) << "Invalid image orientation in HDR file:" << line;
         return false;
     }
 
-    const int width = match.captured(4).toInt();
-    const int height = match.captured(2).toInt();
+    // Y runs down the file when negative, X runs to the right when positive
+    auto isFlipped = [](const QChar &axis, const QString &sign) {
+        return axis == u'Y' ? sign == QLatin1String("+") : sign == QLatin1String("-");
+    };
+
+    Orientation &o = h.orientation;
+    o.columnMajor = majorAxis == u'X';
+    o.flipMajor = isFlipped(majorAxis, match.captured(1));
+    o.flipMinor = isFlipped(minorAxis, match.captured(4));
+
+    h.width = o.columnMajor ? match.captured(3).toInt() : match.captured(6).toInt();
+    h.height = o.columnMajor ? match.captured(6).toInt() : match.captured(3).toInt();
+    return true;
+}
+
+/*!
+ * \brief FloatLine_To_RGBE
+ * Converts a line of linear RGBX float values to planar RGBE components.
+ * The exponent is taken from the IEEE 754 bits of the greatest component
+ * (as frexp() would do) so the loop has no branches and it can be vectorized
+ * by the compiler.
+ * \param planes Buffer of 4 * width bytes: the R, G, B and E planes.
+ */
+static void FloatLine_To_RGBE(const float *line, uchar *planes, int width)
+{
+    uchar *pr = planes;
+    uchar *pg = planes + width;
+    uchar *pb = planes + 2 * width;
+    uchar *pe = planes + 3 * width;
+    for (int j = 0; j < width; j++, line += 4) {
+        // negative and NaN values are written as 0, the huge ones are clamped
+        const float r = std::min(std::max(0.0f, line[0]), 1e38f);
+        const float g = std::min(std::max(0.0f, line[1]), 1e38f);
+        const float b = std::min(std::max(0.0f, line[2]), 1e38f);
+        const float m = std::max(r, std::max(g, b));
+
+        quint32 bits;
+        memcpy(&bits, &m, sizeof(bits));
+        const int e = int(bits >> 23); // biased exponent: m is in [2^(e-127), 2^(e-126))
+
+        // d = 256 / 2^(e - 126) so that m * d is less than 256
+        const quint32 dbits = quint32(261 - e) << 23;
+        float d;
+        memcpy(&d, &dbits, sizeof(d));
+
+        const bool black = m < 1e-32f;
+        pr[j] = black ? 0 : uchar(r * d);
+        pg[j] = black ? 0 : uchar(g * d);
+        pb[j] = black ? 0 : uchar(b * d);
+        pe[j] = black ? 0 : uchar(e + 2);
+    }
+}
+
+/*!
+ * \brief Write_RLE_Plane
+ * Encodes a component of a new style RLE line.
+ */
+static void Write_RLE_Plane(const uchar *plane, int width, QByteArray &out)
+{
+    auto runLength = [plane, width](int j, int max) {
+        int run = 1;
+        while (run < max && j + run < width && plane[j + run] == plane[j]) {
+            run++;
+        }
+        return run;
+    };
+
+    for (int j = 0; j < width;) {
+        const int run = runLength(j, 127);
+        if (run >= MINRUN) {
+            out.append(char(128 + run));
+            out.append(char(plane[j]));
+            j += run;
+            continue;
+        }
 
-    QDataStream s(device());
+        // non-run: it ends at the beginning of the next run
+        const int begin = j;
+        while (j < width && j - begin < 128 && runLength(j, MINRUN) < MINRUN) {
+            j++;
+        }
+        out.append(char(j - begin));
+        out.append(reinterpret_cast<const char *>(plane + begin), j - begin);
+    }
+}
+
+/*!
+ * \brief Write_Scanline
+ * Encodes a line of RGBE planes: new style RLE is used when the width allows
+ * it, otherwise the pixels are written flat.
+ */
+static void Write_Scanline(const uchar *planes, int width, QByteArray &out)
+{
+    out.resize(0);
+    if ((width < MINELEN) || (MAXELEN < width)) {
+        out.resize(4 * width);
+        for (int j = 0; j < width; j++) {
+            uchar r = planes[j];
+            uchar g = planes[width + j];
+            uchar b = planes[2 * width + j];
+            uchar e = planes[3 * width + j];
+            if (r == 1 && g == 1 && b == 1) {
+                // (1, 1, 1) marks a run in old style lines: write the same value as (2, 2, 2)
+                r = g = b = 2;
+                e = e > 1 ? e - 1 : 0;
+            }
+            out[4 * j] = char(r);
+            out[4 * j + 1] = char(g);
+            out[4 * j + 2] = char(b);
+            out[4 * j + 3] = char(e);
+        }
+        return;
+    }
+
+    out.append(char(2));
+    out.append(char(2));
+    out.append(char(width >> 8));
+    out.append(char(width & 0xff));
+    for (int i = 0; i < 4; i++) {
+        Write_RLE_Plane(planes + i * width, width, out);
+    }
+}
+
+/*!
+ * \brief Read_Band
+ * Converts the lines [y, y + height) of the image to linear float values.
+ * \return The lines as RGBX32FPx4 (Qt 6.2+) or RGBX64 image.
+ */
+static QImage Read_Band(const QImage &image, int y, int height)
+{
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    const auto format = QImage::Format_RGBX32FPx4;
+#else
+    const auto format = QImage::Format_RGBX64;
+#endif
+    QImage band = image.copy(0, y, image.width(), height);
+    band.convertTo(format);
+
+    // Radiance values are linear
+    const QColorSpace cs = imageColorSpace(image);
+    if (cs.transferFunction() != QColorSpace::TransferFunction::Linear) {
+        band.setColorSpace(cs);
+        band.convertToColorSpace(cs.withTransferFunction(QColorSpace::TransferFunction::Linear));
+    }
+    return band;
+}
+
+} // namespace
+
+bool HDRHandler::read(QImage *outImage)
+{
+    Header h;
+    if (!Read_Header(device(), h)) {
+        return false;
+    }
 
     QImage img;
-    if (!LoadHDR(s, width, height, img)) {
+    if (!LoadHDR(device(), h, imageFormat(m_quality), m_clipRect, m_scaledSize, img)) {
         // qDebug() << "Error loading HDR file.";
         return false;
     }
 
+    if (img.format() != QImage::Format_RGB32) {
+        img.setColorSpace(QColorSpace(QColorSpace::SRgbLinear));
+    }
+
     *outImage = img;
     return true;
 }
 
 HDRHandler::HDRHandler()
+    : m_quality(-1)
 {
 }
 
+bool HDRHandler::supportsOption(ImageOption option) const
+{
+    if (option == QImageIOHandler::Size) {
+        return true;
+    }
+    if (option == QImageIOHandler::Quality) {
+        return true;
+    }
+    if (option == QImageIOHandler::ClipRect) {
+        return true;
+    }
+    if (option == QImageIOHandler::ScaledSize) {
+        return true;
+    }
+    return false;
+}
+
+void HDRHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == QImageIOHandler::Quality) {
+        bool ok = false;
+        auto q = value.toInt(&ok);
+        if (ok) {
+            m_quality = q;
+        }
+    }
+    if (option == QImageIOHandler::ClipRect) {
+        m_clipRect = value.toRect();
+    }
+    if (option == QImageIOHandler::ScaledSize) {
+        m_scaledSize = value.toSize();
+    }
+}
+
+QVariant HDRHandler::option(ImageOption option) const
+{
+    QVariant v;
+
+    if (option == QImageIOHandler::Size) {
+        if (auto d = device()) {
+            // transactions works on both random and sequential devices
+            d->startTransaction();
+            Header h;
+            if (Read_Header(d, h)) {
+                v = QVariant::fromValue(QSize(h.width, h.height));
+            }
+            d->rollbackTransaction();
+        }
+    }
+
+    if (option == QImageIOHandler::Quality) {
+        v = m_quality;
+    }
+
+    if (option == QImageIOHandler::ClipRect) {
+        v = m_clipRect;
+    }
+
+    if (option == QImageIOHandler::ScaledSize) {
+        v = m_scaledSize;
+    }
+
+    return v;
+}
+
+bool HDRHandler::write(const QImage &image)
+{
+    auto d = device();
+    const int width = image.width();
+    const int height = image.height();
+    if (image.isNull() || d == nullptr) {
+        return false;
+    }
+
+    const QByteArray header = QByteArrayLiteral("#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y ") + QByteArray::number(height) + QByteArrayLiteral(" +X ")
+        + QByteArray::number(width) + QByteArrayLiteral("\n");
+    if (d->write(header) != header.size()) {
+        return false;
+    }
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    // float images without a colorspace conversion are encoded without copies
+    const bool isLinear = imageColorSpace(image).transferFunction() == QColorSpace::TransferFunction::Linear;
+    const bool isFloat = image.format() == QImage::Format_RGBX32FPx4 || image.format() == QImage::Format_RGBA32FPx4;
+    const bool isHalf = image.format() == QImage::Format_RGBX16FPx4 || image.format() == QImage::Format_RGBA16FPx4;
+#endif
+
+    QVector<float> floatLine(4 * width);
+    QByteArray planes(4 * width, Qt::Uninitialized);
+    QByteArray encoded;
+
+    QImage band;
+    for (int y = 0; y < height; y++) {
+        const float *line = floatLine.constData();
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+        if (isLinear && isFloat) {
+            line = reinterpret_cast<const float *>(image.constScanLine(y));
+        } else if (isLinear && isHalf) {
+            qFloatFromFloat16(floatLine.data(), reinterpret_cast<const qfloat16 *>(image.constScanLine(y)), qsizetype(width) * 4);
+        } else {
+            if (y % BAND_HEIGHT == 0) {
+                band = Read_Band(image, y, std::min(BAND_HEIGHT, height - y));
+            }
+            line = reinterpret_cast<const float *>(band.constScanLine(y % BAND_HEIGHT));
+        }
+#else
+        if (y % BAND_HEIGHT == 0) {
+            band = Read_Band(image, y, std::min(BAND_HEIGHT, height - y));
+        }
+        auto rgba64 = reinterpret_cast<const quint16 *>(band.constScanLine(y % BAND_HEIGHT));
+        for (int j = 0, n = 4 * width; j < n; j++) {
+            floatLine[j] = rgba64[j] / 65535.0f;
+        }
+#endif
+
+        FloatLine_To_RGBE(line, reinterpret_cast<uchar *>(planes.data()), width);
+        Write_Scanline(reinterpret_cast<const uchar *>(planes.constData()), width, encoded);
+        if (d->write(encoded) != encoded.size()) {
+            qCDebug(HDRPLUGIN) << "Error while writing the line" << y;
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool HDRHandler::canRead() const
 {
     if (canRead(device())) {
@@ -273,7 +1044,7 @@ bool HDRHandler::canRead(QIODevice *device)
 QImageIOPlugin::Capabilities HDRPlugin::capabilities(QIODevice *device, const QByteArray &format) const
 {
     if (format == "hdr") {
-        return Capabilities(CanRead);
+        return Capabilities(CanRead | CanWrite);
     }
     if (!format.isEmpty()) {
         return {};
@@ -286,6 +1057,9 @@ QImageIOPlugin::Capabilities HDRPlugin::capabilities(QIODevice *device, const QB
     if (device->isReadable() && HDRHandler::canRead(device)) {
         cap |= CanRead;
     }
+    if (device->isWritable()) {
+        cap |= CanWrite;
+    }
     return cap;
 }
 
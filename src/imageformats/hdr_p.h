@@ -9,6 +9,9 @@
 #define KIMG_HDR_P_H
 
 #include <QImageIOPlugin>
+#include <QRect>
+#include <QSize>
+#include <QVariant>
 
 class HDRHandler : public QImageIOHandler
 {
@@ -17,8 +20,35 @@ public:
 
     bool canRead() const override;
     bool read(QImage *outImage) override;
+    bool write(const QImage &image) override;
+
+    bool supportsOption(QImageIOHandler::ImageOption option) const override;
+    void setOption(QImageIOHandler::ImageOption option, const QVariant &value) override;
+    QVariant option(QImageIOHandler::ImageOption option) const override;
 
     static bool canRead(QIODevice *device);
+
+private:
+    /*!
+     * \brief m_quality
+     * Selects the format of the decoded image: the default (-1) is an 8-bit
+     * RGB32 image, from 0 to 99 an half float image and 100 a float image.
+     * \note Float formats require Qt 6.2 or newer.
+     */
+    int m_quality;
+
+    /*!
+     * \brief m_clipRect
+     * Part of the image to decode: the decoder stops after the last scanline
+     * of the rectangle.
+     */
+    QRect m_clipRect;
+
+    /*!
+     * \brief m_scaledSize
+     * Size of the returned image: the image is box filtered while decoding.
+     */
+    QSize m_scaledSize;
 };
 
 class HDRPlugin : public QImageIOPlugin
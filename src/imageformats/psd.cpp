@@ -20,7 +20,9 @@
 
 /*
  * Limitations of the current code:
- * - 32-bit float image are converted to 16-bit integer image.
+ * - 32-bit float image are converted to 16-bit integer image, unless they are
+ *   read with Quality 100 (PSD_QUALITY_FLOAT32) and Qt 6.2 or newer: then they
+ *   are decoded to float images (grayscale ones as RGB).
  * - Other color spaces cannot directly be read due to lack of QImage support for
  *   color spaces other than RGB (and Grayscale). Where possible, a conversion
  *   to RGB is done:
@@ -32,32 +34,52 @@
  *   color management engine (e.g. LittleCMS).
  */
 
-#include "fastmath_p.h"
 #include "psd_p.h"
+#include "psdkernels_p.h"
 #include "util_p.h"
 
 #include <QDataStream>
 #include <QDebug>
+#include <QFile>
 #include <QImage>
+#include <QPainter>
+#include <QScopeGuard>
 #include <QColorSpace>
+#include <QRunnable>
+#include <QThreadPool>
+#include <QtEndian>
 
+#ifdef PSD_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cmath>
 
 typedef quint32 uint;
 typedef quint16 ushort;
 typedef quint8 uchar;
 
-/* The fast LAB conversion converts the image to linear sRgb instead to sRgb.
- * This should not be a problem because the Qt's QColorSpace supports the linear
- * sRgb colorspace.
- *
- * Using linear conversion, the loading speed is slightly improved. Anyway, if you are using
- * an software that discard color info, you should comment it.
- *
- * At the time I'm writing (07/2022), Gwenview and Krita supports linear sRgb but KDE
- * preview creator does not. This is the why, for now, it is disabled.
+/* The image data are decoded in bands of lines by a pool of threads: a band
+ * has a multiple of PSD_MIN_BAND_HEIGHT lines and there are up to PSD_BANDS_PER_THREAD
+ * bands per thread to balance the load when the compression ratio is not uniform.
+ * The KIMAGEFORMATS_THREADS environment variable overrides the number of threads.
+ * The writer stores the compressed lines of each PSD_MIN_BAND_HEIGHT rows in a buffer.
+ */
+#define PSD_MIN_BAND_HEIGHT 16
+#define PSD_BANDS_PER_THREAD 4
+
+/* Size of the chunks of the ZIP compressed data passed to zlib, and of the
+ * lines inflated at once. The ZIP compressed images are not supported when
+ * the plugin is built without zlib (PSD_HAVE_ZLIB not defined).
+ */
+#define PSD_ZIP_CHUNK_SIZE (256 * 1024)
+
+/* Quality option value which decodes the 32-bit images as float (Qt 6.2 or
+ * newer): with any other value they are converted to 16-bit integers.
  */
-//#define PSD_FAST_LAB_CONVERSION
+#define PSD_QUALITY_FLOAT32 100
 
 namespace // Private.
 {
@@ -82,6 +104,8 @@ enum ColorMode : quint16 {
 
 enum ImageResourceId : quint16 {
     IRI_RESOLUTIONINFO = 0x03ED,
+    IRI_THUMBNAIL_PS4 = 0x0409,
+    IRI_THUMBNAIL = 0x040C,
     IRI_ICCPROFILE = 0x040F,
     IRI_TRANSPARENCYINDEX = 0x0417,
     IRI_VERSIONINFO = 0x0421,
@@ -91,7 +115,10 @@ enum ImageResourceId : quint16 {
 enum LayerId : quint32 {
     LI_MT16 = 0x4D743136,   // 'Mt16',
     LI_MT32 = 0x4D743332,   // 'Mt32',
-    LI_MTRN = 0x4D74726E    // 'Mtrn'
+    LI_MTRN = 0x4D74726E,   // 'Mtrn'
+    LI_LUNI = 0x6C756E69,   // 'luni'
+    LI_LR16 = 0x4C723136,   // 'Lr16'
+    LI_LR32 = 0x4C723332    // 'Lr32'
 };
 
 struct PSDHeader {
@@ -135,6 +162,44 @@ struct PSDLayerInfo {
     qint16 layerCount = 0;
 };
 
+/*!
+ * \brief The PSDLayerChannel struct
+ * Channel ids: 0, 1, 2... are the color channels, -1 is the transparency mask
+ * and -2/-3 are the user supplied layer masks.
+ */
+struct PSDLayerChannel {
+    qint16 id = 0;
+    qint64 length = 0;  // size of the channel image data (compression field included)
+};
+
+/*!
+ * \brief The PSDLayerRecord struct
+ * Only the information needed to extract the layer as an image.
+ */
+struct PSDLayerRecord {
+    qint32 top = 0;
+    qint32 left = 0;
+    qint32 bottom = 0;
+    qint32 right = 0;
+    QVector<PSDLayerChannel> channels;
+    quint32 blendMode = 0;  // e.g. 'norm', 'mul '
+    quint8 opacity = 255;
+    quint8 clipping = 0;
+    quint8 flags = 0;
+    QString name;
+
+    QRect rect() const {
+        return QRect(QPoint(left, top), QPoint(right - 1, bottom - 1));
+    }
+
+    qint64 dataSize() const {
+        qint64 size = 0;
+        for (auto &&c : channels)
+            size += c.length;
+        return size;
+    }
+};
+
 struct PSDGlobalLayerMaskInfo {
     qint64 size = -1;
 };
@@ -143,6 +208,8 @@ struct PSDAdditionalLayerInfo {
     Signature signature = Signature();
     LayerId id = LayerId();
     qint64 size = -1;
+    bool largeSize = false;  // the size is 64-bits
+    qint16 layerCount = 0;   // Lr16 and Lr32 only
 };
 
 struct PSDLayerAndMaskSection {
@@ -157,6 +224,8 @@ struct PSDLayerAndMaskSection {
 
     bool hasAlpha() const {
         return layerInfo.layerCount < 0 ||
+               additionalLayerInfo.value(LI_LR16).layerCount < 0 ||
+               additionalLayerInfo.value(LI_LR32).layerCount < 0 ||
                additionalLayerInfo.contains(LI_MT16) ||
                additionalLayerInfo.contains(LI_MT32) ||
                additionalLayerInfo.contains(LI_MTRN);
@@ -175,13 +244,23 @@ struct PSDLayerAndMaskSection {
         auto aliv = additionalLayerInfo.values();
         for (auto &&v : aliv) {
             currentSize += (12 + v.size);
-            if (v.signature == S_8B64)
+            if (v.largeSize)
                 currentSize += 4;
         }
         return (size <= currentSize);
     }
 };
 
+/*!
+ * \brief The PSDReadOptions struct
+ * The options of the handler which change the decoding.
+ */
+struct PSDReadOptions {
+    QRect clipRect;
+    QSize scaledSize;
+    bool floatOutput = false;   // 32-bit images are decoded as float (Qt 6.2 or newer)
+};
+
 /*!
  * \brief fixedPointToDouble
  * Converts a fixed point number to floating point one.
@@ -354,7 +433,34 @@ static PSDImageResourceSection readImageResourceSection(QDataStream &s, bool *ok
     return irs;
 }
 
-PSDAdditionalLayerInfo readAdditionalLayer(QDataStream &s, bool *ok = nullptr)
+/*!
+ * \brief hasLargeSize
+ * \return True if the additional layer information \a key has a 64-bits size in PSB files.
+ */
+static bool hasLargeSize(quint32 key)
+{
+    switch (key) {
+    case 0x4C4D736B: // 'LMsk'
+    case LI_LR16:
+    case LI_LR32:
+    case 0x4C617972: // 'Layr'
+    case LI_MT16:
+    case LI_MT32:
+    case LI_MTRN:
+    case 0x416C7068: // 'Alph'
+    case 0x464D736B: // 'FMsk'
+    case 0x6C6E6B32: // 'lnk2'
+    case 0x46456964: // 'FEid'
+    case 0x46586964: // 'FXid'
+    case 0x50785344: // 'PxSD'
+        return true;
+    default:
+        break;
+    }
+    return false;
+}
+
+PSDAdditionalLayerInfo readAdditionalLayer(QDataStream &s, bool isPsb, bool *ok = nullptr)
 {
     PSDAdditionalLayerInfo li;
 
@@ -372,11 +478,19 @@ PSDAdditionalLayerInfo readAdditionalLayer(QDataStream &s, bool *ok = nullptr)
     if (!*ok)
         return li;
 
-    li.size = readSize(s, li.signature == S_8B64);
+    li.largeSize = li.signature == S_8B64 || (isPsb && hasLargeSize(li.id));
+    li.size = readSize(s, li.largeSize);
     *ok = li.size >= 0;
     if (!*ok)
         return li;
 
+    // the layer info of the 16-bit and 32-bit documents
+    if ((li.id == LI_LR16 || li.id == LI_LR32) && li.size >= 2) {
+        s >> li.layerCount;
+        *ok = s.status() == QDataStream::Ok && skip_data(s, li.size - 2);
+        return li;
+    }
+
     *ok = skip_data(s, li.size);
 
     return li;
@@ -416,7 +530,7 @@ PSDLayerAndMaskSection readLayerAndMaskSection(QDataStream &s, bool isPsb, bool
     // read additional layer info
     if (s.status() == QDataStream::Ok) {
         for (bool ok = true; ok && !lms.atEnd(isPsb);) {
-            auto al = readAdditionalLayer(s, &ok);
+            auto al = readAdditionalLayer(s, isPsb, &ok);
             if (ok)
                 lms.additionalLayerInfo.insert(al.id, al);
         }
@@ -427,6 +541,94 @@ PSDLayerAndMaskSection readLayerAndMaskSection(QDataStream &s, bool isPsb, bool
     return lms;
 }
 
+/*!
+ * \brief readLayerRecord
+ * Reads a layer record of the layer info.
+ * \param s The stream.
+ * \param isPsb True for a large document format.
+ * \param ok Pointer to the operation result variable.
+ * \return The layer record: the stream is positioned on the next record.
+ */
+static PSDLayerRecord readLayerRecord(QDataStream &s, bool isPsb, bool *ok = nullptr)
+{
+    PSDLayerRecord lr;
+
+    bool tmp = true;
+    if (ok == nullptr)
+        ok = &tmp;
+    *ok = false;
+
+    s >> lr.top >> lr.left >> lr.bottom >> lr.right;
+
+    quint16 channels;
+    s >> channels;
+    if (s.status() != QDataStream::Ok || channels > 57) {
+        return lr;
+    }
+    for (quint16 i = 0; i < channels; ++i) {
+        PSDLayerChannel channel;
+        s >> channel.id;
+        channel.length = readSize(s, isPsb);
+        if (channel.length < 0) {
+            return lr;
+        }
+        lr.channels.append(channel);
+    }
+
+    quint32 signature;
+    s >> signature;
+    if (signature != S_8BIM) {
+        return lr;
+    }
+    quint8 filler;
+    s >> lr.blendMode >> lr.opacity >> lr.clipping >> lr.flags >> filler;
+
+    // Extra data: layer mask, blending ranges, name and additional layer information
+    quint32 extraSize;
+    s >> extraSize;
+    if (s.status() != QDataStream::Ok) {
+        return lr;
+    }
+    auto device = s.device();
+    const auto extraEnd = device->pos() + extraSize;
+    if (!skip_section(s) || !skip_section(s)) {
+        return lr;
+    }
+    lr.name = readPascalString(s, 4);
+
+    // the Unicode name is in the additional layer information
+    while (s.status() == QDataStream::Ok && device->pos() + 12 <= extraEnd) {
+        quint32 key;
+        s >> signature >> key;
+        if (signature != S_8BIM && signature != S_8B64) {
+            break;
+        }
+        auto size = readSize(s, isPsb && hasLargeSize(key));
+        if (size < 0 || device->pos() + size > extraEnd) {
+            break;
+        }
+        if (key == LI_LUNI) {
+            quint32 count;
+            s >> count;
+            if (count > 0 && count <= (size - 4) / 2) {
+                QVector<quint16> utf16(count);
+                for (auto &&c : utf16)
+                    s >> c;
+                if (s.status() == QDataStream::Ok)
+                    lr.name = QString::fromUtf16(reinterpret_cast<const char16_t *>(utf16.constData()), utf16.size());
+            }
+            break;
+        }
+        if (!skip_data(s, size)) {
+            break;
+        }
+    }
+
+    s.resetStatus();
+    *ok = device->seek(extraEnd);
+    return lr;
+}
+
 /*!
  * \brief readColorModeDataSection
  * Read the color mode section
@@ -558,6 +760,29 @@ static bool setResolution(QImage& img, const PSDImageResourceSection& irs)
     return true;
 }
 
+/*!
+ * \brief thumbnail
+ * Decodes the JPEG thumbnail of the image resources (Photoshop 4.0 ones are BGR).
+ * \param irs The image resource section.
+ * \return The thumbnail or a null image if there is none.
+ */
+static QImage thumbnail(const PSDImageResourceSection& irs)
+{
+    auto id = irs.contains(IRI_THUMBNAIL) ? IRI_THUMBNAIL : IRI_THUMBNAIL_PS4;
+    if (!irs.contains(id))
+        return QImage();
+    auto irb = irs.value(id);
+
+    // 28 bytes of header: format (1 = kJpegRGB), width, height, widthbytes,
+    // total size, compressed size, bits per pixel and number of planes
+    if (irb.data.size() <= 28 || qFromBigEndian<quint32>(irb.data.constData()) != 1)
+        return QImage();
+    auto img = QImage::fromData(reinterpret_cast<const uchar *>(irb.data.constData()) + 28, irb.data.size() - 28, "JPG");
+    if (id == IRI_THUMBNAIL_PS4)
+        img = img.rgbSwapped();
+    return img;
+}
+
 /*!
  * \brief setTransparencyIndex
  * Search for transparency index block and, if found, changes the alpha of the value at the given index.
@@ -718,12 +943,51 @@ qint64 decompress(const char *input, qint64 ilen, char *output, qint64 olen)
     return j;
 }
 
+/*!
+ * \brief compress
+ * PackBits compression.
+ * \param input The uncompressed input buffer.
+ * \param ilen The input buffer size.
+ * \param output The compressed target buffer: it must have room for at least ilen + (ilen + 127) / 128 bytes.
+ * \return The number of bytes written in the target buffer.
+ */
+qint64 compress(const char *input, qint64 ilen, char *output)
+{
+    qint64 j = 0;
+    for (qint64 ip = 0; ip < ilen;) {
+        // replicate run of at least 3 bytes
+        qint64 rr = 1;
+        while (ip + rr < ilen && rr < 128 && input[ip + rr] == input[ip])
+            ++rr;
+        if (rr > 2) {
+            output[j++] = char(1 - rr);
+            output[j++] = input[ip];
+            ip += rr;
+            continue;
+        }
+
+        // literal run up to the next replicate run
+        auto start = ip;
+        while (ip < ilen && ip - start < 128) {
+            if (ip + 2 < ilen && input[ip] == input[ip + 1] && input[ip] == input[ip + 2])
+                break;
+            ++ip;
+        }
+        rr = ip - start;
+        output[j++] = char(rr - 1);
+        memcpy(output + j, input + start, size_t(rr));
+        j += rr;
+    }
+    return j;
+}
+
 /*!
  * \brief imageFormat
  * \param header The PSD header.
+ * \param floatOutput True to keep the samples of 32-bit RGB images as float.
  * \return The Qt image format.
  */
-static QImage::Format imageFormat(const PSDHeader &header, bool alpha)
+static QImage::Format imageFormat(const PSDHeader &header, bool alpha, bool floatOutput = false)
 {
     if (header.channel_count == 0) {
         return QImage::Format_Invalid;
@@ -732,6 +996,13 @@ static QImage::Format imageFormat(const PSDHeader &header, bool alpha)
     auto format = QImage::Format_Invalid;
     switch(header.color_mode) {
     case CM_RGB:
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+        if (header.depth == 32 && floatOutput)
+            format = header.channel_count < 4 || !alpha ? QImage::Format_RGBX32FPx4 : QImage::Format_RGBA32FPx4;
+        else
+#else
+        Q_UNUSED(floatOutput)
+#endif
         if (header.depth == 16 || header.depth == 32)
             format = header.channel_count < 4 || !alpha ? QImage::Format_RGBX64 : QImage::Format_RGBA64;
         else
@@ -788,36 +1059,6 @@ static qint32 imageChannels(const QImage::Format& format)
     return c;
 }
 
-inline quint8 xchg(quint8 v) {
-    return v;
-}
-
-inline quint16 xchg(quint16 v) {
-#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
-    return quint16( (v>>8) | (v<<8) );
-#else
-    return v;   // never tested
-#endif
-}
-
-inline quint32 xchg(quint32 v) {
-#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
-    return quint32( (v>>24) | ((v & 0x00FF0000)>>8) | ((v & 0x0000FF00)<<8) | (v<<24) );
-#else
-    return v;  // never tested
-#endif
-}
-
-template<class T>
-inline void planarToChunchy(uchar *target, const char *source, qint32 width, qint32 c, qint32 cn)
-{
-    auto s = reinterpret_cast<const T*>(source);
-    auto t = reinterpret_cast<T*>(target);
-    for (qint32 x = 0; x < width; ++x) {
-        t[x*cn+c] = xchg(s[x]);
-    }
-}
-
 template<class T, T min = 0, T max = 1>
 inline void planarToChunchyFloat(uchar *target, const char *source, qint32 width, qint32 c, qint32 cn)
 {
@@ -830,305 +1071,728 @@ inline void planarToChunchyFloat(uchar *target, const char *source, qint32 width
     }
 }
 
-inline void monoInvert(uchar *target, const char* source, qint32 bytes)
-{
-    auto s = reinterpret_cast<const quint8*>(source);
-    auto t = reinterpret_cast<quint8*>(target);
-    for (qint32 x = 0; x < bytes; ++x) {
-        t[x] = ~s[x];
-    }
-}
-
+/*!
+ * \brief decimate
+ * Averages each group of \a factor big-endian samples (box filter): the result is big-endian too.
+ * \param sampling When true, the first sample of each group is taken instead (e.g. palette indexes).
+ */
 template<class T>
-inline void cmykToRgb(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha = false)
+inline void decimate(char *target, const char *source, qint32 width, qint32 factor, bool sampling = false)
 {
     auto s = reinterpret_cast<const T*>(source);
     auto t = reinterpret_cast<T*>(target);
-    auto max = double(std::numeric_limits<T>::max());
-    auto invmax = 1.0 / max; // speed improvements by ~10%
-
-    if (sourceChannels < 4) {
-        qDebug() << "cmykToRgb: image is not a valid CMYK!";
-        return;
-    }
-
-    for (qint32 w = 0; w < width; ++w) {
-        auto ps = s + sourceChannels * w;
-        auto C = 1 - *(ps + 0) * invmax;
-        auto M = 1 - *(ps + 1) * invmax;
-        auto Y = 1 - *(ps + 2) * invmax;
-        auto K = 1 - *(ps + 3) * invmax;
-
-        auto pt = t + targetChannels * w;
-        *(pt + 0) = T(std::min(max - (C * (1 - K) + K) * max + 0.5, max));
-        *(pt + 1) = T(std::min(max - (M * (1 - K) + K) * max + 0.5, max));
-        *(pt + 2) = T(std::min(max - (Y * (1 - K) + K) * max + 0.5, max));
-        if (targetChannels == 4) {
-            if (sourceChannels >= 5 && alpha)
-                *(pt + 3) = *(ps + 4);
-            else
-                *(pt + 3) = std::numeric_limits<T>::max();
+    for (qint32 x = 0; x < width; ++x, s += factor) {
+        if (sampling) {
+            t[x] = s[0];
+            continue;
+        }
+        quint64 sum = 0;
+        for (qint32 i = 0; i < factor; ++i) {
+            sum += xchg(s[i]);
         }
+        t[x] = xchg(T((sum + factor / 2) / factor));
     }
 }
 
-inline double finv(double v)
+inline void decimateFloat(char *target, const char *source, qint32 width, qint32 factor)
 {
-    return (v > 6.0 / 29.0 ? v * v * v : (v - 16.0 / 116.0) / 7.787);
+    auto s = reinterpret_cast<const quint32*>(source);
+    auto t = reinterpret_cast<quint32*>(target);
+    for (qint32 x = 0; x < width; ++x, s += factor) {
+        double sum = 0;
+        for (qint32 i = 0; i < factor; ++i) {
+            auto tmp = xchg(s[i]);
+            sum += *reinterpret_cast<float*>(&tmp);
+        }
+        auto avg = float(sum / factor);
+        t[x] = xchg(*reinterpret_cast<quint32*>(&avg));
+    }
 }
 
-inline double gammaCorrection(double linear)
+inline void monoInvert(uchar *target, const char* source, qint32 bytes)
 {
-#ifdef PSD_FAST_LAB_CONVERSION
-    return linear;
-#else
-    // Replacing fastPow with std::pow the conversion time is 2/3 times longer: using fastPow
-    // there are minimal differences in the conversion that are not visually noticeable.
-    return (linear > 0.0031308 ? 1.055 * fastPow(linear, 1.0 / 2.4) - 0.055 : 12.92 * linear);
-#endif
+    auto s = reinterpret_cast<const quint8*>(source);
+    auto t = reinterpret_cast<quint8*>(target);
+    for (qint32 x = 0; x < bytes; ++x) {
+        t[x] = ~s[x];
+    }
 }
 
-template<class T>
-inline void labToRgb(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha = false)
+/*!
+ * \brief readChannel
+ * Decodes a stride from the image data in memory.
+ * \param target Scratch buffer of the size of an uncompressed stride.
+ * \param length Number of bytes of the stride needed: the decompression stops there.
+ * \return The uncompressed stride: uncompressed data are used in place.
+ */
+static const char *readChannel(QByteArray &target, const char *source, quint32 compressedSize, quint16 compression, qsizetype length)
 {
-    auto s = reinterpret_cast<const T*>(source);
-    auto t = reinterpret_cast<T*>(target);
-    auto max = double(std::numeric_limits<T>::max());
-    auto invmax = 1.0 / max;
-
-    if (sourceChannels < 3) {
-        qDebug() << "labToRgb: image is not a valid LAB!";
-        return;
-    }
-
-    for (qint32 w = 0; w < width; ++w) {
-        auto ps = s + sourceChannels * w;
-        auto L = (*(ps + 0) * invmax) * 100.0;
-        auto A = (*(ps + 1) * invmax) * 255.0 - 128.0;
-        auto B = (*(ps + 2) * invmax) * 255.0 - 128.0;
-
-        // converting LAB to XYZ (D65 illuminant)
-        auto Y = (L + 16.0) * (1.0 / 116.0);
-        auto X = A * (1.0 / 500.0) + Y;
-        auto Z = Y - B * (1.0 / 200.0);
-
-        // NOTE: use the constants of the illuminant of the target RGB color space
-        X = finv(X) * 0.9504;   // D50: * 0.9642
-        Y = finv(Y) * 1.0000;   // D50: * 1.0000
-        Z = finv(Z) * 1.0888;   // D50: * 0.8251
-
-        // converting XYZ to sRGB (sRGB illuminant is D65)
-        auto r = gammaCorrection(  3.24071   * X - 1.53726  * Y - 0.498571  * Z);
-        auto g = gammaCorrection(- 0.969258  * X + 1.87599  * Y + 0.0415557 * Z);
-        auto b = gammaCorrection(  0.0556352 * X - 0.203996 * Y + 1.05707   * Z);
-
-        auto pt = t + targetChannels * w;
-        *(pt + 0) = T(std::max(std::min(r * max + 0.5, max), 0.0));
-        *(pt + 1) = T(std::max(std::min(g * max + 0.5, max), 0.0));
-        *(pt + 2) = T(std::max(std::min(b * max + 0.5, max), 0.0));
-        if (targetChannels == 4) {
-            if (sourceChannels >= 4 && alpha)
-                *(pt + 3) = *(ps + 3);
-            else
-                *(pt + 3) = std::numeric_limits<T>::max();
+    length = std::min(length, qsizetype(target.size()));
+    if (compression == 0) {
+        if (compressedSize < quint32(length)) {
+            return nullptr;
+        }
+        // the samples of 16 and 32-bit images are read as integers
+        if ((quintptr(source) & 3) == 0) {
+            return source;
         }
+        memcpy(target.data(), source, length);
+        return target.constData();
     }
+    // a run is not longer than 128 bytes: decompress() can stop before the end of
+    // the output only when the next run does not fit, so 128 more bytes are enough
+    if (decompress(source, compressedSize, target.data(), std::min(length + 128, qsizetype(target.size()))) < 0) {
+        return nullptr;
+    }
+    return target.constData();
 }
 
-bool readChannel(QByteArray& target, QDataStream &stream, quint32 compressedSize, quint16 compression)
+/*!
+ * \brief The ImageData class
+ * The image data section: the strides are decoded from memory, so the section
+ * is mapped from the file when possible, otherwise it is read once.
+ */
+class ImageData
 {
-    if (compression) {
-        if (compressedSize > kMaxQVectorSize) {
-            return false;
+public:
+    ImageData()
+        : m_file(nullptr)
+        , m_map(nullptr)
+        , m_data(nullptr)
+        , m_size(0)
+    {
+    }
+    ~ImageData()
+    {
+        if (m_map) {
+            m_file->unmap(m_map);
         }
-        QByteArray tmp;
-        tmp.resize(compressedSize);
-        if (stream.readRawData(tmp.data(), tmp.size()) != tmp.size()) {
+    }
+    ImageData(const ImageData &) = delete;
+    ImageData &operator=(const ImageData &) = delete;
+
+    /*!
+     * \brief load
+     * Loads \a size bytes from the current position of the stream: a negative
+     * size loads the data up to the end of the stream.
+     */
+    bool load(QDataStream &stream, qint64 size)
+    {
+        auto device = stream.device();
+        if (size < 0) {
+            m_buffer = device->readAll();
+            m_data = m_buffer.constData();
+            m_size = m_buffer.size();
+            return true;
+        }
+        auto file = qobject_cast<QFile *>(device);
+        if (file && !file->isSequential() && size > 0) {
+            const auto pos = device->pos();
+            m_map = file->map(pos, size);
+            if (m_map) {
+                m_file = file;
+                m_data = reinterpret_cast<const char *>(m_map);
+                m_size = size;
+                return device->seek(pos + size);
+            }
+        }
+
+        if (size > kMaxQVectorSize) {
+            qWarning() << "ImageData::load() image data too big" << size;
             return false;
         }
-        if (decompress(tmp.data(), tmp.size(), target.data(), target.size()) < 0) {
+        m_buffer.resize(size);
+        if (stream.readRawData(m_buffer.data(), m_buffer.size()) != m_buffer.size()) {
             return false;
         }
+        m_data = m_buffer.constData();
+        m_size = size;
+        return true;
     }
-    else if (stream.readRawData(target.data(), target.size()) != target.size()) {
-        return false;
+
+    const char *data() const
+    {
+        return m_data;
     }
 
-    return stream.status() == QDataStream::Ok;
-}
+    qint64 size() const
+    {
+        return m_size;
+    }
 
-// Load the PSD image.
-static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
-{
-    // Checking for PSB
-    auto isPsb = header.version == 2;
-    bool ok = false;
+private:
+    QFile *m_file;
+    uchar *m_map;
+    QByteArray m_buffer;
+    const char *m_data;
+    qint64 m_size;
+};
 
-    // Color Mode Data section
-    auto cmds = readColorModeDataSection(stream, &ok);
-    if (!ok) {
-        qDebug() << "Error while skipping Color Mode Data section";
-        return false;
+/*!
+ * \brief processBands
+ * Calls \a func(y0, y1) for the bands of lines [y0, y1) which cover the image.
+ * When there is more than one band, they are processed in parallel.
+ * \return False if any call failed.
+ */
+template<class Func>
+static bool processBands(qint32 height, Func func)
+{
+    const qint32 threads = decoderThreadCount();
+    const qint32 minHeight = (height + threads * PSD_BANDS_PER_THREAD - 1) / (threads * PSD_BANDS_PER_THREAD);
+    const qint32 bandHeight = std::max(qint32(1), (minHeight + PSD_MIN_BAND_HEIGHT - 1) / PSD_MIN_BAND_HEIGHT) * PSD_MIN_BAND_HEIGHT;
+    if (threads == 1 || bandHeight >= height) {
+        return func(0, height);
+    }
+
+    // a local pool to not interfere with the application pool
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    std::atomic<bool> ok(true);
+    for (qint32 y = 0; y < height; y += bandHeight) {
+        const qint32 y1 = std::min(y + bandHeight, height);
+        pool.start(QRunnable::create([&func, &ok, y, y1]() {
+            if (ok && !func(y, y1)) {
+                ok = false;
+            }
+        }));
     }
+    pool.waitForDone();
+    return ok;
+}
 
-    // Image Resources Section
-    auto irs = readImageResourceSection(stream, &ok);
-    if (!ok) {
-        qDebug() << "Error while reading Image Resources Section";
-        return false;
-    }
-    // Checking for merged image (Photoshop compatibility data)
-    if (!hasMergedData(irs)) {
-        qDebug() << "No merged data found";
-        return false;
-    }
+/*!
+ * \brief The PSDChannelStrides struct
+ * The lines of a channel in the image data loaded in memory.
+ */
+struct PSDChannelStrides {
+    quint16 compression = 0;
+    QVector<quint32> sizes;     // compressed size of each line
+    QVector<quint64> offsets;   // offset of each line in the image data
+    QByteArray inflated;        // when not null, the lines are in the inflated ZIP data instead
+};
 
-    // Layer and Mask section
-    auto lms = readLayerAndMaskSection(stream, isPsb, &ok);
-    if (!ok) {
-        qDebug() << "Error while skipping Layer and Mask section";
-        return false;
+#ifdef PSD_HAVE_ZLIB
+/*!
+ * \brief unpredict
+ * Reverts the horizontal delta encoding of a line of ZIP with prediction data.
+ * 32-bit lines are also stored as byte planes (the most significant bytes first).
+ * \param scratch Buffer of the size of the line, used by 32-bit lines only.
+ */
+static void unpredict(char *line, qint32 width, quint16 depth, QByteArray &scratch)
+{
+    if (depth == 8) {
+        auto p = reinterpret_cast<quint8 *>(line);
+        for (qint32 x = 1; x < width; ++x) {
+            p[x] += p[x - 1];
+        }
+    } else if (depth == 16) {
+        auto p = reinterpret_cast<quint16 *>(line);
+        qFromBigEndian<quint16>(p, width, p);
+        for (qint32 x = 1; x < width; ++x) {
+            p[x] += p[x - 1];
+        }
+        qToBigEndian<quint16>(p, width, p);
+    } else if (depth == 32) {
+        auto p = reinterpret_cast<quint8 *>(line);
+        for (qint32 x = 1, n = width * 4; x < n; ++x) {
+            p[x] += p[x - 1];
+        }
+        auto t = reinterpret_cast<quint8 *>(scratch.data());
+        for (qint32 x = 0; x < width; ++x) {
+            t[x * 4] = p[x];
+            t[x * 4 + 1] = p[width + x];
+            t[x * 4 + 2] = p[width * 2 + x];
+            t[x * 4 + 3] = p[width * 3 + x];
+        }
+        memcpy(line, t, size_t(width) * 4);
     }
+}
 
-    // Find out if the data is compressed.
-    // Known values:
-    //   0: no compression
-    //   1: RLE compressed
-    quint16 compression;
-    stream >> compression;
-    if (compression > 1) {
-        qDebug() << "Unknown compression type";
+/*!
+ * \brief inflatePlanes
+ * Decompresses ZIP (2) and ZIP with prediction (3) data with zlib, without
+ * copying the compressed data: it is passed to inflate() in chunks given by
+ * \a read, and the prediction is reverted on each line as soon as it is
+ * inflated, while it is still in the cache.
+ * \param read Function (const char **chunk, qint64 maxSize) -> qint64 which
+ * points \a chunk to the next bytes of the stream and returns their number.
+ * \param size Size of the compressed data, -1 when it is unknown (the stream
+ * is read until its end).
+ * \param lines Total number of lines of the planes.
+ * \param raw_count Size of an uncompressed line.
+ * \param target The uncompressed lines.
+ */
+template<class Read>
+static bool inflatePlanes(Read read, qint64 size, qint32 lines, qsizetype raw_count, qint32 width, quint16 depth, quint16 compression, QByteArray &target)
+{
+    const qint64 expected = qint64(lines) * raw_count;
+    if (expected > kMaxQVectorSize) {
+        qWarning() << "inflatePlanes() data too big" << expected;
         return false;
     }
+    target.resize(qsizetype(expected));
 
-    // Try to identify the nature of spots: note that this is just one of many ways to identify the presence
-    // of alpha channels: should work in most cases where colorspaces != RGB/Gray
-    auto alpha = header.color_mode == CM_RGB;
-    if (!lms.isNull())
-        alpha = lms.hasAlpha();
-
-    const QImage::Format format = imageFormat(header, alpha);
-    if (format == QImage::Format_Invalid) {
-        qWarning() << "Unsupported image format. color_mode:" << header.color_mode << "depth:" << header.depth << "channel_count:" << header.channel_count;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) {
         return false;
     }
+    auto cleanup = qScopeGuard([&zs] {
+        inflateEnd(&zs);
+    });
+
+    auto bits = target.data();
+    const bool predicted = compression == 3 && depth != 1;
+    QByteArray scratch;
+    if (predicted && depth == 32) {
+        scratch.resize(raw_count);
+    }
+    qint64 consumed = 0;
+    qint64 produced = 0;
+    qint32 unpredicted = 0;
+    bool end = false;
+    while (produced < expected) {
+        if (zs.avail_in == 0 && !end) {
+            const qint64 maxSize = size < 0 ? PSD_ZIP_CHUNK_SIZE : std::min(qint64(PSD_ZIP_CHUNK_SIZE), size - consumed);
+            const char *chunk = nullptr;
+            const qint64 n = maxSize > 0 ? read(&chunk, maxSize) : 0;
+            if (n > 0) {
+                zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(chunk));
+                zs.avail_in = uInt(n);
+                consumed += n;
+            } else {
+                end = true; // zlib may still have buffered output
+            }
+        }
+        const uInt avail = uInt(std::min(qint64(PSD_ZIP_CHUNK_SIZE), expected - produced));
+        zs.next_out = reinterpret_cast<Bytef *>(bits + produced);
+        zs.avail_out = avail;
+        const int ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            break;
+        }
+        produced += avail - zs.avail_out;
+        if (avail == zs.avail_out && (end || zs.avail_in > 0)) {
+            break; // no progress: truncated stream
+        }
 
-    img = imageAlloc(header.width, header.height, format);
-    if (img.isNull()) {
-        qWarning() << "Failed to allocate image, invalid dimensions?" << QSize(header.width, header.height);
-        return false;
+        // the prediction is applied to each line: the lines are independent
+        if (predicted) {
+            for (const auto done = qint32(produced / raw_count); unpredicted < done; ++unpredicted) {
+                unpredict(bits + unpredicted * raw_count, width, depth, scratch);
+            }
+        }
+        if (ret == Z_STREAM_END) {
+            break;
+        }
     }
-    img.fill(qRgb(0, 0, 0));
-    if (!cmds.palette.isEmpty()) {
-        img.setColorTable(cmds.palette);
-        setTransparencyIndex(img, irs);
+    if (produced != expected) {
+        qDebug() << "Error while inflating the ZIP compressed data" << zs.msg;
+        return false;
     }
+    return true;
+}
+
+/*!
+ * \brief inflatePlanes
+ * Decompresses the ZIP data of \a size bytes at \a source.
+ */
+static bool inflatePlanes(const char *source, qint64 size, qint32 lines, qsizetype raw_count, qint32 width, quint16 depth, quint16 compression, QByteArray &target)
+{
+    auto read = [&source](const char **chunk, qint64 maxSize) -> qint64 {
+        *chunk = source;
+        source += maxSize;
+        return maxSize;
+    };
+    return inflatePlanes(read, size, lines, raw_count, width, depth, compression, target);
+}
+#endif // PSD_HAVE_ZLIB
 
+/*!
+ * \brief decodePlanes
+ * Decodes the planar channels into the allocated image.
+ * \param header The header: width, height and channel_count of the channels.
+ * \param channels The strides of the channels, in the order of the header.
+ */
+static bool decodePlanes(const PSDHeader &header, bool alpha, const ImageData &data, const QVector<PSDChannelStrides> &channels, QImage &img, QRect area = QRect(), qint32 factor = 1)
+{
     auto imgChannels = imageChannels(img.format());
     auto channel_num = std::min(qint32(header.channel_count), imgChannels);
     auto raw_count = qsizetype(header.width * header.depth + 7) / 8;
 
-    if (header.height > kMaxQVectorSize / header.channel_count / sizeof(quint32)) {
-        qWarning() << "LoadPSD() header height/channel_count too big" << header.height << header.channel_count;
+    if (!area.isValid()) {
+        area = QRect(0, 0, header.width, header.height);
+    }
+    if (channels.size() < header.channel_count || factor < 1 || (header.depth == 1 && (factor > 1 || area.left() > 0))) {
+        return false;
+    }
+    if (img.width() * factor > area.width() || img.height() * factor > area.height()) {
         return false;
     }
 
-    QVector<quint32> strides(header.height * header.channel_count, raw_count);
-    // Read the compressed stride sizes
-    if (compression) {
-        for (auto&& v : strides) {
-            if (isPsb) {
-                stream >> v;
-                continue;
+    // the decoded lines are used up to the right edge of the area
+    const auto width = img.width();
+    const auto sampleSize = qsizetype(std::max(header.depth / 8, 1));
+    const auto lineSize = header.depth == 1 ? raw_count : qsizetype(area.left() + area.width()) * sampleSize;
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    const bool fp = img.format() == QImage::Format_RGBX32FPx4 || img.format() == QImage::Format_RGBA32FPx4;
+#else
+    const bool fp = false;
+#endif
+
+    // QImage::scanLine() is not thread safe
+    auto bits = img.bits();
+    auto bpl = qsizetype(img.bytesPerLine());
+
+    auto readStride = [&](QByteArray &rawStride, qint32 c, qint32 y) -> const char * {
+        auto&& channel = channels.at(c);
+        y = area.top() + y * factor;   // lines of the area are skipped by the scale factor
+        auto offset = qint64(channel.offsets.at(y));
+        auto&& strideSize = channel.sizes.at(y);
+        auto source = channel.inflated.isNull() ? data.data() : channel.inflated.constData();
+        auto sourceSize = channel.inflated.isNull() ? data.size() : qint64(channel.inflated.size());
+        const char *stride = nullptr;
+        if (offset + strideSize <= sourceSize) {
+            stride = readChannel(rawStride, source + offset, strideSize, channel.compression, lineSize);
+        }
+        if (stride == nullptr) {
+            qDebug() << "Error while reading the stream of channel" << c << "line" << y;
+        }
+        return stride;
+    };
+
+    // the samples of the area, averaged by groups of factor samples when scaling
+    auto readLine = [&](QByteArray &rawStride, QByteArray &decimated, qint32 c, qint32 y) -> const char * {
+        auto stride = readStride(rawStride, c, y);
+        if (stride == nullptr || header.depth == 1) {
+            return stride;
+        }
+        stride += area.left() * sampleSize;
+        if (factor == 1) {
+            return stride;
+        }
+        if (header.depth == 8) {
+            decimate<quint8>(decimated.data(), stride, width, factor, header.color_mode == CM_INDEXED);
+        } else if (header.depth == 16) {
+            decimate<quint16>(decimated.data(), stride, width, factor);
+        } else if (header.depth == 32) {
+            decimateFloat(decimated.data(), stride, width, factor);
+        }
+        return decimated.constData();
+    };
+
+    // The bands of lines are decoded in parallel, each one with its own scratch
+    // buffers: one per channel, so that the channels of a line are interleaved at once
+    auto readLines = [&](QVector<QByteArray> &rawStrides, QVector<QByteArray> &decimated, QVector<const char *> &strides, qint32 y) -> bool {
+        for (qint32 c = 0, n = strides.size(); c < n; ++c) {
+            strides[c] = readLine(rawStrides[c], decimated[c], c, y);
+            if (strides.at(c) == nullptr) {
+                return false;
             }
-            quint16 tmp;
-            stream >> tmp;
-            v = tmp;
         }
-    }
-    // calculate the absolute file positions of each stride (required when a colorspace conversion should be done)
-    auto device = stream.device();
-    QVector<quint64> stridePositions(strides.size());
-    if (!stridePositions.isEmpty()) {
-        stridePositions[0] = device->pos();
-    }
-    for (qsizetype i = 1, n = stridePositions.size(); i < n; ++i) {
-        stridePositions[i] = stridePositions[i-1] + strides.at(i-1);
-    }
-
-    // Read the image
-    QByteArray rawStride;
-    rawStride.resize(raw_count);
+        return true;
+    };
+    auto allocLines = [&](QVector<QByteArray> &rawStrides, QVector<QByteArray> &decimated, qint32 channels) {
+        rawStrides.resize(channels);
+        decimated.resize(channels);
+        for (qint32 c = 0; c < channels; ++c) {
+            rawStrides[c].resize(raw_count);
+            decimated[c].resize(width * sampleSize);
+        }
+    };
 
     if (header.color_mode == CM_CMYK || header.color_mode == CM_LABCOLOR || header.color_mode == CM_MULTICHANNEL) {
-        // In order to make a colorspace transformation, we need all channels of a scanline
-        QByteArray psdScanline;
-        psdScanline.resize(qsizetype(header.width * std::min(header.depth, quint16(16)) * header.channel_count + 7) / 8);
-        for (qint32 y = 0, h = header.height; y < h; ++y) {
-            for (qint32 c = 0; c < header.channel_count; ++c) {
-                auto strideNumber = c * qsizetype(h) + y;
-                if (!device->seek(stridePositions.at(strideNumber))) {
-                    qDebug() << "Error while seeking the stream of channel" << c << "line" << y;
-                    return false;
-                }
-                auto&& strideSize = strides.at(strideNumber);
-                if (!readChannel(rawStride, stream, strideSize, compression)) {
-                    qDebug() << "Error while reading the stream of channel" << c << "line" << y;
+        auto decodeBand = [&](qint32 y0, qint32 y1) -> bool {
+            QVector<QByteArray> rawStrides;
+            QVector<QByteArray> decimated;
+            QVector<const char *> strides(header.channel_count);
+            allocLines(rawStrides, decimated, header.channel_count);
+
+            // In order to make a colorspace transformation, we need all channels of a scanline
+            QByteArray psdScanline;
+            psdScanline.resize(qsizetype(width * std::min(header.depth, quint16(16)) * header.channel_count + 7) / 8);
+            auto scanLine = reinterpret_cast<unsigned char*>(psdScanline.data());
+
+            for (qint32 y = y0; y < y1; ++y) {
+                if (!readLines(rawStrides, decimated, strides, y)) {
                     return false;
                 }
 
-                auto scanLine = reinterpret_cast<unsigned char*>(psdScanline.data());
                 if (header.depth == 8) {
-                    planarToChunchy<quint8>(scanLine, rawStride.data(), header.width, c, header.channel_count);
+                    planesToChunchy<quint8>(scanLine, strides.constData(), header.channel_count, header.channel_count, width);
                 }
                 else if (header.depth == 16) {
-                    planarToChunchy<quint16>(scanLine, rawStride.data(), header.width, c, header.channel_count);
+                    planesToChunchy<quint16>(scanLine, strides.constData(), header.channel_count, header.channel_count, width);
                 }
                 else if (header.depth == 32) { // Not currently used
-                    planarToChunchyFloat<quint32>(scanLine, rawStride.data(), header.width, c, header.channel_count);
+                    for (qint32 c = 0; c < header.channel_count; ++c) {
+                        planarToChunchyFloat<quint32>(scanLine, strides.at(c), width, c, header.channel_count);
+                    }
                 }
-            }
 
-            // Conversion to RGB
-            if (header.color_mode == CM_CMYK || header.color_mode == CM_MULTICHANNEL) {
-                if (header.depth == 8)
-                    cmykToRgb<quint8>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width, alpha);
-                else
-                    cmykToRgb<quint16>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width, alpha);
+                // Conversion to RGB
+                auto imgLine = bits + y * bpl;
+                if (header.color_mode == CM_CMYK || header.color_mode == CM_MULTICHANNEL) {
+                    if (header.depth == 8)
+                        cmykToRgb<quint8>(imgLine, imgChannels, psdScanline.data(), header.channel_count, width, alpha);
+                    else
+                        cmykToRgb<quint16>(imgLine, imgChannels, psdScanline.data(), header.channel_count, width, alpha);
+                }
+                if (header.color_mode == CM_LABCOLOR) {
+                    if (header.depth == 8)
+                        labToRgb<quint8>(imgLine, imgChannels, psdScanline.data(), header.channel_count, width, alpha);
+                    else
+                        labToRgb<quint16>(imgLine, imgChannels, psdScanline.data(), header.channel_count, width, alpha);
+                }
             }
-            if (header.color_mode == CM_LABCOLOR) {
-                if (header.depth == 8)
-                    labToRgb<quint8>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width, alpha);
-                else
-                    labToRgb<quint16>(img.scanLine(y), imgChannels, psdScanline.data(), header.channel_count, header.width, alpha);
+            return true;
+        };
+        return processBands(img.height(), decodeBand);
+    }
+
+    // Only the colorspaces supported by QImage: the channels are written directly into the image
+    auto decodeBand = [&](qint32 y0, qint32 y1) -> bool {
+        QVector<QByteArray> rawStrides;
+        QVector<QByteArray> decimated;
+        QVector<const char *> strides(channel_num);
+        allocLines(rawStrides, decimated, channel_num);
+        for (qint32 y = y0; y < y1; ++y) {
+            auto scanLine = bits + y * bpl;
+            if (!readLines(rawStrides, decimated, strides, y)) {
+                return false;
             }
-        }
-    }
-    else {
-        // Linear read (no position jumps): optimized code usable only for the colorspaces supported by QImage
-        for (qint32 c = 0; c < channel_num; ++c) {
-            for (qint32 y = 0, h = header.height; y < h; ++y) {
-                auto&& strideSize = strides.at(c * qsizetype(h) + y);
-                if (!readChannel(rawStride, stream, strideSize, compression)) {
-                    qDebug() << "Error while reading the stream of channel" << c << "line" << y;
-                    return false;
-                }
 
-                auto scanLine = img.scanLine(y);
+            if (header.depth == 8) {            // 8-bits images: Indexed, Grayscale, RGB/RGBA
+                planesToChunchy<quint8>(scanLine, strides.constData(), channel_num, imgChannels, width);
+                continue;
+            }
+            if (header.depth == 16) {           // 16-bits integer images: Grayscale, RGB/RGBA
+                planesToChunchy<quint16>(scanLine, strides.constData(), channel_num, imgChannels, width);
+                continue;
+            }
+            for (qint32 c = 0; c < channel_num; ++c) {
+                auto stride = strides.at(c);
                 if (header.depth == 1) {        // Bitmap
-                    monoInvert(scanLine, rawStride.data(), std::min(rawStride.size(), img.bytesPerLine()));
+                    monoInvert(scanLine, stride, std::min(rawStrides.at(c).size(), img.bytesPerLine()));
                 }
-                else if (header.depth == 8) {   // 8-bits images: Indexed, Grayscale, RGB/RGBA
-                    planarToChunchy<quint8>(scanLine, rawStride.data(), header.width, c, imgChannels);
-                }
-                else if (header.depth == 16) {  // 16-bits integer images: Grayscale, RGB/RGBA
-                    planarToChunchy<quint16>(scanLine, rawStride.data(), header.width, c, imgChannels);
+                else if (header.depth == 32 && fp) { // 32-bits float images: the samples are byte swapped into the float image
+                    planarToChunchy<quint32>(scanLine, stride, width, c, imgChannels);
                 }
                 else if (header.depth == 32) {  // 32-bits float images: Grayscale, RGB/RGBA (coverted to equivalent integer 16-bits)
-                    planarToChunchyFloat<quint32>(scanLine, rawStride.data(), header.width, c, imgChannels);
+                    planarToChunchyFloat<quint32>(scanLine, stride, width, c, imgChannels);
+                }
+            }
+        }
+        return true;
+    };
+    return processBands(img.height(), decodeBand);
+}
+
+// Load the PSD image.
+static bool LoadPSD(QDataStream &stream, const PSDHeader &header, const PSDReadOptions &options, QImage &img, bool *merged = nullptr)
+{
+    // Checking for PSB
+    auto isPsb = header.version == 2;
+    bool ok = false;
+
+    // Color Mode Data section
+    auto cmds = readColorModeDataSection(stream, &ok);
+    if (!ok) {
+        qDebug() << "Error while skipping Color Mode Data section";
+        return false;
+    }
+
+    // Image Resources Section
+    auto irs = readImageResourceSection(stream, &ok);
+    if (!ok) {
+        qDebug() << "Error while reading Image Resources Section";
+        return false;
+    }
+    // Checking for merged image (Photoshop compatibility data)
+    if (!hasMergedData(irs)) {
+        qDebug() << "No merged data found";
+        if (merged)
+            *merged = false;
+        return false;
+    }
+
+    // Layer and Mask section
+    auto lms = readLayerAndMaskSection(stream, isPsb, &ok);
+    if (!ok) {
+        qDebug() << "Error while skipping Layer and Mask section";
+        return false;
+    }
+
+    // Find out if the data is compressed.
+    // Known values:
+    //   0: no compression
+    //   1: RLE compressed
+    //   2: ZIP without prediction
+    //   3: ZIP with prediction
+    quint16 compression;
+    stream >> compression;
+    if (compression > 3) {
+        qDebug() << "Unknown compression type";
+        return false;
+    }
+
+    // Try to identify the nature of spots: note that this is just one of many ways to identify the presence
+    // of alpha channels: should work in most cases where colorspaces != RGB/Gray
+    auto alpha = header.color_mode == CM_RGB;
+    if (!lms.isNull())
+        alpha = lms.hasAlpha();
+
+    // QImage has no float grayscale formats: float grayscale images are decoded as RGB
+    auto imgHeader = header;
+    const bool grayToRgb = options.floatOutput && header.depth == 32 && (header.color_mode == CM_GRAYSCALE || header.color_mode == CM_DUOTONE);
+    if (grayToRgb) {
+        imgHeader.color_mode = CM_RGB;
+        imgHeader.channel_count = alpha && header.channel_count > 1 ? 4 : 3;
+    }
+
+    const QImage::Format format = imageFormat(imgHeader, alpha, options.floatOutput);
+    if (format == QImage::Format_Invalid) {
+        qWarning() << "Unsupported image format. color_mode:" << header.color_mode << "depth:" << header.depth << "channel_count:" << header.channel_count;
+        return false;
+    }
+
+    // A thumbnail not smaller than the requested size avoids decoding the image data
+    // (but not when the float samples of a 32-bit image are requested): it has no
+    // transparency, so it is used only when the merged image has no alpha channel
+    // and no transparent color
+    const bool opaque = QImage::toPixelFormat(format).alphaUsage() == QPixelFormat::IgnoresAlpha && !irs.contains(IRI_TRANSPARENCYINDEX);
+    if (opaque && options.scaledSize.isValid() && !options.clipRect.isValid() && !(options.floatOutput && header.depth == 32)) {
+        auto thumb = thumbnail(irs);
+        if (!thumb.isNull() && thumb.width() >= options.scaledSize.width() && thumb.height() >= options.scaledSize.height()) {
+            img = thumb.scaled(options.scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            if (img.isNull()) {
+                return false;
+            }
+            // the metadata of the image: the thumbnail is RGB, so only the
+            // profile of an RGB image can be used, the others are sRGB
+            setResolution(img, irs);
+            if (header.color_mode != CM_RGB || !setColorSpace(img, irs)) {
+                img.setColorSpace(QColorSpace(QColorSpace::SRgb));
+            }
+            setXmpData(img, irs);
+            return true;
+        }
+    }
+
+    // Only the lines and the samples of the clip rectangle are decoded, and the
+    // scaled size is approached by an integer factor: the lines are skipped and
+    // the samples averaged. Bitmap lines are decoded whole and cropped later.
+    QRect area(0, 0, header.width, header.height);
+    if (options.clipRect.isValid()) {
+        area = area.intersected(options.clipRect);
+        if (area.isEmpty()) {
+            qWarning() << "LoadPSD() the clip rectangle is outside the image" << options.clipRect;
+            return false;
+        }
+    }
+    auto decodeArea = header.depth == 1 ? QRect(0, area.top(), header.width, area.height()) : area;
+    qint32 factor = 1;
+    if (!options.scaledSize.isEmpty() && header.depth > 1) {
+        factor = std::max(1, std::min(area.width() / options.scaledSize.width(), area.height() / options.scaledSize.height()));
+    }
+
+    img = imageAlloc(decodeArea.width() / factor, decodeArea.height() / factor, format);
+    if (img.isNull()) {
+        qWarning() << "Failed to allocate image, invalid dimensions?" << QSize(header.width, header.height);
+        return false;
+    }
+    img.fill(qRgb(0, 0, 0));
+    if (!cmds.palette.isEmpty()) {
+        img.setColorTable(cmds.palette);
+        setTransparencyIndex(img, irs);
+    }
+
+    if (header.height > kMaxQVectorSize / header.channel_count / sizeof(quint32)) {
+        qWarning() << "LoadPSD() header height/channel_count too big" << header.height << header.channel_count;
+        return false;
+    }
+
+    auto raw_count = qsizetype(header.width * header.depth + 7) / 8;
+    QVector<PSDChannelStrides> channels(header.channel_count);
+    ImageData data;
+    if (compression > 1) {
+#ifdef PSD_HAVE_ZLIB
+        // ZIP: all planes are a single stream in the image data section, which
+        // takes the rest of the file. It is inflated while read from the device.
+        auto device = stream.device();
+        QByteArray chunk;
+        auto read = [device, &chunk](const char **p, qint64 maxSize) -> qint64 {
+            chunk.resize(qsizetype(maxSize));
+            *p = chunk.constData();
+            return device->read(chunk.data(), maxSize);
+        };
+        const qint64 size = device->isSequential() ? -1 : device->size() - device->pos();
+        QByteArray inflated;
+        if (!inflatePlanes(read, size, header.height * header.channel_count, raw_count, header.width, header.depth, compression, inflated)) {
+            return false;
+        }
+        quint64 offset = 0;
+        for (auto &&channel : channels) {
+            channel.inflated = inflated;
+            channel.sizes.fill(raw_count, header.height);
+            channel.offsets.resize(header.height);
+            for (auto &&v : channel.offsets) {
+                v = offset;
+                offset += raw_count;
+            }
+        }
+#else
+        qDebug() << "ZIP compression not supported";
+        return false;
+#endif
+    } else {
+        QVector<quint32> strides(header.height * header.channel_count, raw_count);
+        // Read the compressed stride sizes
+        if (compression) {
+            for (auto&& v : strides) {
+                if (isPsb) {
+                    stream >> v;
+                    continue;
                 }
+                quint16 tmp;
+                stream >> tmp;
+                v = tmp;
             }
         }
+
+        // calculate the offsets of each stride in the image data
+        quint64 dataSize = 0;
+        for (qint32 c = 0; c < header.channel_count; ++c) {
+            auto&& channel = channels[c];
+            channel.compression = compression;
+            channel.sizes = strides.mid(c * qsizetype(header.height), header.height);
+            channel.offsets.resize(header.height);
+            for (qint32 y = 0; y < qint32(header.height); ++y) {
+                channel.offsets[y] = dataSize;
+                dataSize += channel.sizes.at(y);
+            }
+        }
+
+        // Read the image data once: the strides are decoded from memory, with no seeks
+        if (!data.load(stream, qint64(dataSize))) {
+            qDebug() << "Error while reading the image data";
+            return false;
+        }
+    }
+
+    if (grayToRgb) {
+        QVector<PSDChannelStrides> rgb{channels.at(0), channels.at(0), channels.at(0)};
+        if (imgHeader.channel_count > 3)
+            rgb.append(channels.at(1));
+        channels = rgb;
+    }
+
+    if (!decodePlanes(imgHeader, alpha, data, channels, img, decodeArea, factor)) {
+        return false;
+    }
+    if (decodeArea != area) {
+        img = img.copy(area.translated(0, -area.top()));
     }
 
     // LAB conversion generates a sRGB image
@@ -1145,8 +1809,8 @@ static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
         // qDebug() << "No resolution info found!";
     }
 
-    // ICC profile
-    if (!setColorSpace(img, irs)) {
+    // ICC profile (a gray profile cannot be used by the RGB image)
+    if (grayToRgb || !setColorSpace(img, irs)) {
         // qDebug() << "No colorspace info set!";
     }
 
@@ -1165,9 +1829,640 @@ static bool LoadPSD(QDataStream &stream, const PSDHeader &header, QImage &img)
     return true;
 }
 
+/*!
+ * \brief layerChannelStrides
+ * Locates the lines of a layer channel in the image data of the layer.
+ * \param offset Offset of the channel in the image data.
+ * \param length Size of the channel image data (compression field included).
+ */
+static bool layerChannelStrides(const ImageData &data, qint64 offset, qint64 length, const PSDHeader &header, qsizetype raw_count, PSDChannelStrides &strides)
+{
+    if (length < 2 || offset + length > data.size()) {
+        return false;
+    }
+    auto p = reinterpret_cast<const uchar *>(data.data() + offset);
+    auto compression = qFromBigEndian<quint16>(p);
+    if (compression > 3) {
+        qDebug() << "Unknown compression type";
+        return false;
+    }
+
+    const qint32 height = header.height;
+    strides.sizes.resize(height);
+    strides.offsets.resize(height);
+    if (compression > 1) {
+#ifdef PSD_HAVE_ZLIB
+        // the lines are read from the inflated channel as uncompressed ones
+        strides.compression = 0;
+        strides.sizes.fill(raw_count);
+        for (qint32 y = 0; y < height; ++y) {
+            strides.offsets[y] = quint64(y) * raw_count;
+        }
+        return inflatePlanes(data.data() + offset + 2, length - 2, height, raw_count, header.width, header.depth, compression, strides.inflated);
+#else
+        qDebug() << "ZIP compression not supported";
+        return false;
+#endif
+    }
+
+    strides.compression = compression;
+    const bool isPsb = header.version == 2;
+    qint64 pos = 2;
+    if (strides.compression == 1) {
+        const qint64 entrySize = isPsb ? 4 : 2;
+        if (pos + height * entrySize > length) {
+            return false;
+        }
+        for (qint32 y = 0; y < height; ++y, pos += entrySize) {
+            strides.sizes[y] = isPsb ? qFromBigEndian<quint32>(p + pos) : qFromBigEndian<quint16>(p + pos);
+        }
+    } else {
+        strides.sizes.fill(raw_count);
+    }
+    for (qint32 y = 0; y < height; ++y) {
+        strides.offsets[y] = quint64(offset + pos);
+        pos += strides.sizes.at(y);
+    }
+    return pos <= length;
+}
+
+/*!
+ * \brief decodeLayer
+ * Decodes the image of the layer \a lr whose channel image data is at \a dataOffset.
+ */
+static bool decodeLayer(QDataStream &stream, const PSDHeader &header, const PSDColorModeDataSection &cmds, const PSDImageResourceSection &irs, const PSDLayerRecord &lr, qint64 dataOffset, QImage &img, bool floatOutput = false)
+{
+    if (lr.rect().isEmpty()) {
+        return false;
+    }
+
+    // the color channels, in order, followed by the transparency mask
+    auto indexOf = [&lr](qint16 id) -> qint32 {
+        for (qint32 i = 0, n = lr.channels.size(); i < n; ++i) {
+            if (lr.channels.at(i).id == id)
+                return i;
+        }
+        return -1;
+    };
+    qint32 colors = 1;
+    if (header.color_mode == CM_RGB || header.color_mode == CM_LABCOLOR) {
+        colors = 3;
+    } else if (header.color_mode == CM_CMYK) {
+        colors = 4;
+    } else if (header.color_mode == CM_MULTICHANNEL) {
+        colors = std::count_if(lr.channels.cbegin(), lr.channels.cend(), [](const PSDLayerChannel &c) { return c.id >= 0; });
+    }
+    QVector<qint32> order;
+    for (qint16 id = 0; id < colors; ++id) {
+        auto index = indexOf(id);
+        if (index < 0) {
+            qDebug() << "Missing layer channel" << id;
+            return false;
+        }
+        order.append(index);
+    }
+
+    PSDHeader layerHeader = header;
+    layerHeader.width = lr.rect().width();
+    layerHeader.height = lr.rect().height();
+    auto alphaIndex = indexOf(-1);
+    auto alpha = alphaIndex > -1 && header.color_mode != CM_INDEXED && header.color_mode != CM_BITMAP;
+    // Grayscale and Duotone: QImage has no gray with alpha and float gray formats
+    if (colors == 1 && header.color_mode != CM_INDEXED && (alpha || (floatOutput && header.depth == 32))) {
+        layerHeader.color_mode = CM_RGB;
+        order << order.first() << order.first();
+    }
+    if (alpha) {
+        order.append(alphaIndex);
+    }
+    layerHeader.channel_count = order.size();
+    if (!IsSupported(layerHeader)) {
+        return false;
+    }
+
+    const QImage::Format format = imageFormat(layerHeader, alpha, floatOutput);
+    if (format == QImage::Format_Invalid) {
+        qWarning() << "Unsupported layer format. color_mode:" << layerHeader.color_mode << "depth:" << layerHeader.depth << "channel_count:" << layerHeader.channel_count;
+        return false;
+    }
+    img = imageAlloc(layerHeader.width, layerHeader.height, format);
+    if (img.isNull()) {
+        qWarning() << "Failed to allocate image, invalid dimensions?" << QSize(layerHeader.width, layerHeader.height);
+        return false;
+    }
+    img.fill(qRgb(0, 0, 0));
+    if (!cmds.palette.isEmpty()) {
+        img.setColorTable(cmds.palette);
+        setTransparencyIndex(img, irs);
+    }
+
+    // Only the image data of the layer is read
+    if (!stream.device()->seek(dataOffset)) {
+        return false;
+    }
+    ImageData data;
+    if (!data.load(stream, lr.dataSize())) {
+        qDebug() << "Error while reading the layer image data";
+        return false;
+    }
+    QVector<qint64> channelOffsets;
+    qint64 offset = 0;
+    for (auto &&c : lr.channels) {
+        channelOffsets.append(offset);
+        offset += c.length;
+    }
+    auto raw_count = qsizetype(layerHeader.width * layerHeader.depth + 7) / 8;
+    QVector<PSDChannelStrides> channels(order.size());
+    for (qint32 c = 0, n = order.size(); c < n; ++c) {
+        auto index = order.at(c);
+        if (!layerChannelStrides(data, channelOffsets.at(index), lr.channels.at(index).length, layerHeader, raw_count, channels[c])) {
+            qDebug() << "Error while reading the layer channel" << lr.channels.at(index).id;
+            return false;
+        }
+    }
+
+    if (!decodePlanes(layerHeader, alpha, data, channels, img)) {
+        return false;
+    }
+
+    if (header.color_mode == CM_LABCOLOR) {
+#ifdef PSD_FAST_LAB_CONVERSION
+        img.setColorSpace(QColorSpace(QColorSpace::SRgbLinear));
+#else
+        img.setColorSpace(QColorSpace(QColorSpace::SRgb));
+#endif
+    }
+    setResolution(img, irs);
+    if (layerHeader.color_mode == header.color_mode) {
+        setColorSpace(img, irs);
+    }
+
+    img.setOffset(lr.rect().topLeft());
+    img.setText(QStringLiteral("LayerName"), lr.name);
+    img.setText(QStringLiteral("LayerOffset"), QStringLiteral("%1,%2").arg(lr.left).arg(lr.top));
+    const quint32 blendMode = qToBigEndian(lr.blendMode); // the key as written in the file, e.g. "norm"
+    img.setText(QStringLiteral("LayerBlendMode"), QString::fromLatin1(reinterpret_cast<const char *>(&blendMode), sizeof(blendMode)));
+    img.setText(QStringLiteral("LayerOpacity"), QString::number(lr.opacity));
+
+    return true;
+}
+
+/*!
+ * \brief readLayerSections
+ * Reads the sections, after the header, needed to decode the layers.
+ */
+static bool readLayerSections(QDataStream &stream, PSDColorModeDataSection &cmds, PSDImageResourceSection &irs)
+{
+    bool ok = false;
+    cmds = readColorModeDataSection(stream, &ok);
+    if (!ok) {
+        qDebug() << "Error while skipping Color Mode Data section";
+        return false;
+    }
+    irs = readImageResourceSection(stream, &ok);
+    if (!ok) {
+        qDebug() << "Error while reading Image Resources Section";
+        return false;
+    }
+    return true;
+}
+
+// Load a layer of the PSD image.
+static bool LoadPSDLayer(QDataStream &stream, const PSDHeader &header, const PSDReadOptions &options, qint64 recordOffset, qint64 dataOffset, QImage &img)
+{
+    PSDColorModeDataSection cmds;
+    PSDImageResourceSection irs;
+    if (!readLayerSections(stream, cmds, irs) || !stream.device()->seek(recordOffset)) {
+        return false;
+    }
+    bool ok = false;
+    auto lr = readLayerRecord(stream, header.version == 2, &ok);
+    if (!ok) {
+        qDebug() << "Error while reading the layer record";
+        return false;
+    }
+    return decodeLayer(stream, header, cmds, irs, lr, dataOffset, img, options.floatOutput);
+}
+
+/*!
+ * \brief compositionMode
+ * \return The QPainter composition mode of the blend mode \a key: the modes
+ * without an equivalent are drawn as normal.
+ */
+static QPainter::CompositionMode compositionMode(quint32 key)
+{
+    switch (key) {
+    case 0x6D756C20: // 'mul '
+        return QPainter::CompositionMode_Multiply;
+    case 0x7363726E: // 'scrn'
+        return QPainter::CompositionMode_Screen;
+    case 0x6F766572: // 'over'
+        return QPainter::CompositionMode_Overlay;
+    case 0x6461726B: // 'dark'
+        return QPainter::CompositionMode_Darken;
+    case 0x6C697465: // 'lite'
+        return QPainter::CompositionMode_Lighten;
+    case 0x64697620: // 'div ' (color dodge)
+        return QPainter::CompositionMode_ColorDodge;
+    case 0x69646976: // 'idiv' (color burn)
+        return QPainter::CompositionMode_ColorBurn;
+    case 0x684C6974: // 'hLit'
+        return QPainter::CompositionMode_HardLight;
+    case 0x734C6974: // 'sLit'
+        return QPainter::CompositionMode_SoftLight;
+    case 0x64696666: // 'diff'
+        return QPainter::CompositionMode_Difference;
+    case 0x736D7564: // 'smud' (exclusion)
+        return QPainter::CompositionMode_Exclusion;
+    case 0x6C646467: // 'lddg' (linear dodge)
+        return QPainter::CompositionMode_Plus;
+    default:
+        break;
+    }
+    return QPainter::CompositionMode_SourceOver;
+}
+
+/*!
+ * \brief ComposePSD
+ * Blends the visible layers, from the bottom one, to rebuild the merged image.
+ * \param layers Offsets of the record and of the channel image data of each layer.
+ * \note Layer masks, layer effects and group (folder) options are ignored.
+ */
+static bool ComposePSD(QDataStream &stream, const PSDHeader &header, const QVector<QPair<qint64, qint64>> &layers, QImage &img)
+{
+    PSDColorModeDataSection cmds;
+    PSDImageResourceSection irs;
+    if (layers.isEmpty() || !readLayerSections(stream, cmds, irs)) {
+        return false;
+    }
+
+    // the layers are blended by the raster engine on a premultiplied image
+    auto canvas = imageAlloc(header.width, header.height, header.depth > 8 ? QImage::Format_RGBA64_Premultiplied : QImage::Format_ARGB32_Premultiplied);
+    if (canvas.isNull()) {
+        qWarning() << "Failed to allocate image, invalid dimensions?" << QSize(header.width, header.height);
+        return false;
+    }
+    canvas.fill(Qt::transparent);
+
+    QPainter painter(&canvas);
+    QImage base;    // the layer to which the following clipped layers are clipped
+    bool baseVisible = false;
+    QColorSpace colorSpace;
+    for (auto &&layer : layers) {
+        bool ok = false;
+        if (!stream.device()->seek(layer.first)) {
+            return false;
+        }
+        stream.resetStatus(); // a layer skipped below may have left the stream in error
+        auto lr = readLayerRecord(stream, header.version == 2, &ok);
+        if (!ok) {
+            qDebug() << "Error while reading the layer record";
+            return false;
+        }
+
+        // flags bit 1: the layer is hidden (the hidden base also hides its clipped layers)
+        auto visible = (lr.flags & 2) == 0;
+        if (lr.clipping == 0) {
+            base = QImage();
+            baseVisible = visible;
+        }
+        if (!visible || !baseVisible || (lr.clipping != 0 && base.isNull())) {
+            continue;
+        }
+
+        // the empty layers (e.g. the group dividers) and the layers that cannot
+        // be decoded are skipped, with the layers clipped to them
+        QImage image;
+        if (!decodeLayer(stream, header, cmds, irs, lr, layer.second, image)) {
+            qDebug() << "Skipping the layer" << lr.name;
+            continue;
+        }
+        // a gray profile cannot be used by the RGB canvas
+        if (!colorSpace.isValid() && image.format() != QImage::Format_Grayscale8 && image.format() != QImage::Format_Grayscale16) {
+            colorSpace = image.colorSpace();
+        }
+        image.convertTo(canvas.format());
+        if (lr.clipping == 0) {
+            base = image;
+        } else {
+            // only the opaque part of the base layer is painted: the pixels
+            // outside the rectangle of the base are not changed by drawImage()
+            // and are cleared
+            const QRect baseRect(base.offset() - image.offset(), base.size());
+            QPainter clip(&image);
+            clip.setCompositionMode(QPainter::CompositionMode_DestinationIn);
+            clip.drawImage(baseRect.topLeft(), base);
+            clip.setClipRegion(QRegion(image.rect()).subtracted(baseRect));
+            clip.setCompositionMode(QPainter::CompositionMode_Clear);
+            clip.fillRect(image.rect(), Qt::transparent);
+        }
+
+        painter.setCompositionMode(compositionMode(lr.blendMode));
+        painter.setOpacity(lr.opacity / 255.0);
+        painter.drawImage(image.offset(), image);
+    }
+    painter.end();
+
+    img = canvas.convertToFormat(header.depth > 8 ? QImage::Format_RGBA64 : QImage::Format_RGBA8888);
+    img.setColorSpace(colorSpace);
+    setResolution(img, irs);
+    setXmpData(img, irs);
+
+    return true;
+}
+
+/*!
+ * \brief The PSDWriteInfo struct
+ * The layout of the written file.
+ */
+struct PSDWriteInfo {
+    PSDHeader header = PSDHeader();
+    qint32 colors = 0;          // number of color channels
+    bool alpha = false;
+    QVector<QByteArray> bands;  // the RLE compressed lines of each PSD_MIN_BAND_HEIGHT rows, row by row
+    QVector<quint32> lineSizes; // RLE compressed size of each line (channel * height + y)
+    QVector<quint32> lineOffsets; // offset of each line in the buffer of its band
+    QVector<qint64> channelSizes; // RLE compressed size of each channel
+};
+
+/*!
+ * \brief writeImageForm
+ * \return The image converted to a format whose channels are written as they are.
+ */
+static QImage writeImageForm(const QImage &image, PSDWriteInfo &info)
+{
+    auto &&header = info.header;
+    QImage img;
+    info.alpha = image.hasAlphaChannel();
+    if (image.format() == QImage::Format_Grayscale8 || image.format() == QImage::Format_Grayscale16) {
+        header.color_mode = CM_GRAYSCALE;
+        header.depth = image.depth();
+        info.colors = 1;
+        img = image;
+#if QT_VERSION >= QT_VERSION_CHECK(6, 8, 0)
+    } else if (image.format() == QImage::Format_CMYK8888) {
+        header.color_mode = CM_CMYK;
+        header.depth = 8;
+        info.colors = 4;
+        img = image;
+#endif
+    } else {
+        header.color_mode = CM_RGB;
+        header.depth = image.depth() > 32 ? 16 : 8;
+        info.colors = 3;
+        if (header.depth == 16)
+            img = image.convertToFormat(info.alpha ? QImage::Format_RGBA64 : QImage::Format_RGBX64);
+        else
+            img = image.convertToFormat(info.alpha ? QImage::Format_RGBA8888 : QImage::Format_RGB888);
+    }
+    header.signature = 0x38425053; // '8BPS'
+    header.version = img.width() > 30000 || img.height() > 30000 ? 2 : 1;
+    header.channel_count = info.colors + (info.alpha ? 1 : 0);
+    header.width = img.width();
+    header.height = img.height();
+    return img;
+}
+
+/*!
+ * \brief encodePlanes
+ * Compresses the lines of all channels: the bands of lines are compressed in parallel.
+ */
+static bool encodePlanes(const QImage &img, PSDWriteInfo &info)
+{
+    auto &&header = info.header;
+    const qint32 height = header.height;
+    const qint32 width = header.width;
+    const qint32 channels = header.channel_count;
+    const qint32 sampleSize = header.depth / 8;
+    const qint32 imgChannels = img.depth() / header.depth;
+    const bool invert = header.color_mode == CM_CMYK; // PSD stores the inverted inks
+    const auto raw_count = qsizetype(width) * sampleSize;
+
+    info.bands.resize((height + PSD_MIN_BAND_HEIGHT - 1) / PSD_MIN_BAND_HEIGHT);
+    info.lineSizes.resize(qsizetype(channels) * height);
+    info.lineOffsets.resize(qsizetype(channels) * height);
+    auto bands = info.bands.data();
+    auto lineSizes = info.lineSizes.data();
+    auto lineOffsets = info.lineOffsets.data();
+    auto bits = img.constBits();
+    auto bpl = qsizetype(img.bytesPerLine());
+    const auto packedSize = raw_count + (raw_count + 127) / 128; // the worst case
+
+    // the bands of processBands() are made of whole writer bands
+    auto encodeBand = [&](qint32 y0, qint32 y1) -> bool {
+        QByteArray plane(raw_count, Qt::Uninitialized);
+        QByteArray band;
+        quint32 offset = 0;
+        for (qint32 y = y0; y < y1; ++y) {
+            if (y % PSD_MIN_BAND_HEIGHT == 0) {
+                const auto rows = std::min(qint32(PSD_MIN_BAND_HEIGHT), y1 - y);
+                band = QByteArray(qsizetype(rows) * channels * packedSize, Qt::Uninitialized);
+                offset = 0;
+            }
+            auto line = bits + y * bpl;
+            for (qint32 c = 0; c < channels; ++c) {
+                if (sampleSize == 2) {
+                    auto s = reinterpret_cast<const quint16 *>(line) + c;
+                    auto t = reinterpret_cast<quint16 *>(plane.data());
+                    for (qint32 x = 0; x < width; ++x) {
+                        t[x] = xchg(s[x * imgChannels]);
+                    }
+                } else {
+                    auto s = line + c;
+                    auto t = reinterpret_cast<quint8 *>(plane.data());
+                    for (qint32 x = 0; x < width; ++x) {
+                        t[x] = s[x * imgChannels];
+                    }
+                    if (invert && c < info.colors) {
+                        for (qint32 x = 0; x < width; ++x) {
+                            t[x] = ~t[x];
+                        }
+                    }
+                }
+                auto size = compress(plane.constData(), raw_count, band.data() + offset);
+                lineSizes[c * qsizetype(height) + y] = quint32(size);
+                lineOffsets[c * qsizetype(height) + y] = offset;
+                offset += quint32(size);
+            }
+            if (y + 1 == y1 || (y + 1) % PSD_MIN_BAND_HEIGHT == 0) {
+                band.resize(offset);
+                band.squeeze();
+                bands[y / PSD_MIN_BAND_HEIGHT] = std::move(band);
+            }
+        }
+        return true;
+    };
+    if (!processBands(height, encodeBand)) {
+        return false;
+    }
+
+    info.channelSizes.fill(0, channels);
+    for (qint32 c = 0; c < channels; ++c) {
+        for (qint32 y = 0; y < height; ++y) {
+            info.channelSizes[c] += info.lineSizes.at(c * qsizetype(height) + y);
+        }
+    }
+    return true;
+}
+
+static void writeSize(QDataStream &s, qint64 size, bool psb)
+{
+    if (psb)
+        s << qint64(size);
+    else
+        s << quint32(size);
+}
+
+/*!
+ * \brief writeChannelLines
+ * Writes the RLE row table of the channels [c0, c1) followed by their lines.
+ */
+static void writeChannelLines(QDataStream &s, const PSDWriteInfo &info, qint32 c0, qint32 c1)
+{
+    const bool psb = info.header.version == 2;
+    const qsizetype height = info.header.height;
+    for (qint32 c = c0; c < c1; ++c) {
+        for (qsizetype y = 0; y < height; ++y) {
+            auto size = info.lineSizes.at(c * height + y);
+            if (psb)
+                s << quint32(size);
+            else
+                s << quint16(size);
+        }
+    }
+    for (qint32 c = c0; c < c1; ++c) {
+        for (qsizetype y = 0; y < height; ++y) {
+            auto &&band = info.bands.at(y / PSD_MIN_BAND_HEIGHT);
+            auto index = c * height + y;
+            s.writeRawData(band.constData() + info.lineOffsets.at(index), info.lineSizes.at(index));
+        }
+    }
+}
+
+/*!
+ * \brief writeImageResourceSection
+ * Writes the resolution and the ICC profile.
+ */
+static void writeImageResourceSection(QDataStream &s, const QImage &image)
+{
+    QByteArray irs;
+    QDataStream ds(&irs, QIODevice::WriteOnly);
+    ds.setByteOrder(QDataStream::BigEndian);
+    auto writeBlock = [&ds](quint16 id, const QByteArray &data) {
+        ds << quint32(S_8BIM) << id << quint16(0); // null name
+        ds << quint32(data.size());
+        ds.writeRawData(data.constData(), data.size());
+        if (data.size() % 2)
+            ds << quint8(0);
+    };
+
+    if (image.dotsPerMeterX() > 0 && image.dotsPerMeterY() > 0) {
+        QByteArray ba;
+        QDataStream rs(&ba, QIODevice::WriteOnly);
+        rs.setByteOrder(QDataStream::BigEndian);
+        // Fixed point pixels per inch, unit (1 = ppi) and display unit (1 = inches)
+        rs << qint32(qRound(image.dotsPerMeterX() * 0.0254 * 65536)) << quint16(1) << quint16(1);
+        rs << qint32(qRound(image.dotsPerMeterY() * 0.0254 * 65536)) << quint16(1) << quint16(1);
+        writeBlock(IRI_RESOLUTIONINFO, ba);
+    }
+
+    auto icc = image.colorSpace().iccProfile();
+    if (!icc.isEmpty()) {
+        writeBlock(IRI_ICCPROFILE, icc);
+    }
+
+    s << quint32(irs.size());
+    s.writeRawData(irs.constData(), irs.size());
+}
+
+/*!
+ * \brief writeLayerAndMaskSection
+ * Writes a single layer with the image: Background for opaque images.
+ * \note For images with alpha the layer count is negative: the first alpha
+ * channel of the merged image is its transparency.
+ */
+static void writeLayerAndMaskSection(QDataStream &s, const PSDWriteInfo &info)
+{
+    auto &&header = info.header;
+    const bool psb = header.version == 2;
+    const qint64 rowTableSize = qint64(header.height) * (psb ? 4 : 2);
+
+    const QByteArray name = info.alpha ? QByteArrayLiteral("Layer 0") : QByteArrayLiteral("Background");
+    QByteArray pascalName = char(name.size()) + name;
+    while (pascalName.size() % 4)
+        pascalName.append('\0');
+    const qint64 extraSize = 4 + 4 + pascalName.size();
+    const qint64 recordSize = 16 + 2 + header.channel_count * (2 + (psb ? 8 : 4)) + 12 + 4 + extraSize;
+    qint64 layerInfoSize = 2 + recordSize;
+    for (auto &&size : info.channelSizes)
+        layerInfoSize += 2 + rowTableSize + size;
+    const qint64 padding = layerInfoSize % 2;
+    layerInfoSize += padding;
+
+    writeSize(s, (psb ? 8 : 4) + layerInfoSize + 4, psb);
+    writeSize(s, layerInfoSize, psb);
+    s << qint16(info.alpha ? -1 : 1);
+
+    // layer record
+    s << qint32(0) << qint32(0) << qint32(header.height) << qint32(header.width);
+    s << quint16(header.channel_count);
+    for (qint32 c = 0; c < header.channel_count; ++c) {
+        s << qint16(c < info.colors ? c : -1);
+        writeSize(s, 2 + rowTableSize + info.channelSizes.at(c), psb);
+    }
+    s << quint32(S_8BIM) << quint32(0x6E6F726D); // 'norm'
+    s << quint8(255) << quint8(0) << quint8(0) << quint8(0); // opacity, clipping, flags and filler
+    s << quint32(extraSize);
+    s << quint32(0) << quint32(0); // no layer mask and blending ranges
+    s.writeRawData(pascalName.constData(), pascalName.size());
+
+    // channel image data
+    for (qint32 c = 0; c < header.channel_count; ++c) {
+        s << quint16(1); // RLE
+        writeChannelLines(s, info, c, c + 1);
+    }
+    if (padding)
+        s << quint8(0);
+
+    s << quint32(0); // no global layer mask info
+}
+
+// Save the PSD image.
+static bool SavePSD(QDataStream &s, const QImage &image)
+{
+    PSDWriteInfo info;
+    auto img = writeImageForm(image, info);
+    auto &&header = info.header;
+    if (img.isNull() || !IsSupported(header)) {
+        return false;
+    }
+    if (!encodePlanes(img, info)) {
+        return false;
+    }
+
+    s << header.signature << header.version;
+    for (int i = 0; i < 6; i++) {
+        s << quint8(0);
+    }
+    s << header.channel_count << header.height << header.width << header.depth << header.color_mode;
+
+    s << quint32(0); // no Color Mode Data
+    writeImageResourceSection(s, image);
+    writeLayerAndMaskSection(s, info);
+
+    // merged image data
+    s << quint16(1); // RLE
+    writeChannelLines(s, info, 0, header.channel_count);
+
+    return s.status() == QDataStream::Ok;
+}
+
 } // Private
 
 PSDHandler::PSDHandler()
+    : m_quality(-1)
+    , m_imageNumber(0)
+    , m_scanned(false)
 {
 }
 
@@ -1182,6 +2477,17 @@ bool PSDHandler::canRead() const
 
 bool PSDHandler::read(QImage *image)
 {
+    const Layer *layer = nullptr;
+    if (m_imageNumber > 0) {
+        if (!ensureScanned() || m_imageNumber > m_layers.size()) {
+            return false;
+        }
+        layer = &m_layers.at(m_imageNumber - 1);
+        if (!device()->seek(0)) {
+            return false;
+        }
+    }
+
     QDataStream s(device());
     s.setByteOrder(QDataStream::BigEndian);
 
@@ -1200,28 +2506,86 @@ bool PSDHandler::read(QImage *image)
         return false;
     }
 
+    PSDReadOptions options;
+    options.clipRect = m_clipRect;
+    options.scaledSize = m_scaledSize;
+    options.floatOutput = m_quality == PSD_QUALITY_FLOAT32;
+
     QImage img;
-    if (!LoadPSD(s, header, img)) {
-        //         qDebug() << "Error loading PSD file.";
-        return false;
+    bool merged = true;
+    bool clipped = false;   // LoadPSD() clips the merged image
+    if (layer) {
+        if (!LoadPSDLayer(s, header, options, layer->recordOffset, layer->dataOffset, img)) {
+            //         qDebug() << "Error loading PSD layer.";
+            return false;
+        }
+    } else if (LoadPSD(s, header, options, img, &merged)) {
+        clipped = true;
+    } else {
+        // files saved without "Maximize compatibility" have only the layers
+        if (merged || !composeLayers(img)) {
+            //         qDebug() << "Error loading PSD file.";
+            return false;
+        }
+    }
+
+    if (!clipped && m_clipRect.isValid()) {
+        img = img.copy(m_clipRect);
+    }
+    if (m_scaledSize.isValid() && img.size() != m_scaledSize) {
+        img = img.scaled(m_scaledSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
     }
 
     *image = img;
     return true;
 }
 
+bool PSDHandler::write(const QImage &image)
+{
+    QDataStream s(device());
+    s.setByteOrder(QDataStream::BigEndian);
+    return SavePSD(s, image);
+}
+
 bool PSDHandler::supportsOption(ImageOption option) const
 {
     if (option == QImageIOHandler::Size)
         return true;
+    if (option == QImageIOHandler::ScaledSize)
+        return true;
+    if (option == QImageIOHandler::ClipRect)
+        return true;
+    if (option == QImageIOHandler::Quality)
+        return true;
     return false;
 }
 
+void PSDHandler::setOption(ImageOption option, const QVariant &value)
+{
+    if (option == QImageIOHandler::ScaledSize) {
+        m_scaledSize = value.toSize();
+    }
+    if (option == QImageIOHandler::ClipRect) {
+        m_clipRect = value.toRect();
+    }
+    if (option == QImageIOHandler::Quality) {
+        bool ok = false;
+        auto q = value.toInt(&ok);
+        if (ok) {
+            m_quality = q;
+        }
+    }
+}
+
 QVariant PSDHandler::option(ImageOption option) const
 {
     QVariant v;
 
-    if (option == QImageIOHandler::Size) {
+    if (option == QImageIOHandler::Size && m_imageNumber > 0) {
+        if (ensureScanned() && m_imageNumber <= m_layers.size()) {
+            v = QVariant::fromValue(m_layers.at(m_imageNumber - 1).size);
+        }
+    } else if (option == QImageIOHandler::Size) {
         if (auto d = device()) {
             // transactions works on both random and sequential devices
             d->startTransaction();
@@ -1239,9 +2603,191 @@ QVariant PSDHandler::option(ImageOption option) const
         }
     }
 
+    if (option == QImageIOHandler::Quality) {
+        v = m_quality;
+    }
+
+    if (option == QImageIOHandler::ClipRect) {
+        v = m_clipRect;
+    }
+
+    if (option == QImageIOHandler::ScaledSize) {
+        v = m_scaledSize;
+    }
+
     return v;
 }
 
+int PSDHandler::currentImageNumber() const
+{
+    return m_imageNumber;
+}
+
+int PSDHandler::imageCount() const
+{
+    // the scan is skipped on sequential devices: only the merged image can be read
+    if (!ensureScanned()) {
+        return 1;
+    }
+    return m_layers.size() + 1;
+}
+
+bool PSDHandler::jumpToImage(int imageNumber)
+{
+    if (imageNumber < 0 || imageNumber >= imageCount()) {
+        return false;
+    }
+    if (imageNumber == 0 && m_imageNumber > 0 && !device()->seek(0)) {
+        return false;
+    }
+    m_imageNumber = imageNumber;
+    return true;
+}
+
+bool PSDHandler::jumpToNextImage()
+{
+    return jumpToImage(m_imageNumber + 1);
+}
+
+bool PSDHandler::composeLayers(QImage &image) const
+{
+    if (!ensureScanned() || !device()->seek(0)) {
+        return false;
+    }
+    QVector<QPair<qint64, qint64>> layers;
+    for (auto &&layer : m_records) {
+        layers.append(qMakePair(layer.recordOffset, layer.dataOffset));
+    }
+
+    QDataStream s(device());
+    s.setByteOrder(QDataStream::BigEndian);
+
+    PSDHeader header;
+    s >> header;
+    if (s.status() != QDataStream::Ok || !IsSupported(header)) {
+        return false;
+    }
+    return ComposePSD(s, header, layers, image);
+}
+
+bool PSDHandler::ensureScanned() const
+{
+    if (m_scanned) {
+        return true;
+    }
+
+    if (device()->isSequential()) {
+        return false;
+    }
+
+    auto *mutableThis = const_cast<PSDHandler *>(this);
+    mutableThis->m_layers.clear();
+    mutableThis->m_records.clear();
+
+    const auto oldPos = device()->pos();
+    auto cleanup = qScopeGuard([this, oldPos] {
+        device()->seek(oldPos);
+    });
+
+    device()->seek(0);
+
+    QDataStream s(device());
+    s.setByteOrder(QDataStream::BigEndian);
+
+    PSDHeader header;
+    s >> header;
+    if (s.status() != QDataStream::Ok || !IsSupported(header)) {
+        return false;
+    }
+    auto isPsb = header.version == 2;
+
+    // Color Mode Data and Image Resources sections
+    if (!skip_section(s) || !skip_section(s)) {
+        return false;
+    }
+
+    // Layer and Mask section: only the layer records are read
+    auto lmsSize = readSize(s, isPsb);
+    if (lmsSize <= 0) {
+        mutableThis->m_scanned = true;
+        return true;
+    }
+    const auto lmsEnd = device()->pos() + lmsSize;
+
+    // reads the records of a layer info: the channel image data of the layers
+    // follows the records, in the same order
+    auto scanLayerInfo = [&]() {
+        qint16 layerCount = 0;
+        s >> layerCount;
+        QVector<PSDLayerRecord> records;
+        QVector<qint64> recordOffsets;
+        for (qint32 i = 0, n = std::abs(layerCount); i < n; ++i) {
+            recordOffsets.append(device()->pos());
+            bool ok = false;
+            records.append(readLayerRecord(s, isPsb, &ok));
+            if (!ok) {
+                return false;
+            }
+        }
+
+        auto dataOffset = device()->pos();
+        for (qint32 i = 0, n = records.size(); i < n; ++i) {
+            auto &&lr = records.at(i);
+            Layer layer;
+            layer.recordOffset = recordOffsets.at(i);
+            layer.dataOffset = dataOffset;
+            layer.size = lr.rect().size();
+            mutableThis->m_records.append(layer);
+            if (!lr.rect().isEmpty() && !lr.channels.isEmpty()) {
+                mutableThis->m_layers.append(layer);
+            }
+            dataOffset += lr.dataSize();
+        }
+        return true;
+    };
+
+    auto layerInfoSize = readSize(s, isPsb);
+    if (layerInfoSize < 0) {
+        return false;
+    }
+    const auto layerInfoEnd = device()->pos() + layerInfoSize;
+    if (layerInfoSize > 0 && !scanLayerInfo()) {
+        return false;
+    }
+
+    // the 16-bit and 32-bit documents store the layers in the Lr16 and Lr32
+    // additional layer information, after the global layer mask info
+    if (layerInfoSize == 0 && header.depth > 8) {
+        if (!device()->seek(layerInfoEnd) || !skip_section(s)) {
+            return false;
+        }
+        while (s.status() == QDataStream::Ok && device()->pos() + 12 <= lmsEnd) {
+            quint32 signature;
+            quint32 key;
+            s >> signature >> key;
+            if (signature != S_8BIM && signature != S_8B64) {
+                break;
+            }
+            auto size = readSize(s, signature == S_8B64 || (isPsb && hasLargeSize(key)));
+            if (size < 0 || device()->pos() + size > lmsEnd) {
+                break;
+            }
+            if (key == LI_LR16 || key == LI_LR32) {
+                if (size > 0 && !scanLayerInfo()) {
+                    return false;
+                }
+                break;
+            }
+            if (!skip_data(s, size)) {
+                break;
+            }
+        }
+    }
+
+    mutableThis->m_scanned = true;
+    return true;
+}
+
 bool PSDHandler::canRead(QIODevice *device)
 {
     if (!device) {
@@ -1257,25 +2803,31 @@ bool PSDHandler::canRead(QIODevice *device)
     PSDHeader header;
     s >> header;
 
+    // without the merged image, the layers are composed: this needs a random access device
+    auto ok = s.status() == QDataStream::Ok;
+    auto merged = true;
+    if (ok && device->isSequential() && IsSupported(header)) {
+        bool sectionOk = false;
+        readColorModeDataSection(s, &sectionOk);
+        if (sectionOk) {
+            auto irs = readImageResourceSection(s, &sectionOk);
+            merged = !sectionOk || hasMergedData(irs);
+        }
+    }
+
     device->rollbackTransaction();
 
-    if (s.status() != QDataStream::Ok) {
+    if (!ok || !merged) {
         return false;
     }
 
-    if (device->isSequential()) {
-        if (header.color_mode == CM_CMYK || header.color_mode == CM_LABCOLOR || header.color_mode == CM_MULTICHANNEL) {
-            return false;
-        }
-    }
-
     return IsSupported(header);
 }
 
 QImageIOPlugin::Capabilities PSDPlugin::capabilities(QIODevice *device, const QByteArray &format) const
 {
     if (format == "psd" || format == "psb" || format == "pdd" || format == "psdt") {
-        return Capabilities(CanRead);
+        return Capabilities(CanRead | CanWrite);
     }
     if (!format.isEmpty()) {
         return {};
@@ -1288,6 +2840,9 @@ QImageIOPlugin::Capabilities PSDPlugin::capabilities(QIODevice *device, const QB
     if (device->isReadable() && PSDHandler::canRead(device)) {
         cap |= CanRead;
     }
+    if (device->isWritable()) {
+        cap |= CanWrite;
+    }
     return cap;
 }
 
@@ -9,6 +9,9 @@
 #define KIMG_PSD_P_H
 
 #include <QImageIOPlugin>
+#include <QRect>
+#include <QSize>
+#include <QVector>
 
 class PSDHandler : public QImageIOHandler
 {
@@ -17,11 +20,85 @@ public:
 
     bool canRead() const override;
     bool read(QImage *image) override;
+    bool write(const QImage &image) override;
+
+    int currentImageNumber() const override;
+    int imageCount() const override;
+    bool jumpToImage(int imageNumber) override;
+    bool jumpToNextImage() override;
 
     bool supportsOption(QImageIOHandler::ImageOption option) const override;
+    void setOption(QImageIOHandler::ImageOption option, const QVariant &value) override;
     QVariant option(QImageIOHandler::ImageOption option) const override;
 
     static bool canRead(QIODevice *device);
+
+private:
+    /*!
+     * \brief ensureScanned
+     * Reads the layer records, of the Layer Info or of the Lr16 and Lr32
+     * blocks of the 16-bit and 32-bit documents, to list the layers, once.
+     * \return False on sequential devices.
+     */
+    bool ensureScanned() const;
+
+    /*!
+     * \brief composeLayers
+     * Blends the visible layers when the file has no merged image.
+     * \return False on sequential devices.
+     */
+    bool composeLayers(QImage &image) const;
+
+    /*!
+     * \brief The Layer struct
+     * Position in the file of a layer: its image data is decoded only when read.
+     */
+    struct Layer {
+        qint64 recordOffset = 0;
+        qint64 dataOffset = 0;
+        QSize size;
+    };
+
+    /*!
+     * \brief m_clipRect
+     * Part of the image to decode: only the lines and the samples of the
+     * merged image inside it are decoded.
+     */
+    QRect m_clipRect;
+
+    /*!
+     * \brief m_scaledSize
+     * Size of the decoded image: the embedded thumbnail is used when it is
+     * not smaller than it, otherwise the merged image is decoded skipping
+     * lines and averaging samples by an integer factor and then scaled.
+     */
+    QSize m_scaledSize;
+
+    /*!
+     * \brief m_quality
+     * Selects the format of 32-bit images: 100 keeps the float samples,
+     * the default (-1) converts them to 16-bit integers.
+     * \note Float formats require Qt 6.2 or newer.
+     */
+    int m_quality;
+
+    int m_imageNumber;
+
+    bool m_scanned;
+
+    /*!
+     * \brief m_layers
+     * The layers with pixels, from the bottom one: image 0 is the merged
+     * image and image N is the layer N-1.
+     */
+    QVector<Layer> m_layers;
+
+    /*!
+     * \brief m_records
+     * All the layer records, also the empty ones (e.g. the group dividers)
+     * that end the clipping groups: used to compose the layers.
+     */
+    QVector<Layer> m_records;
 };
 
 class PSDPlugin : public QImageIOPlugin
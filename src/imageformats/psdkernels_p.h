@@ -0,0 +1,902 @@
+/*
+    Pixel conversion kernels of the PSD plugin.
+
+    SPDX-FileCopyrightText: 2022 Mirco Miranda <mircomir@outlook.com>
+    SPDX-FileCopyrightText: 2026 KDE Community
+
+    SPDX-License-Identifier: LGPL-2.0-or-later
+*/
+#ifndef PSDKERNELS_P_H
+#define PSDKERNELS_P_H
+
+#include "fastmath_p.h"
+
+#include <QDebug>
+#include <QtEndian>
+#include <QtGlobal>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+/* The fast LAB conversion converts the image to linear sRgb instead to sRgb.
+ * This should not be a problem because the Qt's QColorSpace supports the linear
+ * sRgb colorspace.
+ *
+ * Using linear conversion, the loading speed is slightly improved. Anyway, if you are using
+ * an software that discard color info, you should comment it.
+ *
+ * At the time I'm writing (07/2022), Gwenview and Krita supports linear sRgb but KDE
+ * preview creator does not. This is the why, for now, it is disabled.
+ */
+//#define PSD_FAST_LAB_CONVERSION
+
+/* The kernels which interleave the planes and convert Lab and CMYK to RGB have
+ * SIMD versions: SSE2, SSSE3 and AVX2 on x86 (GCC and Clang, selected at runtime)
+ * and NEON on ARM. They give the same results of the scalar versions, used
+ * on the other architectures and compilers.
+ * Build with PSD_DISABLE_SIMD to use the scalar versions only.
+ */
+#if !defined(PSD_DISABLE_SIMD) && defined(__SSE2__) && defined(__GNUC__)
+#define PSD_X86_KERNELS
+#include <immintrin.h>
+#define PSD_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define PSD_TARGET_AVX2 __attribute__((target("avx2")))
+#elif !defined(PSD_DISABLE_SIMD) && defined(__ARM_NEON)
+#define PSD_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+/*!
+ * \brief The PSDKernelSet enum
+ * The instruction sets of the kernels, from the slowest.
+ */
+enum class PSDKernelSet {
+    Scalar,
+    SSE2,
+    SSSE3,
+    AVX2,
+    NEON,
+};
+
+/*!
+ * \brief isKernelSetSupported
+ * \return True if the kernels of the set are built and the CPU runs them.
+ */
+inline bool isKernelSetSupported(PSDKernelSet set)
+{
+    switch (set) {
+    case PSDKernelSet::Scalar:
+        return true;
+#if defined(PSD_X86_KERNELS)
+    case PSDKernelSet::SSE2:
+        return true;
+    case PSDKernelSet::SSSE3: {
+        static const bool ssse3 = __builtin_cpu_supports("ssse3");
+        return ssse3;
+    }
+    case PSDKernelSet::AVX2: {
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        return avx2;
+    }
+#elif defined(PSD_NEON_KERNELS)
+    case PSDKernelSet::NEON:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/*!
+ * \brief bestKernelSet
+ * \return The fastest set supported by the CPU.
+ */
+inline PSDKernelSet bestKernelSet()
+{
+    static const PSDKernelSet best = []() {
+        const PSDKernelSet sets[] = {PSDKernelSet::NEON, PSDKernelSet::AVX2, PSDKernelSet::SSSE3, PSDKernelSet::SSE2};
+        for (auto set : sets) {
+            if (isKernelSetSupported(set)) {
+                return set;
+            }
+        }
+        return PSDKernelSet::Scalar;
+    }();
+    return best;
+}
+
+inline quint8 xchg(quint8 v) {
+    return v;
+}
+
+inline quint16 xchg(quint16 v) {
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    return quint16( (v>>8) | (v<<8) );
+#else
+    return v;   // never tested
+#endif
+}
+
+inline quint32 xchg(quint32 v) {
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    return quint32( (v>>24) | ((v & 0x00FF0000)>>8) | ((v & 0x0000FF00)<<8) | (v<<24) );
+#else
+    return v;  // never tested
+#endif
+}
+
+/*!
+ * \brief interleave
+ * Copies a channel to a chunky line with a stride known at compile time, so the
+ * compiler can vectorize the loop.
+ */
+template<class T, qint32 cn>
+inline void interleave(T *t, const T *s, qint32 width)
+{
+    for (qint32 x = 0; x < width; ++x) {
+        t[x*cn] = xchg(s[x]);
+    }
+}
+
+template<class T>
+inline void planarToChunchy(uchar *target, const char *source, qint32 width, qint32 c, qint32 cn)
+{
+    auto s = reinterpret_cast<const T*>(source);
+    auto t = reinterpret_cast<T*>(target) + c;
+    switch (cn) {
+    case 1:
+        // contiguous samples: the (SIMD) byte swap of Qt is used
+        qFromBigEndian<T>(s, width, t);
+        break;
+    case 3:
+        interleave<T, 3>(t, s, width);
+        break;
+    case 4:
+        interleave<T, 4>(t, s, width);
+        break;
+    case 5:
+        interleave<T, 5>(t, s, width);
+        break;
+    default:
+        for (qint32 x = 0; x < width; ++x) {
+            t[x*cn] = xchg(s[x]);
+        }
+        break;
+    }
+}
+
+#if defined(PSD_X86_KERNELS)
+inline __m128i bswap16Sse2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+
+/*!
+ * \brief planesToChunchySse2
+ * Interleaves 4 planes: the unpack instructions merge the planes two by two.
+ * \return The number of pixels converted.
+ */
+template<class T>
+inline qint32 planesToChunchySse2(uchar *target, const char *const *sources, qint32 width)
+{
+    constexpr qint32 step = 16 / sizeof(T);
+    auto t = reinterpret_cast<__m128i *>(target);
+    qint32 x = 0;
+    for (; x + step <= width; x += step, t += 4) {
+        auto r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[0] + x * sizeof(T)));
+        auto g = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[1] + x * sizeof(T)));
+        auto b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[2] + x * sizeof(T)));
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[3] + x * sizeof(T)));
+        if (sizeof(T) == 1) {
+            auto rgLo = _mm_unpacklo_epi8(r, g);
+            auto rgHi = _mm_unpackhi_epi8(r, g);
+            auto baLo = _mm_unpacklo_epi8(b, a);
+            auto baHi = _mm_unpackhi_epi8(b, a);
+            _mm_storeu_si128(t + 0, _mm_unpacklo_epi16(rgLo, baLo));
+            _mm_storeu_si128(t + 1, _mm_unpackhi_epi16(rgLo, baLo));
+            _mm_storeu_si128(t + 2, _mm_unpacklo_epi16(rgHi, baHi));
+            _mm_storeu_si128(t + 3, _mm_unpackhi_epi16(rgHi, baHi));
+        } else {
+            r = bswap16Sse2(r);
+            g = bswap16Sse2(g);
+            b = bswap16Sse2(b);
+            a = bswap16Sse2(a);
+            auto rgLo = _mm_unpacklo_epi16(r, g);
+            auto rgHi = _mm_unpackhi_epi16(r, g);
+            auto baLo = _mm_unpacklo_epi16(b, a);
+            auto baHi = _mm_unpackhi_epi16(b, a);
+            _mm_storeu_si128(t + 0, _mm_unpacklo_epi32(rgLo, baLo));
+            _mm_storeu_si128(t + 1, _mm_unpackhi_epi32(rgLo, baLo));
+            _mm_storeu_si128(t + 2, _mm_unpacklo_epi32(rgHi, baHi));
+            _mm_storeu_si128(t + 3, _mm_unpackhi_epi32(rgHi, baHi));
+        }
+    }
+    return x;
+}
+
+/*!
+ * \brief planesToChunchySsse3
+ * Interleaves 3 planes: each output register is made of the shuffled bytes of
+ * the planes (the shuffles of the 16-bit samples also swap their bytes).
+ * \return The number of pixels converted.
+ */
+template<class T>
+PSD_TARGET_SSSE3 inline qint32 planesToChunchySsse3(uchar *target, const char *const *sources, qint32 width)
+{
+    constexpr qint32 step = 16 / sizeof(T);
+    __m128i masks[3][3];
+    if (sizeof(T) == 1) {
+        masks[0][0] = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+        masks[0][1] = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+        masks[0][2] = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+        masks[1][0] = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+        masks[1][1] = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+        masks[1][2] = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+        masks[2][0] = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+        masks[2][1] = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+        masks[2][2] = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+    } else {
+        masks[0][0] = _mm_setr_epi8(1, 0, -1, -1, -1, -1, 3, 2, -1, -1, -1, -1, 5, 4, -1, -1);
+        masks[0][1] = _mm_setr_epi8(-1, -1, 1, 0, -1, -1, -1, -1, 3, 2, -1, -1, -1, -1, 5, 4);
+        masks[0][2] = _mm_setr_epi8(-1, -1, -1, -1, 1, 0, -1, -1, -1, -1, 3, 2, -1, -1, -1, -1);
+        masks[1][0] = _mm_setr_epi8(-1, -1, 7, 6, -1, -1, -1, -1, 9, 8, -1, -1, -1, -1, 11, 10);
+        masks[1][1] = _mm_setr_epi8(-1, -1, -1, -1, 7, 6, -1, -1, -1, -1, 9, 8, -1, -1, -1, -1);
+        masks[1][2] = _mm_setr_epi8(5, 4, -1, -1, -1, -1, 7, 6, -1, -1, -1, -1, 9, 8, -1, -1);
+        masks[2][0] = _mm_setr_epi8(-1, -1, -1, -1, 13, 12, -1, -1, -1, -1, 15, 14, -1, -1, -1, -1);
+        masks[2][1] = _mm_setr_epi8(11, 10, -1, -1, -1, -1, 13, 12, -1, -1, -1, -1, 15, 14, -1, -1);
+        masks[2][2] = _mm_setr_epi8(-1, -1, 11, 10, -1, -1, -1, -1, 13, 12, -1, -1, -1, -1, 15, 14);
+    }
+
+    auto t = reinterpret_cast<__m128i *>(target);
+    qint32 x = 0;
+    for (; x + step <= width; x += step, t += 3) {
+        const __m128i planes[3] = {
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[0] + x * sizeof(T))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[1] + x * sizeof(T))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(sources[2] + x * sizeof(T))),
+        };
+        for (int i = 0; i < 3; ++i) {
+            auto v = _mm_or_si128(_mm_shuffle_epi8(planes[0], masks[i][0]), _mm_shuffle_epi8(planes[1], masks[i][1]));
+            _mm_storeu_si128(t + i, _mm_or_si128(v, _mm_shuffle_epi8(planes[2], masks[i][2])));
+        }
+    }
+    return x;
+}
+
+/*!
+ * \brief planesToChunchyAvx2
+ * Interleaves 4 planes as planesToChunchySse2() does: the unpack instructions
+ * work on the two halves of the registers, which are reordered when stored.
+ * \return The number of pixels converted.
+ */
+template<class T>
+PSD_TARGET_AVX2 inline qint32 planesToChunchyAvx2(uchar *target, const char *const *sources, qint32 width)
+{
+    constexpr qint32 step = 32 / sizeof(T);
+    auto t = reinterpret_cast<__m256i *>(target);
+    qint32 x = 0;
+    for (; x + step <= width; x += step, t += 4) {
+        auto r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[0] + x * sizeof(T)));
+        auto g = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[1] + x * sizeof(T)));
+        auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[2] + x * sizeof(T)));
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sources[3] + x * sizeof(T)));
+        __m256i q0, q1, q2, q3;
+        if (sizeof(T) == 1) {
+            auto rgLo = _mm256_unpacklo_epi8(r, g);
+            auto rgHi = _mm256_unpackhi_epi8(r, g);
+            auto baLo = _mm256_unpacklo_epi8(b, a);
+            auto baHi = _mm256_unpackhi_epi8(b, a);
+            q0 = _mm256_unpacklo_epi16(rgLo, baLo);
+            q1 = _mm256_unpackhi_epi16(rgLo, baLo);
+            q2 = _mm256_unpacklo_epi16(rgHi, baHi);
+            q3 = _mm256_unpackhi_epi16(rgHi, baHi);
+        } else {
+            const auto swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                               1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+            r = _mm256_shuffle_epi8(r, swap);
+            g = _mm256_shuffle_epi8(g, swap);
+            b = _mm256_shuffle_epi8(b, swap);
+            a = _mm256_shuffle_epi8(a, swap);
+            auto rgLo = _mm256_unpacklo_epi16(r, g);
+            auto rgHi = _mm256_unpackhi_epi16(r, g);
+            auto baLo = _mm256_unpacklo_epi16(b, a);
+            auto baHi = _mm256_unpackhi_epi16(b, a);
+            q0 = _mm256_unpacklo_epi32(rgLo, baLo);
+            q1 = _mm256_unpackhi_epi32(rgLo, baLo);
+            q2 = _mm256_unpacklo_epi32(rgHi, baHi);
+            q3 = _mm256_unpackhi_epi32(rgHi, baHi);
+        }
+        // the low halves have the first half of the pixels
+        _mm256_storeu_si256(t + 0, _mm256_permute2x128_si256(q0, q1, 0x20));
+        _mm256_storeu_si256(t + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+        _mm256_storeu_si256(t + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+        _mm256_storeu_si256(t + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+    }
+    return x;
+}
+#endif // PSD_X86_KERNELS
+
+#if defined(PSD_NEON_KERNELS)
+/*!
+ * \brief planesToChunchyNeon
+ * Interleaves 3 or 4 planes with the structure stores.
+ * \return The number of pixels converted.
+ */
+template<class T>
+inline qint32 planesToChunchyNeon(uchar *target, const char *const *sources, qint32 cn, qint32 width)
+{
+    constexpr qint32 step = 16 / sizeof(T);
+    qint32 x = 0;
+    for (; x + step <= width; x += step) {
+        auto load = [&](qint32 c) {
+            return vld1q_u8(reinterpret_cast<const uint8_t *>(sources[c] + x * sizeof(T)));
+        };
+        if (sizeof(T) == 1 && cn == 4) {
+            const uint8x16x4_t v = {{load(0), load(1), load(2), load(3)}};
+            vst4q_u8(reinterpret_cast<uint8_t *>(target) + x * 4, v);
+        } else if (sizeof(T) == 1) {
+            const uint8x16x3_t v = {{load(0), load(1), load(2)}};
+            vst3q_u8(reinterpret_cast<uint8_t *>(target) + x * 3, v);
+        } else if (cn == 4) {
+            const uint16x8x4_t v = {{vreinterpretq_u16_u8(vrev16q_u8(load(0))),
+                                     vreinterpretq_u16_u8(vrev16q_u8(load(1))),
+                                     vreinterpretq_u16_u8(vrev16q_u8(load(2))),
+                                     vreinterpretq_u16_u8(vrev16q_u8(load(3)))}};
+            vst4q_u16(reinterpret_cast<uint16_t *>(target) + x * 4, v);
+        } else {
+            const uint16x8x3_t v = {{vreinterpretq_u16_u8(vrev16q_u8(load(0))),
+                                     vreinterpretq_u16_u8(vrev16q_u8(load(1))),
+                                     vreinterpretq_u16_u8(vrev16q_u8(load(2)))}};
+            vst3q_u16(reinterpret_cast<uint16_t *>(target) + x * 3, v);
+        }
+    }
+    return x;
+}
+#endif // PSD_NEON_KERNELS
+
+/*!
+ * \brief planesToChunchy
+ * Converts the big-endian planes of a line into a chunky line, all the channels at once.
+ * \param sources The planes of the channels.
+ * \param channels The number of planes.
+ * \param cn The number of channels of the target line: the ones without a plane are not written.
+ * \param set The instruction set: the kernels of the fastest set not above it are used.
+ */
+template<class T>
+inline void planesToChunchy(uchar *target, const char *const *sources, qint32 channels, qint32 cn, qint32 width, PSDKernelSet set = bestKernelSet())
+{
+    qint32 done = 0;
+    if (channels == cn && (cn == 3 || cn == 4) && (sizeof(T) == 1 || sizeof(T) == 2)) {
+#if defined(PSD_X86_KERNELS)
+        if (cn == 4 && set >= PSDKernelSet::AVX2 && set != PSDKernelSet::NEON) {
+            done = planesToChunchyAvx2<T>(target, sources, width);
+        } else if (cn == 4 && set >= PSDKernelSet::SSE2 && set != PSDKernelSet::NEON) {
+            done = planesToChunchySse2<T>(target, sources, width);
+        } else if (cn == 3 && set >= PSDKernelSet::SSSE3 && set != PSDKernelSet::NEON) {
+            done = planesToChunchySsse3<T>(target, sources, width);
+        }
+#elif defined(PSD_NEON_KERNELS)
+        if (set == PSDKernelSet::NEON) {
+            done = planesToChunchyNeon<T>(target, sources, cn, width);
+        }
+#else
+        Q_UNUSED(set)
+#endif
+    }
+
+    // the remaining pixels
+    if (done < width) {
+        const auto offset = done * qsizetype(sizeof(T));
+        for (qint32 c = 0; c < channels; ++c) {
+            planarToChunchy<T>(target + offset * cn, sources[c] + offset, width - done, c, cn);
+        }
+    }
+}
+
+template<class T>
+inline void cmykToRgbScalar(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha = false)
+{
+    auto s = reinterpret_cast<const T*>(source);
+    auto t = reinterpret_cast<T*>(target);
+    const quint32 max = std::numeric_limits<T>::max();
+
+    // The samples store the inverted inks (c = max * (1 - C)), so the conversion
+    // max * (1 - (C * (1 - K) + K)) is c * k / max: computed with integers it is
+    // rounded exactly as the floating point formula.
+    const bool copyAlpha = targetChannels == 4 && sourceChannels >= 5 && alpha;
+    for (qint32 w = 0; w < width; ++w) {
+        auto ps = s + sourceChannels * w;
+        const quint32 k = *(ps + 3);
+        auto pt = t + targetChannels * w;
+        *(pt + 0) = T((*(ps + 0) * k + max / 2) / max);
+        *(pt + 1) = T((*(ps + 1) * k + max / 2) / max);
+        *(pt + 2) = T((*(ps + 2) * k + max / 2) / max);
+        if (targetChannels == 4) {
+            *(pt + 3) = copyAlpha ? *(ps + 4) : T(max);
+        }
+    }
+}
+
+#if defined(PSD_X86_KERNELS)
+/* The SIMD versions of cmykToRgb convert the lines of 4 channels: the products
+ * c * k are computed in each pixel, the K channel included, and they are divided
+ * by max with the rounding of cmykToRgbScalar(): for the 8-bit samples, with
+ * x = c * k + 127, x / 255 is (x + 1 + (x >> 8)) >> 8 and for the 16-bit ones,
+ * with x = c * k + 32767, x / 65535 is (x + 1 + (x >> 16)) >> 16. The fourth
+ * channel is then replaced by the opaque alpha or dropped.
+ */
+inline __m128i div255Sse2(__m128i x)
+{
+    x = _mm_add_epi16(x, _mm_set1_epi16(127));
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+inline __m128i div65535Sse2(__m128i x)
+{
+    x = _mm_add_epi32(x, _mm_set1_epi32(32767));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(x, _mm_set1_epi32(1)), _mm_srli_epi32(x, 16)), 16);
+}
+
+/*!
+ * \brief cmykToRgbSse2
+ * The 8-bit pixels are widened to 16 bits, the 16-bit ones multiplied with
+ * _mm_mulhi_epu16() and _mm_mullo_epi16() to have the 32-bit products.
+ * \return The number of pixels converted.
+ */
+template<class T>
+inline qint32 cmykToRgbSse2(uchar *target, qint32 targetChannels, const char *source, qint32 width)
+{
+    constexpr qint32 step = 8 / sizeof(T);
+    // the RGB pixels are stored 4 channels at a time: the last one is written
+    // over the first channel of the following pixel, which must exist
+    const qint32 limit = targetChannels == 3 ? width - 1 : width;
+    qint32 w = 0;
+    for (; w + step <= limit; w += step) {
+        for (qint32 h = 0; h < 2; ++h) {
+            const qint32 x = w + h * step / 2;
+            auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + qsizetype(x) * 4 * sizeof(T)));
+            __m128i rgbx;
+            if (sizeof(T) == 1) {
+                auto lo = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+                auto hi = _mm_unpackhi_epi8(v, _mm_setzero_si128());
+                auto kLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                auto kHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                rgbx = _mm_packus_epi16(div255Sse2(_mm_mullo_epi16(lo, kLo)), div255Sse2(_mm_mullo_epi16(hi, kHi)));
+                rgbx = _mm_or_si128(rgbx, _mm_set1_epi32(qint32(0xFF000000)));
+            } else {
+                auto k = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                auto pLo = _mm_mullo_epi16(v, k);
+                auto pHi = _mm_mulhi_epu16(v, k);
+                auto q0 = div65535Sse2(_mm_unpacklo_epi16(pLo, pHi));
+                auto q1 = div65535Sse2(_mm_unpackhi_epi16(pLo, pHi));
+                // the quotients fit 16 bits: sign extended, the signed saturation keeps them
+                q0 = _mm_srai_epi32(_mm_slli_epi32(q0, 16), 16);
+                q1 = _mm_srai_epi32(_mm_slli_epi32(q1, 16), 16);
+                rgbx = _mm_or_si128(_mm_packs_epi32(q0, q1), _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1));
+            }
+            auto pt = target + qsizetype(x) * targetChannels * sizeof(T);
+            if (targetChannels == 4) {
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(pt), rgbx);
+            } else if (sizeof(T) == 1) {
+                for (qint32 p = 0; p < 4; ++p, rgbx = _mm_srli_si128(rgbx, 4)) {
+                    const qint32 px = _mm_cvtsi128_si32(rgbx);
+                    memcpy(pt + p * 3, &px, 4);
+                }
+            } else {
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(pt), rgbx);
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(pt + 6), _mm_srli_si128(rgbx, 8));
+            }
+        }
+    }
+    return w;
+}
+
+PSD_TARGET_AVX2 inline __m256i div255Avx2(__m256i x)
+{
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(127));
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)), _mm256_srli_epi16(x, 8)), 8);
+}
+
+PSD_TARGET_AVX2 inline __m256i div65535Avx2(__m256i x)
+{
+    x = _mm256_add_epi32(x, _mm256_set1_epi32(32767));
+    return _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(x, _mm256_set1_epi32(1)), _mm256_srli_epi32(x, 16)), 16);
+}
+
+/*!
+ * \brief cmykToRgbAvx2
+ * Converts the pixels as cmykToRgbSse2() does: the unpack and pack instructions
+ * work on the two halves of the registers, so the pixels keep their order.
+ * \return The number of pixels converted.
+ */
+template<class T>
+PSD_TARGET_AVX2 inline qint32 cmykToRgbAvx2(uchar *target, qint32 targetChannels, const char *source, qint32 width)
+{
+    constexpr qint32 step = 8 / sizeof(T);
+    const qint32 limit = targetChannels == 3 ? width - 1 : width;
+    qint32 w = 0;
+    for (; w + step <= limit; w += step) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + qsizetype(w) * 4 * sizeof(T)));
+        __m256i rgbx;
+        if (sizeof(T) == 1) {
+            auto lo = _mm256_unpacklo_epi8(v, _mm256_setzero_si256());
+            auto hi = _mm256_unpackhi_epi8(v, _mm256_setzero_si256());
+            auto kLo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            auto kHi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            rgbx = _mm256_packus_epi16(div255Avx2(_mm256_mullo_epi16(lo, kLo)), div255Avx2(_mm256_mullo_epi16(hi, kHi)));
+            rgbx = _mm256_or_si256(rgbx, _mm256_set1_epi32(qint32(0xFF000000)));
+        } else {
+            auto k = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+            auto pLo = _mm256_mullo_epi16(v, k);
+            auto pHi = _mm256_mulhi_epu16(v, k);
+            rgbx = _mm256_packus_epi32(div65535Avx2(_mm256_unpacklo_epi16(pLo, pHi)), div65535Avx2(_mm256_unpackhi_epi16(pLo, pHi)));
+            rgbx = _mm256_or_si256(rgbx, _mm256_set1_epi64x(qint64(0xFFFF000000000000)));
+        }
+        auto pt = target + qsizetype(w) * targetChannels * sizeof(T);
+        if (targetChannels == 4) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(pt), rgbx);
+            continue;
+        }
+        const __m128i halves[2] = {_mm256_castsi256_si128(rgbx), _mm256_extracti128_si256(rgbx, 1)};
+        for (const auto &half : halves) {
+            if (sizeof(T) == 1) {
+                auto h = half;
+                for (qint32 p = 0; p < 4; ++p, h = _mm_srli_si128(h, 4), pt += 3) {
+                    const qint32 px = _mm_cvtsi128_si32(h);
+                    memcpy(pt, &px, 4);
+                }
+            } else {
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(pt), half);
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(pt + 6), _mm_srli_si128(half, 8));
+                pt += 12;
+            }
+        }
+    }
+    return w;
+}
+#endif // PSD_X86_KERNELS
+
+#if defined(PSD_NEON_KERNELS)
+/*!
+ * \brief cmykToRgbNeon
+ * Splits the channels with the structure loads, multiplies them by K into
+ * the wider lanes and divides the products as cmykToRgbSse2() does.
+ * \return The number of pixels converted.
+ */
+template<class T>
+inline qint32 cmykToRgbNeon(uchar *target, qint32 targetChannels, const char *source, qint32 width)
+{
+    constexpr qint32 step = 8;
+    qint32 w = 0;
+    for (; w + step <= width; w += step) {
+        if (sizeof(T) == 1) {
+            const uint8x8x4_t v = vld4_u8(reinterpret_cast<const uint8_t *>(source) + w * 4);
+            auto mulDiv = [&](uint8x8_t c) {
+                auto x = vaddq_u16(vmull_u8(c, v.val[3]), vdupq_n_u16(127));
+                return vshrn_n_u16(vaddq_u16(vaddq_u16(x, vdupq_n_u16(1)), vshrq_n_u16(x, 8)), 8);
+            };
+            if (targetChannels == 4) {
+                const uint8x8x4_t rgba = {{mulDiv(v.val[0]), mulDiv(v.val[1]), mulDiv(v.val[2]), vdup_n_u8(0xFF)}};
+                vst4_u8(reinterpret_cast<uint8_t *>(target) + w * 4, rgba);
+            } else {
+                const uint8x8x3_t rgb = {{mulDiv(v.val[0]), mulDiv(v.val[1]), mulDiv(v.val[2])}};
+                vst3_u8(reinterpret_cast<uint8_t *>(target) + w * 3, rgb);
+            }
+        } else {
+            const uint16x8x4_t v = vld4q_u16(reinterpret_cast<const uint16_t *>(source) + w * 4);
+            auto div65535 = [](uint32x4_t x) {
+                x = vaddq_u32(x, vdupq_n_u32(32767));
+                return vshrn_n_u32(vaddq_u32(vaddq_u32(x, vdupq_n_u32(1)), vshrq_n_u32(x, 16)), 16);
+            };
+            auto mulDiv = [&](uint16x8_t c) {
+                auto lo = div65535(vmull_u16(vget_low_u16(c), vget_low_u16(v.val[3])));
+                auto hi = div65535(vmull_u16(vget_high_u16(c), vget_high_u16(v.val[3])));
+                return vcombine_u16(lo, hi);
+            };
+            if (targetChannels == 4) {
+                const uint16x8x4_t rgba = {{mulDiv(v.val[0]), mulDiv(v.val[1]), mulDiv(v.val[2]), vdupq_n_u16(0xFFFF)}};
+                vst4q_u16(reinterpret_cast<uint16_t *>(target) + w * 4, rgba);
+            } else {
+                const uint16x8x3_t rgb = {{mulDiv(v.val[0]), mulDiv(v.val[1]), mulDiv(v.val[2])}};
+                vst3q_u16(reinterpret_cast<uint16_t *>(target) + w * 3, rgb);
+            }
+        }
+    }
+    return w;
+}
+#endif // PSD_NEON_KERNELS
+
+/*!
+ * \brief cmykToRgb
+ * Converts a chunky line of CMYK pixels to RGB.
+ * \param set The instruction set: the kernels of the fastest set not above it are used.
+ * \note The SIMD kernels convert the lines without alpha (4 source channels) only.
+ */
+template<class T>
+inline void cmykToRgb(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha = false, PSDKernelSet set = bestKernelSet())
+{
+    if (sourceChannels < 4) {
+        qDebug() << "cmykToRgb: image is not a valid CMYK!";
+        return;
+    }
+
+    qint32 done = 0;
+    if (sourceChannels == 4 && (targetChannels == 3 || targetChannels == 4) && (sizeof(T) == 1 || sizeof(T) == 2)) {
+#if defined(PSD_X86_KERNELS)
+        if (set >= PSDKernelSet::AVX2 && set != PSDKernelSet::NEON) {
+            done = cmykToRgbAvx2<T>(target, targetChannels, source, width);
+        } else if (set >= PSDKernelSet::SSE2 && set != PSDKernelSet::NEON) {
+            done = cmykToRgbSse2<T>(target, targetChannels, source, width);
+        }
+#elif defined(PSD_NEON_KERNELS)
+        if (set == PSDKernelSet::NEON) {
+            done = cmykToRgbNeon<T>(target, targetChannels, source, width);
+        }
+#else
+        Q_UNUSED(set)
+#endif
+    }
+
+    // the remaining pixels
+    if (done < width) {
+        const auto t = target + qsizetype(done) * targetChannels * sizeof(T);
+        const auto s = source + qsizetype(done) * sourceChannels * sizeof(T);
+        cmykToRgbScalar<T>(t, targetChannels, s, sourceChannels, width - done, alpha);
+    }
+}
+
+inline double finv(double v)
+{
+    return (v > 6.0 / 29.0 ? v * v * v : (v - 16.0 / 116.0) / 7.787);
+}
+
+inline double gammaCorrection(double linear)
+{
+#ifdef PSD_FAST_LAB_CONVERSION
+    return linear;
+#else
+    // Replacing fastPow with std::pow the conversion time is 2/3 times longer: using fastPow
+    // there are minimal differences in the conversion that are not visually noticeable.
+    return (linear > 0.0031308 ? 1.055 * fastPow(linear, 1.0 / 2.4) - 0.055 : 12.92 * linear);
+#endif
+}
+
+template<class T>
+inline void labToRgbScalar(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha = false)
+{
+    auto s = reinterpret_cast<const T*>(source);
+    auto t = reinterpret_cast<T*>(target);
+    auto max = double(std::numeric_limits<T>::max());
+    auto invmax = 1.0 / max;
+
+    for (qint32 w = 0; w < width; ++w) {
+        auto ps = s + sourceChannels * w;
+        auto L = (*(ps + 0) * invmax) * 100.0;
+        auto A = (*(ps + 1) * invmax) * 255.0 - 128.0;
+        auto B = (*(ps + 2) * invmax) * 255.0 - 128.0;
+
+        // converting LAB to XYZ (D65 illuminant)
+        auto Y = (L + 16.0) * (1.0 / 116.0);
+        auto X = A * (1.0 / 500.0) + Y;
+        auto Z = Y - B * (1.0 / 200.0);
+
+        // NOTE: use the constants of the illuminant of the target RGB color space
+        X = finv(X) * 0.9504;   // D50: * 0.9642
+        Y = finv(Y) * 1.0000;   // D50: * 1.0000
+        Z = finv(Z) * 1.0888;   // D50: * 0.8251
+
+        // converting XYZ to sRGB (sRGB illuminant is D65)
+        auto r = gammaCorrection(  3.24071   * X - 1.53726  * Y - 0.498571  * Z);
+        auto g = gammaCorrection(- 0.969258  * X + 1.87599  * Y + 0.0415557 * Z);
+        auto b = gammaCorrection(  0.0556352 * X - 0.203996 * Y + 1.05707   * Z);
+
+        auto pt = t + targetChannels * w;
+        *(pt + 0) = T(std::max(std::min(r * max + 0.5, max), 0.0));
+        *(pt + 1) = T(std::max(std::min(g * max + 0.5, max), 0.0));
+        *(pt + 2) = T(std::max(std::min(b * max + 0.5, max), 0.0));
+        if (targetChannels == 4) {
+            if (sourceChannels >= 4 && alpha)
+                *(pt + 3) = *(ps + 3);
+            else
+                *(pt + 3) = std::numeric_limits<T>::max();
+        }
+    }
+}
+
+#if defined(PSD_X86_KERNELS)
+/* The SIMD versions of labToRgb compute the same double precision operations,
+ * in the same order, of labToRgbScalar() on 2 (SSE2) or 4 (AVX2) pixels at a time:
+ * the branches are replaced by masks and fastPow() works on the high 32 bits of
+ * the doubles as the scalar version does. The samples are loaded and stored by
+ * scalar code, which handles the strides and the alpha channel.
+ */
+inline __m128d selectSse2(__m128d mask, __m128d a, __m128d b)
+{
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+
+inline __m128d finvSse2(__m128d v)
+{
+    auto cube = _mm_mul_pd(_mm_mul_pd(v, v), v);
+    auto line = _mm_div_pd(_mm_sub_pd(v, _mm_set1_pd(16.0 / 116.0)), _mm_set1_pd(7.787));
+    return selectSse2(_mm_cmpgt_pd(v, _mm_set1_pd(6.0 / 29.0)), cube, line);
+}
+
+inline __m128d gammaCorrectionSse2(__m128d linear)
+{
+#ifdef PSD_FAST_LAB_CONVERSION
+    return linear;
+#else
+    // fastPow(linear, 1.0 / 2.4)
+    auto hi = _mm_shuffle_epi32(_mm_castpd_si128(linear), _MM_SHUFFLE(3, 1, 3, 1));
+    auto d = _mm_cvtepi32_pd(_mm_sub_epi32(hi, _mm_set1_epi32(1072632447)));
+    d = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.0 / 2.4), d), _mm_set1_pd(1072632447));
+    auto pow = _mm_castsi128_pd(_mm_unpacklo_epi32(_mm_setzero_si128(), _mm_cvttpd_epi32(d)));
+
+    auto curve = _mm_sub_pd(_mm_mul_pd(_mm_set1_pd(1.055), pow), _mm_set1_pd(0.055));
+    return selectSse2(_mm_cmpgt_pd(linear, _mm_set1_pd(0.0031308)), curve, _mm_mul_pd(_mm_set1_pd(12.92), linear));
+#endif
+}
+
+template<class T>
+inline qint32 labToRgbSse2(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha)
+{
+    auto s = reinterpret_cast<const T*>(source);
+    auto t = reinterpret_cast<T*>(target);
+    const auto max = double(std::numeric_limits<T>::max());
+    const auto vmax = _mm_set1_pd(max);
+    const auto invmax = _mm_set1_pd(1.0 / max);
+    const bool copyAlpha = targetChannels == 4 && sourceChannels >= 4 && alpha;
+
+    qint32 w = 0;
+    for (; w + 2 <= width; w += 2) {
+        auto ps = s + sourceChannels * w;
+        auto L = _mm_mul_pd(_mm_mul_pd(_mm_setr_pd(ps[0], ps[sourceChannels + 0]), invmax), _mm_set1_pd(100.0));
+        auto A = _mm_sub_pd(_mm_mul_pd(_mm_mul_pd(_mm_setr_pd(ps[1], ps[sourceChannels + 1]), invmax), _mm_set1_pd(255.0)), _mm_set1_pd(128.0));
+        auto B = _mm_sub_pd(_mm_mul_pd(_mm_mul_pd(_mm_setr_pd(ps[2], ps[sourceChannels + 2]), invmax), _mm_set1_pd(255.0)), _mm_set1_pd(128.0));
+
+        auto Y = _mm_mul_pd(_mm_add_pd(L, _mm_set1_pd(16.0)), _mm_set1_pd(1.0 / 116.0));
+        auto X = _mm_add_pd(_mm_mul_pd(A, _mm_set1_pd(1.0 / 500.0)), Y);
+        auto Z = _mm_sub_pd(Y, _mm_mul_pd(B, _mm_set1_pd(1.0 / 200.0)));
+
+        X = _mm_mul_pd(finvSse2(X), _mm_set1_pd(0.9504));
+        Y = _mm_mul_pd(finvSse2(Y), _mm_set1_pd(1.0000));
+        Z = _mm_mul_pd(finvSse2(Z), _mm_set1_pd(1.0888));
+
+        auto r = _mm_sub_pd(_mm_sub_pd(_mm_mul_pd(_mm_set1_pd(3.24071), X), _mm_mul_pd(_mm_set1_pd(1.53726), Y)), _mm_mul_pd(_mm_set1_pd(0.498571), Z));
+        auto g = _mm_add_pd(_mm_add_pd(_mm_mul_pd(_mm_set1_pd(-0.969258), X), _mm_mul_pd(_mm_set1_pd(1.87599), Y)), _mm_mul_pd(_mm_set1_pd(0.0415557), Z));
+        auto b = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(_mm_set1_pd(0.0556352), X), _mm_mul_pd(_mm_set1_pd(0.203996), Y)), _mm_mul_pd(_mm_set1_pd(1.05707), Z));
+
+        // std::max(std::min(v * max + 0.5, max), 0.0) truncated
+        const __m128d rgb[3] = {gammaCorrectionSse2(r), gammaCorrectionSse2(g), gammaCorrectionSse2(b)};
+        auto pt = t + targetChannels * w;
+        for (int c = 0; c < 3; ++c) {
+            auto v = _mm_max_pd(_mm_min_pd(_mm_add_pd(_mm_mul_pd(rgb[c], vmax), _mm_set1_pd(0.5)), vmax), _mm_setzero_pd());
+            auto i = _mm_cvttpd_epi32(v);
+            pt[c] = T(_mm_cvtsi128_si32(i));
+            pt[targetChannels + c] = T(_mm_cvtsi128_si32(_mm_shuffle_epi32(i, _MM_SHUFFLE(1, 1, 1, 1))));
+        }
+        if (targetChannels == 4) {
+            pt[3] = copyAlpha ? ps[3] : std::numeric_limits<T>::max();
+            pt[7] = copyAlpha ? ps[sourceChannels + 3] : std::numeric_limits<T>::max();
+        }
+    }
+    return w;
+}
+
+PSD_TARGET_AVX2 inline __m256d finvAvx2(__m256d v)
+{
+    auto cube = _mm256_mul_pd(_mm256_mul_pd(v, v), v);
+    auto line = _mm256_div_pd(_mm256_sub_pd(v, _mm256_set1_pd(16.0 / 116.0)), _mm256_set1_pd(7.787));
+    return _mm256_blendv_pd(line, cube, _mm256_cmp_pd(v, _mm256_set1_pd(6.0 / 29.0), _CMP_GT_OQ));
+}
+
+PSD_TARGET_AVX2 inline __m256d gammaCorrectionAvx2(__m256d linear)
+{
+#ifdef PSD_FAST_LAB_CONVERSION
+    return linear;
+#else
+    // fastPow(linear, 1.0 / 2.4)
+    auto odd = _mm256_permutevar8x32_epi32(_mm256_castpd_si256(linear), _mm256_setr_epi32(1, 3, 5, 7, 1, 3, 5, 7));
+    auto hi = _mm256_castsi256_si128(odd);
+    auto d = _mm256_cvtepi32_pd(_mm_sub_epi32(hi, _mm_set1_epi32(1072632447)));
+    d = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(1.0 / 2.4), d), _mm256_set1_pd(1072632447));
+    auto pow = _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_cvtepu32_epi64(_mm256_cvttpd_epi32(d)), 32));
+
+    auto curve = _mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(1.055), pow), _mm256_set1_pd(0.055));
+    return _mm256_blendv_pd(_mm256_mul_pd(_mm256_set1_pd(12.92), linear), curve, _mm256_cmp_pd(linear, _mm256_set1_pd(0.0031308), _CMP_GT_OQ));
+#endif
+}
+
+template<class T>
+PSD_TARGET_AVX2 inline qint32 labToRgbAvx2(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha)
+{
+    auto s = reinterpret_cast<const T*>(source);
+    auto t = reinterpret_cast<T*>(target);
+    const auto max = double(std::numeric_limits<T>::max());
+    const auto vmax = _mm256_set1_pd(max);
+    const auto invmax = _mm256_set1_pd(1.0 / max);
+    const bool copyAlpha = targetChannels == 4 && sourceChannels >= 4 && alpha;
+    const qint32 sc = sourceChannels;
+
+    qint32 w = 0;
+    for (; w + 4 <= width; w += 4) {
+        auto ps = s + sc * w;
+        auto L = _mm256_mul_pd(_mm256_mul_pd(_mm256_setr_pd(ps[0], ps[sc], ps[2 * sc], ps[3 * sc]), invmax), _mm256_set1_pd(100.0));
+        auto A = _mm256_mul_pd(_mm256_mul_pd(_mm256_setr_pd(ps[1], ps[sc + 1], ps[2 * sc + 1], ps[3 * sc + 1]), invmax), _mm256_set1_pd(255.0));
+        auto B = _mm256_mul_pd(_mm256_mul_pd(_mm256_setr_pd(ps[2], ps[sc + 2], ps[2 * sc + 2], ps[3 * sc + 2]), invmax), _mm256_set1_pd(255.0));
+        A = _mm256_sub_pd(A, _mm256_set1_pd(128.0));
+        B = _mm256_sub_pd(B, _mm256_set1_pd(128.0));
+
+        auto Y = _mm256_mul_pd(_mm256_add_pd(L, _mm256_set1_pd(16.0)), _mm256_set1_pd(1.0 / 116.0));
+        auto X = _mm256_add_pd(_mm256_mul_pd(A, _mm256_set1_pd(1.0 / 500.0)), Y);
+        auto Z = _mm256_sub_pd(Y, _mm256_mul_pd(B, _mm256_set1_pd(1.0 / 200.0)));
+
+        X = _mm256_mul_pd(finvAvx2(X), _mm256_set1_pd(0.9504));
+        Y = _mm256_mul_pd(finvAvx2(Y), _mm256_set1_pd(1.0000));
+        Z = _mm256_mul_pd(finvAvx2(Z), _mm256_set1_pd(1.0888));
+
+        auto r = _mm256_sub_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(3.24071), X), _mm256_mul_pd(_mm256_set1_pd(1.53726), Y)),
+                               _mm256_mul_pd(_mm256_set1_pd(0.498571), Z));
+        auto g = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(-0.969258), X), _mm256_mul_pd(_mm256_set1_pd(1.87599), Y)),
+                               _mm256_mul_pd(_mm256_set1_pd(0.0415557), Z));
+        auto b = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(0.0556352), X), _mm256_mul_pd(_mm256_set1_pd(0.203996), Y)),
+                               _mm256_mul_pd(_mm256_set1_pd(1.05707), Z));
+
+        // std::max(std::min(v * max + 0.5, max), 0.0) truncated
+        const __m256d rgb[3] = {gammaCorrectionAvx2(r), gammaCorrectionAvx2(g), gammaCorrectionAvx2(b)};
+        auto pt = t + targetChannels * w;
+        for (int c = 0; c < 3; ++c) {
+            auto v = _mm256_max_pd(_mm256_min_pd(_mm256_add_pd(_mm256_mul_pd(rgb[c], vmax), _mm256_set1_pd(0.5)), vmax), _mm256_setzero_pd());
+            alignas(16) qint32 i[4];
+            _mm_store_si128(reinterpret_cast<__m128i *>(i), _mm256_cvttpd_epi32(v));
+            for (int p = 0; p < 4; ++p) {
+                pt[targetChannels * p + c] = T(i[p]);
+            }
+        }
+        if (targetChannels == 4) {
+            for (int p = 0; p < 4; ++p) {
+                pt[targetChannels * p + 3] = copyAlpha ? ps[sc * p + 3] : std::numeric_limits<T>::max();
+            }
+        }
+    }
+    return w;
+}
+#endif // PSD_X86_KERNELS
+
+/*!
+ * \brief labToRgb
+ * Converts a chunky line of Lab pixels to RGB.
+ * \param set The instruction set: the kernels of the fastest set not above it are used.
+ * \note There are no NEON kernels: on ARM the compiler fuses the multiplications
+ * and the additions of the scalar code, so the results would not be the same.
+ */
+template<class T>
+inline void labToRgb(uchar *target, qint32 targetChannels, const char *source, qint32 sourceChannels, qint32 width, bool alpha = false, PSDKernelSet set = bestKernelSet())
+{
+    if (sourceChannels < 3) {
+        qDebug() << "labToRgb: image is not a valid LAB!";
+        return;
+    }
+
+    qint32 done = 0;
+#if defined(PSD_X86_KERNELS)
+    if (set >= PSDKernelSet::AVX2 && set != PSDKernelSet::NEON) {
+        done = labToRgbAvx2<T>(target, targetChannels, source, sourceChannels, width, alpha);
+    } else if (set >= PSDKernelSet::SSE2 && set != PSDKernelSet::NEON) {
+        done = labToRgbSse2<T>(target, targetChannels, source, sourceChannels, width, alpha);
+    }
+#else
+    Q_UNUSED(set)
+#endif
+
+    // the remaining pixels
+    if (done < width) {
+        const auto t = target + qsizetype(done) * targetChannels * sizeof(T);
+        const auto s = source + qsizetype(done) * sourceChannels * sizeof(T);
+        labToRgbScalar<T>(t, targetChannels, s, sourceChannels, width - done, alpha);
+    }
+}
+
+#endif // PSDKERNELS_P_H
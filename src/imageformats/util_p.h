@@ -10,7 +10,9 @@
 
 #include <limits>
 
+#include <QColorSpace>
 #include <QImage>
+#include <QThread>
 
 #if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
 #include <QImageIOHandler>
@@ -39,4 +41,38 @@ inline QImage imageAlloc(qint32 width, qint32 height, const QImage::Format &form
     return imageAlloc(QSize(width, height), format);
 }
 
+// Number of threads used by the plugins which decode in parallel: the
+// KIMAGEFORMATS_THREADS environment variable, read at every call, overrides
+// the number of cores (e.g. 1 decodes on the calling thread only).
+inline int decoderThreadCount()
+{
+    bool ok = false;
+    const int threads = qEnvironmentVariableIntValue("KIMAGEFORMATS_THREADS", &ok);
+    return qBound(1, ok && threads > 0 ? threads : QThread::idealThreadCount(), 64);
+}
+
+// Colorspace of the values of an image to encode: as Qt does, the images
+// without a colorspace are sRGB, except the float ones, which are linear.
+inline QColorSpace imageColorSpace(const QImage &image)
+{
+    const QColorSpace cs = image.colorSpace();
+    if (cs.isValid()) {
+        return cs;
+    }
+#if QT_VERSION >= QT_VERSION_CHECK(6, 2, 0)
+    switch (image.format()) {
+    case QImage::Format_RGBX16FPx4:
+    case QImage::Format_RGBA16FPx4:
+    case QImage::Format_RGBA16FPx4_Premultiplied:
+    case QImage::Format_RGBX32FPx4:
+    case QImage::Format_RGBA32FPx4:
+    case QImage::Format_RGBA32FPx4_Premultiplied:
+        return QColorSpace(QColorSpace::SRgbLinear);
+    default:
+        break;
+    }
+#endif
+    return QColorSpace(QColorSpace::SRgb);
+}
+
 #endif // UTIL_P_H
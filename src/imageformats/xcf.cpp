@@ -14,7 +14,9 @@
 #include <QImage>
 #include <QLoggingCategory>
 #include <QPainter>
+#include <QRunnable>
 #include <QStack>
+#include <QThreadPool>
 #include <QVector>
 #include <QtEndian>
 #include <QColorSpace>
@@ -22,6 +24,8 @@
 #include <QImageReader>
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <stdlib.h>
 #include <string.h>
 
@@ -32,6 +36,12 @@ Q_LOGGING_CATEGORY(XCFPLUGIN, "kf.imageformats.plugins.xcf", QtWarningMsg)
 
 const float INCHESPERMETER = (100.0f / 2.54f);
 
+//! Maximum number of bytes of tile data read at once from a level.
+const qint64 MAX_LEVEL_READ_SIZE = 64 * 1024 * 1024;
+
+//! Maximum size of an RLE compressed tile (RLE can occasionally expand a tile).
+const int MAX_TILE_RLE_SIZE = int(TILE_WIDTH * TILE_HEIGHT * 4 * 1.5);
+
 namespace
 {
 struct RandomTable {
@@ -80,6 +90,36 @@ struct RandomTable {
 
     int values[RANDOM_TABLE_SIZE]{};
 };
+
+/*!
+ * Calls \a func(k0, k1) for the ranges of tiles [k0, k1) which cover \a count tiles.
+ * When there is more than one range, they are processed in parallel.
+ * \return false if any call failed.
+ */
+template<class Func>
+bool processTiles(int count, Func func)
+{
+    const int threads = decoderThreadCount();
+    const int rangeSize = std::max(4, (count + threads * 4 - 1) / (threads * 4));
+    if (threads == 1 || rangeSize >= count) {
+        return func(0, count);
+    }
+
+    // a local pool to not interfere with the application pool
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    std::atomic<bool> ok(true);
+    for (int k = 0; k < count; k += rangeSize) {
+        const int k1 = std::min(k + rangeSize, count);
+        pool.start(QRunnable::create([&func, &ok, k, k1]() {
+            if (ok && !func(k, k1)) {
+                ok = false;
+            }
+        }));
+    }
+    pool.waitForDone();
+    return ok;
+}
 } // namespace {
 
 /*!
@@ -308,14 +348,13 @@ private:
         qint32 compositeSpace = 0; //!< What colorspace to use when compositing
         qint32 compositeMode = 0; //!< How to composite layer (union, clip, etc.)
 
-        //! As each tile is read from the file, it is buffered here.
-        uchar tile[TILE_WIDTH * TILE_HEIGHT * sizeof(QRgb)];
-
         //! The data from tile buffer is copied to the Tile by this
         //! method.  Depending on the type of the tile (RGB, Grayscale,
         //! Indexed) and use (image or mask), the bytes in the buffer are
         //! copied in different ways.
-        void (*assignBytes)(Layer &layer, uint i, uint j);
+        //! As each tile is read from the file, it is buffered in a
+        //! TILE_WIDTH * TILE_HEIGHT * sizeof(QRgb) bytes buffer.
+        void (*assignBytes)(Layer &layer, const uchar *tile, uint i, uint j);
 
         Layer(void)
             : name(nullptr)
@@ -413,14 +452,14 @@ private:
     void setGrayPalette(QImage &image);
     void setPalette(XCFImage &xcf_image, QImage &image);
     void setImageParasites(const XCFImage &xcf_image, QImage &image);
-    static void assignImageBytes(Layer &layer, uint i, uint j);
+    static void assignImageBytes(Layer &layer, const uchar *tile, uint i, uint j);
     bool loadHierarchy(QDataStream &xcf_io, Layer &layer);
     bool loadLevel(QDataStream &xcf_io, Layer &layer, qint32 bpp);
-    static void assignMaskBytes(Layer &layer, uint i, uint j);
+    static void assignMaskBytes(Layer &layer, const uchar *tile, uint i, uint j);
     bool loadMask(QDataStream &xcf_io, Layer &layer);
     bool loadChannelProperties(QDataStream &xcf_io, Layer &layer);
     bool initializeImage(XCFImage &xcf_image);
-    bool loadTileRLE(QDataStream &xcf_io, uchar *tile, int size, int data_length, qint32 bpp);
+    static bool loadTileRLE(const uchar *xcfodata, uchar *tile, int size, int data_length, qint32 bpp);
 
     static void copyLayerToImage(XCFImage &xcf_image);
     static void copyRGBToRGB(const Layer &layer, uint i, uint j, int k, int l, QImage &image, int m, int n);
@@ -1334,14 +1373,14 @@ void XCFImageFormat::setImageParasites(const XCFImage &xcf_image, QImage &image)
 /*!
  * Copy the bytes from the tile buffer into the image tile QImage, taking into
  * account all the myriad different modes.
- * \param layer layer containing the tile buffer and the image tile matrix.
+ * \param layer layer containing the image tile matrix.
+ * \param tile the tile buffer.
  * \param i column index of current tile.
  * \param j row index of current tile.
  */
-void XCFImageFormat::assignImageBytes(Layer &layer, uint i, uint j)
+void XCFImageFormat::assignImageBytes(Layer &layer, const uchar *tile, uint i, uint j)
 {
     QImage &image = layer.image_tiles[j][i];
-    const uchar *tile = layer.tile;
     const int width = image.width();
     const int height = image.height();
     const int bytesPerLine = image.bytesPerLine();
@@ -1546,72 +1585,174 @@ bool XCFImageFormat::loadLevel(QDataStream &xcf_io, Layer &layer, qint32 bpp)
         return true;
     }
 
-    for (uint j = 0; j < layer.nrows; j++) {
-        for (uint i = 0; i < layer.ncols; i++) {
-            if (offset == 0) {
-                qCDebug(XCFPLUGIN) << "XCF: incorrect number of tiles in layer " << layer.name;
-                return false;
-            }
+    switch (layer.compression) {
+    case COMPRESS_NONE:
+        if (xcf_io.version() > 11) {
+            qCDebug(XCFPLUGIN) << "Component reading not supported yet";
+            return false;
+        }
+        break;
+    case COMPRESS_RLE:
+        break;
+    default:
+        qCDebug(XCFPLUGIN) << "Unhandled compression" << layer.compression;
+        return false;
+    }
 
-            qint64 saved_pos = xcf_io.device()->pos();
-            qint64 offset2 = readOffsetPtr(xcf_io);
+    const int tile_size = TILE_WIDTH * TILE_HEIGHT * sizeof(QRgb);
+    const int data_size = bpp * TILE_WIDTH * TILE_HEIGHT;
+    if (data_size > tile_size) {
+        qCDebug(XCFPLUGIN) << "Tile data too big, we can only fit" << tile_size << "but need" << data_size;
+        return false;
+    }
 
-            if (offset2 < 0) {
-                qCDebug(XCFPLUGIN) << "XCF: negative level offset";
-                return false;
-            }
+    // Read the offsets of all the tiles up front: the last one is followed by 0
+    const int ntiles = layer.nrows * layer.ncols;
+    QVector<qint64> offsets(ntiles + 1);
+    offsets[0] = offset;
+    for (int k = 1; k <= ntiles; k++) {
+        offsets[k] = readOffsetPtr(xcf_io);
 
-            // Evidently, RLE can occasionally expand a tile instead of compressing it!
-            if (offset2 == 0) {
-                offset2 = offset + (uint)(TILE_WIDTH * TILE_HEIGHT * 4 * 1.5);
-            }
+        if (offsets[k] < 0) {
+            qCDebug(XCFPLUGIN) << "XCF: negative level offset";
+            return false;
+        }
 
-            xcf_io.device()->seek(offset);
+        if (k < ntiles && offsets[k] == 0) {
+            qCDebug(XCFPLUGIN) << "XCF: incorrect number of tiles in layer " << layer.name;
+            return false;
+        }
+    }
 
-            switch (layer.compression) {
-            case COMPRESS_NONE: {
-                if (xcf_io.version() > 11) {
-                    qCDebug(XCFPLUGIN) << "Component reading not supported yet";
-                    return false;
-                }
-                const int data_size = bpp * TILE_WIDTH * TILE_HEIGHT;
-                if (data_size > int(sizeof(layer.tile))) {
-                    qCDebug(XCFPLUGIN) << "Tile data too big, we can only fit" << sizeof(layer.tile) << "but need" << data_size;
-                    return false;
-                }
-                int dataRead = xcf_io.readRawData(reinterpret_cast<char *>(layer.tile), data_size);
-                if (dataRead < data_size) {
-                    qCDebug(XCFPLUGIN) << "short read, expected" << data_size << "got" << dataRead;
-                    return false;
-                }
+    auto dataLength = [&](int k) -> qint64 {
+        if (layer.compression == COMPRESS_NONE) {
+            return data_size;
+        }
+        // Evidently, RLE can occasionally expand a tile instead of compressing it!
+        if (offsets[k + 1] == 0) {
+            return MAX_TILE_RLE_SIZE;
+        }
+        return offsets[k + 1] - offsets[k];
+    };
+    auto dataEnd = [&](int k) -> qint64 {
+        return offsets[k] + qBound(qint64(0), dataLength(k), qint64(MAX_TILE_RLE_SIZE));
+    };
+
+    const qint64 device_size = xcf_io.device()->isSequential() ? -1 : xcf_io.device()->size();
+
+    // The loading stops at the first broken tile, as if the tiles were decoded
+    // in order: the tiles decoded in parallel after it are cleared as the ones
+    // not decoded, so that the image does not depend on the order of the
+    // threads and has no uninitialized tiles.
+    std::atomic<int> broken(ntiles);
+    auto setBroken = [&broken](int k) {
+        int b = broken;
+        while (k < b && !broken.compare_exchange_weak(b, k)) { }
+    };
+    auto clearTiles = [&](int k0) {
+        const QByteArray tile(tile_size, 0);
+        for (int k = k0; k < ntiles; k++) {
+            layer.assignBytes(layer, reinterpret_cast<const uchar *>(tile.constData()), uint(k) % layer.ncols, uint(k) / layer.ncols);
+        }
+    };
+
+    // The tiles are decoded in groups: the data of the whole group is read at
+    // once and then the tiles are decompressed and assigned in parallel.
+    for (int k0 = 0; k0 < ntiles;) {
+        qint64 begin = offsets[k0];
+        qint64 end = dataEnd(k0);
+        int k1 = k0 + 1;
+        for (; k1 < ntiles; k1++) {
+            const qint64 b = std::min(begin, offsets[k1]);
+            const qint64 e = std::max(end, dataEnd(k1));
+            if (e - b > MAX_LEVEL_READ_SIZE) {
                 break;
             }
-            case COMPRESS_RLE: {
-                int size = layer.image_tiles[j][i].width() * layer.image_tiles[j][i].height();
-                if (!loadTileRLE(xcf_io, layer.tile, size, offset2 - offset, bpp)) {
-                    return true;
+            begin = b;
+            end = e;
+        }
+        if (device_size > -1) {
+            end = std::max(begin, std::min(end, device_size));
+        }
+
+        QByteArray data(int(end - begin), Qt::Uninitialized);
+        int dataRead = 0;
+        if (!data.isEmpty() && xcf_io.device()->seek(begin)) {
+            dataRead = std::max(0, xcf_io.readRawData(data.data(), data.size()));
+        }
+
+        std::atomic<bool> shortRead(false);
+        // all the tiles of the ranges are decoded, also after a broken one
+        auto decodeTiles = [&](int t0, int t1) {
+            // each worker uses its own buffers
+            QByteArray tile(tile_size, 0);
+            QByteArray rle;
+            for (int k = t0; k < t1; k++) {
+                const uint i = uint(k) % layer.ncols;
+                const uint j = uint(k) / layer.ncols;
+                const qint64 pos = offsets[k] - begin;
+                const qint64 available = dataRead - pos;
+
+                switch (layer.compression) {
+                case COMPRESS_NONE: {
+                    if (available < data_size) {
+                        qCDebug(XCFPLUGIN) << "short read, expected" << data_size << "got" << std::max(qint64(0), available);
+                        shortRead = true;
+                        setBroken(k);
+                        continue;
+                    }
+                    memcpy(tile.data(), data.constData() + pos, data_size);
+                    break;
+                }
+                case COMPRESS_RLE: {
+                    const qint64 data_length = dataLength(k);
+                    if (data_length < 0 || data_length > MAX_TILE_RLE_SIZE) {
+                        qCDebug(XCFPLUGIN) << "XCF: invalid tile data length" << data_length;
+                        setBroken(k);
+                        continue;
+                    }
+                    if (available <= 0) {
+                        qCDebug(XCFPLUGIN) << "XCF: read failure on tile" << available;
+                        setBroken(k);
+                        continue;
+                    }
+                    const uchar *xcfodata = reinterpret_cast<const uchar *>(data.constData() + pos);
+                    if (available < data_length) {
+                        // the missing data at the end of the file is read as zeros
+                        rle.fill(0, int(data_length));
+                        memcpy(rle.data(), xcfodata, size_t(available));
+                        xcfodata = reinterpret_cast<const uchar *>(rle.constData());
+                    }
+                    const int size = layer.image_tiles[j][i].width() * layer.image_tiles[j][i].height();
+                    if (!loadTileRLE(xcfodata, reinterpret_cast<uchar *>(tile.data()), size, int(data_length), bpp)) {
+                        setBroken(k);
+                        continue;
+                    }
+                    break;
+                }
+                default:
+                    break;
                 }
-                break;
-            }
-            default:
-                qCDebug(XCFPLUGIN) << "Unhandled compression" << layer.compression;
-                return false;
-            }
-
-            // The bytes in the layer tile are juggled differently depending on
-            // the target QImage. The caller has set layer.assignBytes to the
-            // appropriate routine.
-
-            layer.assignBytes(layer, i, j);
 
-            xcf_io.device()->seek(saved_pos);
-            offset = readOffsetPtr(xcf_io);
+                // The bytes in the layer tile are juggled differently depending on
+                // the target QImage. The caller has set layer.assignBytes to the
+                // appropriate routine.
 
-            if (offset < 0) {
-                qCDebug(XCFPLUGIN) << "XCF: negative level offset";
-                return false;
+                layer.assignBytes(layer, reinterpret_cast<const uchar *>(tile.constData()), i, j);
             }
+        };
+
+        processTiles(k1 - k0, [&](int t0, int t1) {
+            decodeTiles(k0 + t0, k0 + t1);
+            return true;
+        });
+        if (broken < ntiles) {
+            // a broken RLE tile stops the loading, but what was read before it is kept
+            clearTiles(broken);
+            return !shortRead;
         }
+
+        k0 = k1;
     }
 
     return true;
@@ -1669,47 +1810,20 @@ bool XCFImageFormat::loadMask(QDataStream &xcf_io, Layer &layer)
  * The data is compressed with "run length encoding". Some simple data
  * integrity checks are made.
  *
- * \param xcf_io the data stream connected to the XCF image.
+ * \param xcfodata the RLE data read from the XCF image.
  * \param tile the buffer to expand the RLE into.
  * \param image_size number of bytes expected to be in the image tile.
  * \param data_length number of bytes expected in the RLE.
  * \param bpp number of bytes per pixel.
- * \return true if there were no I/O errors and no obvious corruption of
- * the RLE data.
+ * \return true if there was no obvious corruption of the RLE data.
+ * \note It is safe to call this function from multiple threads.
  */
-bool XCFImageFormat::loadTileRLE(QDataStream &xcf_io, uchar *tile, int image_size, int data_length, qint32 bpp)
+bool XCFImageFormat::loadTileRLE(const uchar *xcfodata, uchar *tile, int image_size, int data_length, qint32 bpp)
 {
     uchar *data;
 
-    uchar *xcfdata;
-    uchar *xcfodata;
-    uchar *xcfdatalimit;
-
-    if (data_length < 0 || data_length > int(TILE_WIDTH * TILE_HEIGHT * 4 * 1.5)) {
-        qCDebug(XCFPLUGIN) << "XCF: invalid tile data length" << data_length;
-        return false;
-    }
-
-    xcfdata = xcfodata = new uchar[data_length];
-
-    const int dataRead = xcf_io.readRawData((char *)xcfdata, data_length);
-    if (dataRead <= 0) {
-        delete[] xcfodata;
-        qCDebug(XCFPLUGIN) << "XCF: read failure on tile" << dataRead;
-        return false;
-    }
-
-    if (dataRead < data_length) {
-        memset(&xcfdata[dataRead], 0, data_length - dataRead);
-    }
-
-    if (!xcf_io.device()->isOpen()) {
-        delete[] xcfodata;
-        qCDebug(XCFPLUGIN) << "XCF: read failure on tile";
-        return false;
-    }
-
-    xcfdatalimit = &xcfodata[data_length - 1];
+    const uchar *xcfdata = xcfodata;
+    const uchar *xcfdatalimit = &xcfodata[data_length - 1];
 
     for (int i = 0; i < bpp; ++i) {
         data = tile + i;
@@ -1784,13 +1898,11 @@ bool XCFImageFormat::loadTileRLE(QDataStream &xcf_io, uchar *tile, int image_siz
         }
     }
 
-    delete[] xcfodata;
     return true;
 
 bogus_rle:
 
     qCDebug(XCFPLUGIN) << "The run length encoding could not be decoded properly";
-    delete[] xcfodata;
     return false;
 }
 
@@ -1877,14 +1989,14 @@ bool XCFImageFormat::loadChannelProperties(QDataStream &xcf_io, Layer &layer)
 
 /*!
  * Copy the bytes from the tile buffer into the mask tile QImage.
- * \param layer layer containing the tile buffer and the mask tile matrix.
+ * \param layer layer containing the mask tile matrix.
+ * \param tile the tile buffer.
  * \param i column index of current tile.
  * \param j row index of current tile.
  */
-void XCFImageFormat::assignMaskBytes(Layer &layer, uint i, uint j)
+void XCFImageFormat::assignMaskBytes(Layer &layer, const uchar *tile, uint i, uint j)
 {
     QImage &image = layer.mask_tiles[j][i];
-    uchar *tile = layer.tile;
     const int width = image.width();
     const int height = image.height();
     const int bytesPerLine = image.bytesPerLine();
@@ -0,0 +1,293 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Community
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+#include <limits>
+#include <memory>
+#include <stdio.h>
+
+#include <QBuffer>
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImageReader>
+#include <QProcess>
+#include <QTextStream>
+
+#include "format-enum.h"
+
+struct BenchmarkOptions {
+    QByteArray format;
+    int iterations = 10;
+    int quality = -1;
+    bool hasQuality = false;
+    QRect clipRect;
+    QSize scaledSize;
+    bool allImages = false;
+    QString fileName; // when not empty, the images are decoded from the file instead of a buffer
+};
+
+struct BenchmarkResult {
+    qint64 total = 0;
+    qint64 best = std::numeric_limits<qint64>::max();
+    int count = 0;
+    int images = 0;
+    qint64 pixels = 0;
+    QImage image;
+};
+
+static bool benchmark(const QByteArray &data, const BenchmarkOptions &opt, BenchmarkResult &res)
+{
+    for (int i = 0; i < opt.iterations; ++i) {
+        // a QFile lets the plugins map the file in memory
+        std::unique_ptr<QIODevice> device;
+        if (opt.fileName.isEmpty()) {
+            auto buffer = new QBuffer;
+            buffer->setData(data);
+            device.reset(buffer);
+        } else {
+            device.reset(new QFile(opt.fileName));
+        }
+        if (!device->open(QIODevice::ReadOnly)) {
+            QTextStream(stderr) << "Could not open the image: " << device->errorString() << '\n';
+            return false;
+        }
+
+        QImageReader reader(device.get(), opt.format);
+        if (opt.hasQuality) {
+            reader.setQuality(opt.quality);
+        }
+        if (opt.clipRect.isValid()) {
+            reader.setClipRect(opt.clipRect);
+        }
+        if (opt.scaledSize.isValid()) {
+            reader.setScaledSize(opt.scaledSize);
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+        res.image = reader.read();
+        res.images = 1;
+        res.pixels = qint64(res.image.width()) * res.image.height();
+        // e.g. the parts and the layers of a file
+        while (opt.allImages && !res.image.isNull() && reader.jumpToNextImage()) {
+            const QImage image = reader.read();
+            if (image.isNull()) {
+                break;
+            }
+            ++res.images;
+            res.pixels += qint64(image.width()) * image.height();
+        }
+        const qint64 elapsed = timer.nsecsElapsed();
+
+        if (res.image.isNull()) {
+            QTextStream(stderr) << "Could not read image: " << reader.errorString() << '\n';
+            return false;
+        }
+        res.total += elapsed;
+        res.best = std::min(res.best, elapsed);
+        ++res.count;
+    }
+    return true;
+}
+
+/*!
+ * \brief removeOption
+ * Removes an option and its value from the arguments.
+ */
+static void removeOption(QStringList &args, const QString &name)
+{
+    const int index = args.indexOf(name);
+    if (index > -1) {
+        args.erase(args.begin() + index, args.begin() + std::min(index + 2, int(args.size())));
+    }
+}
+
+/*!
+ * \brief measureChild
+ * Runs the benchmark in a child process: the plugins and their thread pools
+ * are initialized once per process.
+ * \return The best and the average time in seconds.
+ */
+static bool measureChild(const QStringList &args, const QProcessEnvironment &env, double &bestSecs, double &avgSecs)
+{
+    QProcess child;
+    child.setProcessEnvironment(env);
+    child.start(QCoreApplication::applicationFilePath(), QStringList(args) << QStringLiteral("--raw"));
+    if (!child.waitForFinished(-1) || child.exitCode() != 0) {
+        return false;
+    }
+    const QStringList values = QString::fromLatin1(child.readAllStandardOutput()).split(QLatin1Char(' '));
+    bestSecs = values.value(0).toDouble() / 1e9;
+    avgSecs = values.value(1).toDouble() / 1e9;
+    return bestSecs > 0;
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("imagebenchmark"));
+    QCoreApplication::setApplicationVersion(QStringLiteral("1.0.0.0"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Measures the decoding throughput of an image file"));
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument(QStringLiteral("image"), QStringLiteral("image file"));
+    QCommandLineOption informat(QStringList() << QStringLiteral("f") << QStringLiteral("file-format"),
+                                QStringLiteral("Image file format"),
+                                QStringLiteral("format"));
+    parser.addOption(informat);
+    QCommandLineOption iterations(QStringList() << QStringLiteral("n") << QStringLiteral("iterations"),
+                                  QStringLiteral("Number of decodes (default: 10)"),
+                                  QStringLiteral("count"),
+                                  QStringLiteral("10"));
+    parser.addOption(iterations);
+    QCommandLineOption quality(QStringList() << QStringLiteral("q") << QStringLiteral("quality"),
+                               QStringLiteral("Quality option passed to the reader"),
+                               QStringLiteral("quality"));
+    parser.addOption(quality);
+    QCommandLineOption clipRect(QStringList() << QStringLiteral("c") << QStringLiteral("clip-rect"),
+                                QStringLiteral("Clip rectangle passed to the reader"),
+                                QStringLiteral("x,y,width,height"));
+    parser.addOption(clipRect);
+    QCommandLineOption scaledSize(QStringList() << QStringLiteral("s") << QStringLiteral("scaled-size"),
+                                  QStringLiteral("Scaled size passed to the reader"),
+                                  QStringLiteral("widthxheight"));
+    parser.addOption(scaledSize);
+    QCommandLineOption pluginDir(QStringList() << QStringLiteral("p") << QStringLiteral("plugin-dir"),
+                                 QStringLiteral("Directory of the image plugins to measure (default: the plugins of this build)"),
+                                 QStringLiteral("dir"),
+                                 QStringLiteral(PLUGIN_DIR));
+    parser.addOption(pluginDir);
+    QCommandLineOption compare(QStringList() << QStringLiteral("compare"),
+                               QStringLiteral("Also measures the plugins in dir (e.g. a build of a previous revision) and prints the speedup"),
+                               QStringLiteral("dir"));
+    parser.addOption(compare);
+    QCommandLineOption fromFile(QStringList() << QStringLiteral("file"),
+                                QStringLiteral("Decodes from the file, as QImageReader does with a file name, instead of from a copy in memory"));
+    parser.addOption(fromFile);
+    QCommandLineOption threads(QStringList() << QStringLiteral("threads"),
+                               QStringLiteral("Measures the decoding with each number of threads in the list (e.g. 1,2,4,8) and prints the scaling"),
+                               QStringLiteral("list"));
+    parser.addOption(threads);
+    QCommandLineOption allImages(QStringList() << QStringLiteral("a") << QStringLiteral("all-images"),
+                                 QStringLiteral("Decodes all the images of the file (e.g. the parts and the layers)"));
+    parser.addOption(allImages);
+    QCommandLineOption raw(QStringList() << QStringLiteral("raw"), QStringLiteral("Prints only the best and the average time in nanoseconds"));
+    raw.setFlags(QCommandLineOption::HiddenFromHelp);
+    parser.addOption(raw);
+
+    parser.process(app);
+
+    const QStringList files = parser.positionalArguments();
+    if (files.count() != 1) {
+        QTextStream(stderr) << "Must provide exactly one file\n";
+        parser.showHelp(1);
+    }
+
+    QCoreApplication::addLibraryPath(parser.value(pluginDir));
+
+    // by default the file is loaded in memory to measure the decoder only
+    QFile file(files.at(0));
+    if (!file.open(QIODevice::ReadOnly)) {
+        QTextStream(stderr) << "Could not open " << files.at(0) << ": " << file.errorString() << '\n';
+        return 2;
+    }
+    const QByteArray data = file.readAll();
+    file.close();
+
+    BenchmarkOptions opt;
+    opt.format = parser.value(informat).toLatin1();
+    opt.iterations = std::max(1, parser.value(iterations).toInt());
+    if (parser.isSet(quality)) {
+        opt.hasQuality = true;
+        opt.quality = parser.value(quality).toInt();
+    }
+    if (parser.isSet(clipRect)) {
+        const QStringList values = parser.value(clipRect).split(QLatin1Char(','));
+        if (values.size() == 4) {
+            opt.clipRect = QRect(values.at(0).toInt(), values.at(1).toInt(), values.at(2).toInt(), values.at(3).toInt());
+        }
+    }
+    if (parser.isSet(scaledSize)) {
+        const QStringList values = parser.value(scaledSize).split(QLatin1Char('x'));
+        if (values.size() == 2) {
+            opt.scaledSize = QSize(values.at(0).toInt(), values.at(1).toInt());
+        }
+    }
+    opt.allImages = parser.isSet(allImages);
+    if (parser.isSet(fromFile)) {
+        opt.fileName = files.at(0);
+    }
+
+    // the arguments of the child processes
+    QStringList childArgs = app.arguments().mid(1);
+    removeOption(childArgs, QStringLiteral("--compare"));
+    removeOption(childArgs, QStringLiteral("--threads"));
+
+    if (parser.isSet(threads)) {
+        // the plugins read the number of threads from KIMAGEFORMATS_THREADS
+        QTextStream out(stdout);
+        double singleSecs = 0;
+        const QStringList counts = parser.value(threads).split(QLatin1Char(','));
+        for (const auto &count : counts) {
+            QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+            env.insert(QStringLiteral("KIMAGEFORMATS_THREADS"), count.trimmed());
+            double bestSecs = 0;
+            double avgSecs = 0;
+            if (!measureChild(childArgs, env, bestSecs, avgSecs)) {
+                QTextStream(stderr) << "Could not measure the decoding with " << count << " threads\n";
+                return 4;
+            }
+            if (singleSecs == 0) {
+                singleSecs = bestSecs;
+            }
+            out << "Threads: " << count.trimmed() << ", average " << avgSecs * 1e3 << " ms, best " << bestSecs * 1e3 << " ms, "
+                << data.size() / 1e6 / bestSecs << " MB/s, speedup " << singleSecs / bestSecs << "x\n";
+        }
+        return 0;
+    }
+
+    BenchmarkResult res;
+    if (!benchmark(data, opt, res)) {
+        return 3;
+    }
+
+    QTextStream out(stdout);
+    if (parser.isSet(raw)) {
+        out << res.best << ' ' << res.total / res.count << '\n';
+        return 0;
+    }
+
+    const double avgSecs = double(res.total) / res.count / 1e9;
+    const double bestSecs = double(res.best) / 1e9;
+    const double pixels = double(res.pixels);
+
+    out << "Image: " << res.image.width() << 'x' << res.image.height() << ' ' << formatToString(res.image.format()) << '\n';
+    if (res.images > 1) {
+        out << "Images: " << res.images << '\n';
+    }
+    out << "Decodes: " << res.count << ", average " << avgSecs * 1e3 << " ms, best " << bestSecs * 1e3 << " ms\n";
+    out << "Input: " << data.size() / 1e6 / bestSecs << " MB/s\n";
+    out << "Output: " << pixels / 1e6 / bestSecs << " Mpixel/s\n";
+
+    if (parser.isSet(compare)) {
+        // the plugins are loaded once per process: the other ones are measured by a child process
+        double baseBestSecs = 0;
+        double baseAvgSecs = 0;
+        const QStringList args = QStringList(childArgs) << QStringLiteral("--plugin-dir") << parser.value(compare);
+        if (!measureChild(args, QProcessEnvironment::systemEnvironment(), baseBestSecs, baseAvgSecs)) {
+            QTextStream(stderr) << "Could not measure the plugins in " << parser.value(compare) << '\n';
+            return 4;
+        }
+        out << "Compared to " << parser.value(compare) << ": average " << baseAvgSecs * 1e3 << " ms, best " << baseBestSecs * 1e3 << " ms\n";
+        out << "Input: " << data.size() / 1e6 / baseBestSecs << " MB/s, speedup " << baseBestSecs / bestSecs << "x\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+/*
+    SPDX-FileCopyrightText: 2026 KDE Community
+
+    SPDX-License-Identifier: LGPL-2.1-only OR LGPL-3.0-only OR LicenseRef-KDE-Accepted-LGPL
+*/
+
+/*
+ * Benchmark of the conversion kernels of the PSD plugin: every kernel is run
+ * on the same lines with each instruction set supported by the CPU, and the
+ * results are compared to the ones of the scalar code.
+ */
+
+#include <functional>
+#include <limits>
+#include <stdio.h>
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QTextStream>
+#include <QVector>
+
+#include "psdkernels_p.h"
+
+using Kernel = std::function<void(uchar *target, PSDKernelSet set)>;
+
+struct KernelResult {
+    qint64 best = std::numeric_limits<qint64>::max();
+    QByteArray output;
+};
+
+static const char *kernelSetName(PSDKernelSet set)
+{
+    switch (set) {
+    case PSDKernelSet::Scalar:
+        return "scalar";
+    case PSDKernelSet::SSE2:
+        return "sse2";
+    case PSDKernelSet::SSSE3:
+        return "ssse3";
+    case PSDKernelSet::AVX2:
+        return "avx2";
+    case PSDKernelSet::NEON:
+        return "neon";
+    }
+    return "";
+}
+
+static KernelResult runKernel(const Kernel &kernel, PSDKernelSet set, qsizetype outputSize, int iterations)
+{
+    KernelResult res;
+    res.output.resize(outputSize);
+    auto target = reinterpret_cast<uchar *>(res.output.data());
+    kernel(target, set); // warm up
+    for (int i = 0; i < iterations; ++i) {
+        QElapsedTimer timer;
+        timer.start();
+        kernel(target, set);
+        res.best = std::min(res.best, timer.nsecsElapsed());
+    }
+    return res;
+}
+
+static bool benchmark(const char *name, const Kernel &kernel, qsizetype outputSize, qint64 pixels, int iterations)
+{
+    const PSDKernelSet sets[] = {PSDKernelSet::Scalar, PSDKernelSet::SSE2, PSDKernelSet::SSSE3, PSDKernelSet::AVX2, PSDKernelSet::NEON};
+    bool ok = true;
+    KernelResult scalar;
+    for (auto set : sets) {
+        if (!isKernelSetSupported(set)) {
+            continue;
+        }
+        const auto res = runKernel(kernel, set, outputSize, iterations);
+        const double ns = double(res.best) / pixels;
+        const double mbs = outputSize * 1000.0 / std::max(res.best, qint64(1));
+        if (set == PSDKernelSet::Scalar) {
+            scalar = res;
+            printf("%-24s %-8s %8.3f ns/pixel %10.1f MB/s\n", name, kernelSetName(set), ns, mbs);
+            continue;
+        }
+        const bool same = res.output == scalar.output;
+        ok = ok && same;
+        printf("%-24s %-8s %8.3f ns/pixel %10.1f MB/s  x%.2f%s\n",
+               name,
+               kernelSetName(set),
+               ns,
+               mbs,
+               double(scalar.best) / std::max(res.best, qint64(1)),
+               same ? "" : "  DIFFERENT FROM SCALAR");
+    }
+    return ok;
+}
+
+static QByteArray randomData(qsizetype size)
+{
+    QByteArray ba(size, Qt::Uninitialized);
+    QRandomGenerator rng(7);
+    for (auto &&c : ba) {
+        c = char(rng.bounded(256));
+    }
+    return ba;
+}
+
+template<class T>
+static bool benchmarkPlanes(const char *name, qint32 channels, qint32 width, int iterations)
+{
+    QVector<QByteArray> planes;
+    QVector<const char *> sources;
+    for (qint32 c = 0; c < channels; ++c) {
+        planes << randomData(width * qsizetype(sizeof(T)));
+        sources << planes.last().constData();
+    }
+    auto kernel = [&](uchar *target, PSDKernelSet set) {
+        planesToChunchy<T>(target, sources.constData(), channels, channels, width, set);
+    };
+    return benchmark(name, kernel, width * channels * qsizetype(sizeof(T)), width, iterations);
+}
+
+template<class T>
+static bool benchmarkLab(const char *name, qint32 channels, qint32 width, int iterations)
+{
+    const QByteArray source = randomData(width * channels * qsizetype(sizeof(T)));
+    auto kernel = [&](uchar *target, PSDKernelSet set) {
+        labToRgb<T>(target, channels, source.constData(), channels, width, channels == 4, set);
+    };
+    return benchmark(name, kernel, width * channels * qsizetype(sizeof(T)), width, iterations);
+}
+
+template<class T>
+static bool benchmarkCmyk(const char *name, qint32 channels, qint32 width, int iterations)
+{
+    const QByteArray source = randomData(width * 4 * qsizetype(sizeof(T)));
+    auto kernel = [&](uchar *target, PSDKernelSet set) {
+        cmykToRgb<T>(target, channels, source.constData(), 4, width, false, set);
+    };
+    return benchmark(name, kernel, width * channels * qsizetype(sizeof(T)), width, iterations);
+}
+
+int main(int argc, char **argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("psdkernelbenchmark"));
+    QCoreApplication::setApplicationVersion(QStringLiteral("1.0.0"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Measures the conversion kernels of the PSD plugin with each supported instruction set."));
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption width(QStringList() << QStringLiteral("w") << QStringLiteral("width"),
+                             QStringLiteral("Number of pixels of the converted line (default: 1000000)."),
+                             QStringLiteral("pixels"),
+                             QStringLiteral("1000000"));
+    parser.addOption(width);
+    QCommandLineOption iterations(QStringList() << QStringLiteral("n") << QStringLiteral("iterations"),
+                                  QStringLiteral("Number of conversions of the line, the best time is shown (default: 20)."),
+                                  QStringLiteral("count"),
+                                  QStringLiteral("20"));
+    parser.addOption(iterations);
+
+    parser.process(app);
+
+    bool ok = false;
+    const qint32 w = parser.value(width).toInt(&ok);
+    if (!ok || w < 1) {
+        QTextStream(stderr) << "Invalid width: " << parser.value(width) << '\n';
+        return 1;
+    }
+    const int n = parser.value(iterations).toInt(&ok);
+    if (!ok || n < 1) {
+        QTextStream(stderr) << "Invalid number of iterations: " << parser.value(iterations) << '\n';
+        return 1;
+    }
+
+    printf("best kernel set: %s\n", kernelSetName(bestKernelSet()));
+
+    bool same = true;
+    same &= benchmarkPlanes<quint8>("planes to chunky 8x3", 3, w, n);
+    same &= benchmarkPlanes<quint8>("planes to chunky 8x4", 4, w, n);
+    same &= benchmarkPlanes<quint16>("planes to chunky 16x3", 3, w, n);
+    same &= benchmarkPlanes<quint16>("planes to chunky 16x4", 4, w, n);
+    same &= benchmarkLab<quint8>("lab to rgb 8", 3, w, n);
+    same &= benchmarkLab<quint8>("lab to rgb 8 (alpha)", 4, w, n);
+    same &= benchmarkLab<quint16>("lab to rgb 16", 3, w, n);
+    same &= benchmarkCmyk<quint8>("cmyk to rgb 8", 3, w, n);
+    same &= benchmarkCmyk<quint8>("cmyk to rgba 8", 4, w, n);
+    same &= benchmarkCmyk<quint16>("cmyk to rgb 16", 3, w, n);
+    same &= benchmarkCmyk<quint16>("cmyk to rgba 16", 4, w, n);
+
+    // the SIMD kernels must give the same pixels as the scalar code
+    return same ? 0 : 2;
+}